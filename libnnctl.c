@@ -1,8 +1,33 @@
+#define _GNU_SOURCE  /* dladdr, process_vm_readv, REG_RIP */
 #include <assert.h>
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <sched.h>
+#include <poll.h>
+#include <malloc.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <nanomsg/pubsub.h>
+#include <nanomsg/reqrep.h>
 #include "libnnctl.h"
+/* the hash tables count their memory under their own tag */
+#define uthash_malloc(sz) nnctl_mem_alloc(NNCTL_MEM_HASH, sz)
+#define uthash_free(ptr,sz) nnctl_mem_free(NNCTL_MEM_HASH, ptr)
 #include "libut.h"
 #include "tpl.h"
 
@@ -12,15 +37,321 @@ typedef struct {  // wraps a command structure
   void *data;
 } nnctl_cmd_w;
 
+/* a timer on the wheel. the wheel counts milliseconds of CLOCK_MONOTONIC
+ * and one timerfd is armed for its next due tick */
+struct _nnctl_timer {
+  utwheel_timer t;
+  nnctl *cp;
+  nnctl_timer_cb *cb;
+  void *data;
+};
+
+/* a watch subscription. the command line is run every interval seconds
+ * and its output published on the pub socket, prefixed by the topic */
+typedef struct {
+  char *topic;       // command words joined by a space; the hash key
+  nnctl_arg arg;     // the command words, passed to the command
+  unsigned interval; // seconds between publications
+  nnctl_timer *timer;// when the next publication is due
+  time_t expires;    // end of lease; each watch request renews it
+  struct nnctl_job *job; // its run on the pool, until that returns
+  UT_hash_handle hh;
+} nnctl_watch;
+
+#define NNCTL_WATCH_LEASE 60 /* seconds a subscription lives unrenewed */
+
+/* metrics. data-plane threads update their own slot of each metric with
+ * relaxed atomics; slots are cache-line aligned so threads never share a
+ * line. the control port sums the slots when the metrics command runs. */
+#define NNCTL_CACHELINE 64
+#define NNCTL_MAX_THREADS 64  /* threads beyond this share slots */
+
+typedef struct {
+  int64_t v;
+} __attribute__((aligned(NNCTL_CACHELINE))) nnctl_slot;
+
+typedef struct {
+  int64_t count;
+  int64_t sum;
+  int64_t b[NNCTL_HIST_BUCKETS];
+} __attribute__((aligned(NNCTL_CACHELINE))) nnctl_hslot;
+
+#define NNCTL_SHM_CAPACITY 512 /* metrics in the shared memory export */
+
+struct _nnctl_metric {
+  char *name;
+  int type;          // NNCTL_COUNTER, NNCTL_GAUGE or NNCTL_HISTOGRAM
+  void *slots;       // nnctl_slot or nnctl_hslot array
+  UT_hash_handle hh;
+};
+
+static __thread int nnctl_tidx = -1;  /* this thread's slot index */
+static int nnctl_nthreads;
+
+/* tracing. each thread records events into its own ring- like libut's
+ * ringbuf, but of fixed-size records, with a single lock-free producer
+ * that overwrites the oldest record. i counts the records ever written,
+ * and started the records begun, bumped before a slot is overwritten as a
+ * seqlock writer does; the consumer (the trace command) reads them without
+ * stopping the thread and drops any that were overwritten while it copied. */
+#define NNCTL_TRACE_EVENTS 16384 /* per thread; a power of two */
+
+typedef struct {
+  uint64_t tsc;
+  const char *name;
+  uint64_t ph;        // 'B', 'E' or 'i' as in the chrome trace format
+} nnctl_tev;
+
+typedef struct nnctl_tring {
+  struct nnctl_tring *next; // list of all rings
+  int owner;          // 1 while a live thread writes this ring
+  int tid;
+  uint64_t i;         // records written; only the owner stores it
+  uint64_t started;   // records begun; i, or i+1 while one is written
+  nnctl_tev d[NNCTL_TRACE_EVENTS];
+} nnctl_tring;
+
+static struct {
+  int on;
+  nnctl_tring *rings;
+  pthread_mutex_t mutex;  // protects the list of rings
+  pthread_key_t key;      // releases a thread's ring when it exits
+  pthread_once_t once;
+  uint64_t tsc0;          // timestamps are exported relative to this
+  double tsc_per_us;
+} nnctl_trace = { .mutex = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+static __thread nnctl_tring *nnctl_ring;
+
+/* sampling profiler. a SIGPROF timer on the process cpu clock interrupts
+ * whichever thread is running; the handler walks the frame pointer chain
+ * into a buffer preallocated by profile start. each sample is stored as
+ * its depth followed by that many pc's, leaf first. profile stop folds
+ * the samples into flamegraph input. */
+#define NNCTL_PROF_WORDS (1 << 20) /* sample buffer size */
+#define NNCTL_PROF_DEPTH 64        /* max frames per sample */
+
+static struct {
+  int on;
+  int active;           // handlers in progress
+  timer_t timer;
+  struct sigaction old; // SIGPROF disposition before profile start
+  uintptr_t *buf;
+  size_t n;             // words reserved in buf, by samples that fit
+  size_t dropped;       // samples that did not fit
+  int hz;
+} nnctl_prof;
+
+typedef struct {
+  char *stack;          // folded stack; the hash key
+  size_t count;
+  UT_hash_handle hh;
+} nnctl_folded;
+
+/* memory accounting. each tag counts its live bytes by malloc_usable_size,
+ * so a block needs no header and is freed by its size at free time. tpl is
+ * counted through tpl_hook, installed before main so that every block tpl
+ * frees was counted when it was allocated, and request maps through
+ * nnctl_tpl_alloc. */
+typedef struct {
+  const char *name;
+  int64_t live;      // bytes allocated now
+  int64_t peak;      // most bytes allocated at once
+  uint64_t allocs;   // allocations ever made
+  uint64_t bytes;    // bytes ever allocated
+  uint64_t last;     // bytes, as of the previous memory report
+} __attribute__((aligned(NNCTL_CACHELINE))) nnctl_memtag;
+
+static struct {
+  int ntags;
+  uint64_t last_ms;  // time of the previous memory report
+  nnctl_memtag tags[NNCTL_MEM_TAGS];
+} nnctl_mem = { .ntags = NNCTL_MEM_SESSIONS+1, .tags = {
+  [NNCTL_MEM_TPL] = {"tpl"}, [NNCTL_MEM_HASH] = {"hash"},
+  [NNCTL_MEM_REPLY] = {"reply"}, [NNCTL_MEM_SESSIONS] = {"sessions"} } };
+
+extern tpl_hook_t tpl_hook;
+
+/* an offloaded command. workers take jobs from the pending queue and put
+ * them on the done queue, then signal the eventfd; the owning thread sends
+ * the reply (or, for a watch, publishes the output) in nnctl_complete.
+ * a job with a deadline that passes is answered with a timeout reply and
+ * abandoned; its worker frees it when (if) the callback returns. */
+typedef struct nnctl_job {
+  nnctl_cmdf *cmdf;
+  void *data;
+  nnctl_arg arg;
+  uint64_t cookie;
+  void *control;     // raw socket header of the request, routes the reply
+  char *topic;       // set if the job runs a watch rather than a request
+  nnctl_watch *watch;// the watch, unless it ended while the job ran
+  UT_string out;
+  int state;         // NNCTL_JOB_PENDING, _RUNNING or _DONE
+  int sync;          // nnctl_exec waits for it, rather than nnctl_complete
+  int abandoned;     // its deadline passed while it ran
+  int cancelled;     // read by nnctl_cancelled
+  unsigned timeout;  // deadline, in milliseconds from the request
+  nnctl_timer *timer;// fires at the deadline (raw sockets)
+  int socket;        // to send the timeout reply on
+  int arg_tag;       // memory tag of the argument strings
+  size_t out_seen;   // size of out, as accounted
+  struct nnctl_job *next;
+} nnctl_job;
+
+#define NNCTL_JOB_PENDING 0
+#define NNCTL_JOB_RUNNING 1
+#define NNCTL_JOB_DONE    2
+
+#define NNCTL_WORKERS 2 /* threads in the offload pool, not counting stuck ones */
+
+/* internal command flag: runs on the thread that owns the control port */
+#define NNCTL_OWNER (1 << 30)
+
+/* the job running on this thread; its buffer takes the command output */
+static __thread nnctl_job *nnctl_tjob;
+
 struct _nnctl {
   nnctl_cmd_w *cmds; // hash table of commands
   void *data;        // opaque data pointer passed into commands
+  nnctl_watch *watches; // hash table of watch subscriptions
+  int pub_socket;    // NN_PUB socket for watch output, or -1
+  char *pub_addr;
+  nnctl_metric *metrics; // hash table of metrics
+  pthread_mutex_t metrics_mutex; // held to register or snapshot, not update
+  nnctl_shm_hdr *shm; // shared memory metrics export, or NULL
+  size_t shm_sz;
+  char *shm_path;
+  nnctl_timer *shm_timer; // refreshes the export every shm_ms
+  unsigned shm_ms;
+  utwheel wheel;     // timers, in milliseconds
+  int timer_fd;      // armed for the wheel's next due tick
+  uint64_t armed;    // the tick it is armed for, or UINT64_MAX
+  int event_fd;      // signaled when offloaded jobs are done
+  int nworkers;      // live worker threads, started on first use
+  int nstuck;        // workers running abandoned jobs
+  int stopping;
+  pthread_mutex_t job_mutex; // protects the job queues, counts and states
+  pthread_cond_t job_cond;   // signals pending jobs to workers
+  pthread_cond_t done_cond;  // signals finished sync jobs, exited workers
+  unsigned timeout;  // default deadline for commands, in ms, or 0
+  nnctl_metric *m_timeouts, *m_stuck, *m_watch_skips;
+  nnctl_job *pending, *pending_tail;
+  nnctl_job *done, *done_tail;
+  int running;       // control thread mode (nnctl_start_thread)
+  pthread_t thread;
+  int stop_fd;       // eventfd that tells the control thread to exit
+  int rep_socket;    // the control thread's REP socket
+  int cpu;           // pin the control thread here, or -1
   // below: used during command execution. only one command executes
   // at a time; nnctl_exec is designed to be used from one thread
   nnctl_arg arg;
   UT_string out;
+  size_t out_seen;   // size of out, as accounted
 };
 
+/* account a change in the size of a block from old to new bytes */
+static void mem_count(int tag, size_t old, size_t new) {
+  nnctl_memtag *t;
+  int64_t live, peak;
+
+  if ((tag < 0) || (tag >= NNCTL_MEM_TAGS)) return;
+  t = &nnctl_mem.tags[tag];
+  live = __atomic_add_fetch(&t->live, (int64_t)new - (int64_t)old, __ATOMIC_RELAXED);
+  if (new <= old) return;
+  if (old == 0) __atomic_fetch_add(&t->allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&t->bytes, new - old, __ATOMIC_RELAXED);
+  peak = __atomic_load_n(&t->peak, __ATOMIC_RELAXED);
+  while ((live > peak) && !__atomic_compare_exchange_n(&t->peak, &peak, live,
+    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+int nnctl_mem_tag(const char *name) {
+  int tag;
+
+  tag = __atomic_fetch_add(&nnctl_mem.ntags, 1, __ATOMIC_RELAXED);
+  if (tag >= NNCTL_MEM_TAGS) {
+    __atomic_fetch_sub(&nnctl_mem.ntags, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  if ( (nnctl_mem.tags[tag].name = strdup(name)) == NULL) exit(-1);
+  return tag;
+}
+
+void *nnctl_mem_alloc(int tag, size_t sz) {
+  void *p;
+
+  if ( (p = malloc(sz)) != NULL) mem_count(tag, 0, malloc_usable_size(p));
+  return p;
+}
+
+void *nnctl_mem_realloc(int tag, void *ptr, size_t sz) {
+  size_t old = malloc_usable_size(ptr);
+  void *p;
+
+  if (sz == 0) { nnctl_mem_free(tag, ptr); return NULL; }
+  if ( (p = realloc(ptr, sz)) == NULL) return NULL;
+  mem_count(tag, old, malloc_usable_size(p));
+  return p;
+}
+
+void nnctl_mem_free(int tag, void *ptr) {
+  if (ptr == NULL) return;
+  mem_count(tag, malloc_usable_size(ptr), 0);
+  free(ptr);
+}
+
+static void *mem_calloc(int tag, size_t sz) {
+  void *p;
+
+  if ( (p = nnctl_mem_alloc(tag, sz)) != NULL) memset(p, 0, sz);
+  return p;
+}
+
+static char *mem_strdup(int tag, const char *s) {
+  char *d;
+
+  if ( (d = nnctl_mem_alloc(tag, strlen(s)+1)) != NULL) strcpy(d, s);
+  return d;
+}
+
+static void *tpl_malloc(size_t sz) { return nnctl_mem_alloc(NNCTL_MEM_TPL, sz); }
+static void *tpl_realloc(void *ptr, size_t sz) { return nnctl_mem_realloc(NNCTL_MEM_TPL, ptr, sz); }
+static void tpl_mfree(void *ptr) { nnctl_mem_free(NNCTL_MEM_TPL, ptr); }
+
+/* request maps allocate through this regardless of the thread's tpl hooks,
+ * so the arguments they unpack can be freed by a worker */
+static void *tpl_amalloc(void *ctx, size_t sz) { return nnctl_mem_alloc(NNCTL_MEM_TPL, sz); }
+static void *tpl_arealloc(void *ctx, void *ptr, size_t sz) { return nnctl_mem_realloc(NNCTL_MEM_TPL, ptr, sz); }
+static void tpl_afree(void *ctx, void *ptr) { nnctl_mem_free(NNCTL_MEM_TPL, ptr); }
+static const tpl_alloc_t nnctl_tpl_alloc = { tpl_amalloc, tpl_arealloc, tpl_afree, NULL };
+
+/* an application that sets tpl_hook itself keeps its own allocator */
+__attribute__((constructor)) static void mem_hooks(void) {
+  if ((tpl_hook.malloc != malloc) || (tpl_hook.realloc != realloc) ||
+      (tpl_hook.free != free)) return;
+  tpl_hook.malloc = tpl_malloc;
+  tpl_hook.realloc = tpl_realloc;
+  tpl_hook.free = tpl_mfree;
+}
+
+/* utstring grows with plain realloc, so reply buffers are accounted by
+ * their size after a command has written to them */
+static void reply_note(UT_string *s, size_t *seen) {
+  if (s->n != *seen) mem_count(NNCTL_MEM_REPLY, *seen, s->n);
+  *seen = s->n;
+}
+
+/* free argument strings allocated under tag */
+static void free_arg(nnctl_arg *a, int tag) {
+  while(a->argv && a->argc) {
+    a->argc--;
+    nnctl_mem_free(tag, a->argv[a->argc]);
+  }
+  a->argc = 0;
+  if (a->argv) { free(a->argv); a->argv = NULL; }
+  if (a->lenv) { free(a->lenv); a->lenv = NULL; }
+}
+
 static int help_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
   UT_string *t;
   utstring_new(t);
@@ -45,23 +376,1103 @@ static int unknown_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie)
 // so we point to this record if we need to invoke it.
 static nnctl_cmd_w unknown_cmdw = {{"unknown",unknown_cmd}};
 
+static nnctl_cmd_w *find_cmd(nnctl *cp, char *name, size_t len) {
+  nnctl_cmd_w *cw;
+  HASH_FIND(hh, cp->cmds, name, len, cw);
+  return cw ? cw : &unknown_cmdw;
+}
+
+static time_t nnctl_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static uint64_t nnctl_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void free_watch(nnctl *cp, nnctl_watch *w) {
+  HASH_DEL(cp->watches, w);
+  pthread_mutex_lock(&cp->job_mutex);
+  if (w->job) w->job->watch = NULL;
+  pthread_mutex_unlock(&cp->job_mutex);
+  nnctl_timer_free(w->timer);
+  free_arg(&w->arg, NNCTL_MEM_SESSIONS);
+  nnctl_mem_free(NNCTL_MEM_SESSIONS, w->topic);
+  nnctl_mem_free(NNCTL_MEM_SESSIONS, w);
+}
+
+/* copy the arguments of src from index first onward, as session memory */
+static void copy_arg(nnctl_arg *dst, nnctl_arg *src, int first) {
+  int i;
+
+  dst->argc = src->argc - first;
+  dst->argv = calloc(dst->argc, sizeof(char*));
+  dst->lenv = calloc(dst->argc, sizeof(size_t));
+  if (!dst->argv || !dst->lenv) exit(-1);
+  for(i=0; i < dst->argc; i++) {
+    dst->argv[i] = nnctl_mem_alloc(NNCTL_MEM_SESSIONS, src->lenv[i+first] + 1);
+    if (dst->argv[i] == NULL) exit(-1);
+    if (src->lenv[i+first]) memcpy(dst->argv[i], src->argv[i+first], src->lenv[i+first]);
+    dst->argv[i][src->lenv[i+first]] = '\0';
+    dst->lenv[i] = src->lenv[i+first];
+  }
+}
+
+static void watch_fire(nnctl *cp, void *data);
+
+/* watch <seconds> <command> [args ...] 
+ * subscribe to the output of a command. The command runs once per interval
+ * no matter how many clients watch it; each run is published on the pub
+ * socket as the topic (the command words joined by a space), a NUL, then
+ * the output. Repeating the request renews the subscription's lease. */
+static int watch_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
+  nnctl_watch *w;
+  UT_string *t;
+  int i, interval;
+
+  if (arg->argc < 3) {
+    nnctl_printf(cp, "usage: watch <seconds> <command> [args ...]\n");
+    return -1;
+  }
+  interval = atoi(arg->argv[1]);
+  if (interval <= 0) {
+    nnctl_printf(cp, "invalid interval: %s\n", arg->argv[1]);
+    return -1;
+  }
+  if ((find_cmd(cp, arg->argv[2], arg->lenv[2]) == &unknown_cmdw) ||
+      (strcmp(arg->argv[2], "watch") == 0)) {
+    nnctl_printf(cp, "cannot watch: %s\n", arg->argv[2]);
+    return -1;
+  }
+
+  utstring_new(t);
+  for(i=2; i < arg->argc; i++) {
+    if (i > 2) utstring_bincpy(t, " ", 1);
+    if (arg->lenv[i]) utstring_bincpy(t, arg->argv[i], arg->lenv[i]);
+  }
+  if (strlen(utstring_body(t)) != utstring_len(t)) {
+    nnctl_printf(cp, "cannot watch a command with binary arguments\n");
+    utstring_free(t);
+    return -1;
+  }
+
+  HASH_FIND(hh, cp->watches, utstring_body(t), utstring_len(t), w);
+  if (w == NULL) {
+    if ( (w = mem_calloc(NNCTL_MEM_SESSIONS, sizeof(*w))) == NULL) exit(-1);
+    w->topic = mem_strdup(NNCTL_MEM_SESSIONS, utstring_body(t));
+    if (w->topic == NULL) exit(-1);
+    copy_arg(&w->arg, arg, 2);
+    w->timer = nnctl_timer_new(cp, watch_fire, w);
+    nnctl_timer_set(w->timer, 0);
+    HASH_ADD_KEYPTR(hh, cp->watches, w->topic, utstring_len(t), w);
+  }
+  w->interval = interval;
+  w->expires = nnctl_now() + NNCTL_WATCH_LEASE;
+  nnctl_printf(cp, "watching \"%s\" every %us on %s\n", w->topic,
+    w->interval, cp->pub_addr);
+  utstring_free(t);
+  return 0;
+}
+
+static int slot_index(void) {
+  if (nnctl_tidx == -1) {
+    nnctl_tidx = __atomic_fetch_add(&nnctl_nthreads, 1, __ATOMIC_RELAXED);
+    nnctl_tidx %= NNCTL_MAX_THREADS;
+  }
+  return nnctl_tidx;
+}
+
+static char *metric_types[] = {"", "counter", "gauge", "histogram"};
+
+/* sum a metric's slots into a snapshot entry */
+static void metric_sum(nnctl_metric *m, int nslots, nnctl_shm_ent *e) {
+  nnctl_slot *s = m->slots;
+  nnctl_hslot *h = m->slots;
+  int i, j;
+
+  memset(e, 0, sizeof(*e));
+  strncpy(e->name, m->name, sizeof(e->name)-1);
+  e->type = m->type;
+  switch(m->type) {
+    case NNCTL_COUNTER:
+      for(i=0; i < nslots; i++) e->v += __atomic_load_n(&s[i].v, __ATOMIC_RELAXED);
+      break;
+    case NNCTL_GAUGE:
+      e->v = __atomic_load_n(&s->v, __ATOMIC_RELAXED);
+      break;
+    case NNCTL_HISTOGRAM:
+      for(i=0; i < nslots; i++) {
+        e->v += __atomic_load_n(&h[i].count, __ATOMIC_RELAXED);
+        e->sum += __atomic_load_n(&h[i].sum, __ATOMIC_RELAXED);
+        for(j=0; j < NNCTL_HIST_BUCKETS; j++) {
+          e->b[j] += __atomic_load_n(&h[i].b[j], __ATOMIC_RELAXED);
+        }
+      }
+      break;
+  }
+}
+
+static int used_slots(void) {
+  int nslots = __atomic_load_n(&nnctl_nthreads, __ATOMIC_RELAXED);
+  return (nslots > NNCTL_MAX_THREADS) ? NNCTL_MAX_THREADS : nslots;
+}
+
+/* metrics [prefix] - snapshot the metrics registry */
+static int metrics_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
+  nnctl_metric *m, *tmp;
+  nnctl_shm_ent e;
+  char *prefix = (arg->argc > 1) ? arg->argv[1] : "";
+
+  pthread_mutex_lock(&cp->metrics_mutex);
+  HASH_ITER(hh, cp->metrics, m, tmp) {
+    if (strncmp(m->name, prefix, strlen(prefix))) continue;
+    metric_sum(m, used_slots(), &e);
+    nnctl_printf(cp, "%-30s %-10s ", m->name, metric_types[m->type]);
+    if (m->type != NNCTL_HISTOGRAM) {
+      nnctl_printf(cp, "%" PRId64 "\n", e.v);
+      continue;
+    }
+    nnctl_printf(cp, "count=%" PRId64 " sum=%" PRId64, e.v, e.sum);
+    if (e.v) nnctl_printf(cp, " p50<=%" PRIu64 " p99<=%" PRIu64 " max<=%" PRIu64,
+      nnctl_hist_quantile(e.b, e.v, 0.5), nnctl_hist_quantile(e.b, e.v, 0.99),
+      nnctl_hist_quantile(e.b, e.v, 1.0));
+    nnctl_printf(cp, "\n");
+  }
+  pthread_mutex_unlock(&cp->metrics_mutex);
+  return 0;
+}
+
+/* copy a snapshot of the registry into the shared memory export. readers
+ * retry if the sequence number is odd, or changes while they copy. */
+static void metrics_publish(nnctl *cp) {
+  nnctl_shm_hdr *hdr = cp->shm;
+  nnctl_shm_ent *ent = (nnctl_shm_ent*)(hdr + 1);
+  nnctl_metric *m, *tmp;
+  struct timespec ts;
+  uint64_t seq;
+  uint32_t n = 0;
+
+  pthread_mutex_lock(&cp->metrics_mutex);
+  seq = hdr->seq;
+  __atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  HASH_ITER(hh, cp->metrics, m, tmp) {
+    if (n == hdr->capacity) break;
+    metric_sum(m, used_slots(), &ent[n++]);
+  }
+  hdr->nmetrics = n;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  hdr->updated = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  __atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&cp->metrics_mutex);
+}
+
+static inline uint64_t trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void trace_release(void *r) {
+  __atomic_store_n(&((nnctl_tring*)r)->owner, 0, __ATOMIC_RELEASE);
+}
+
+/* measure the trace clock rate, once */
+static void trace_setup(void) {
+  struct timespec ts0, ts1, d = {0, 20000000};
+  uint64_t t0, t1;
+
+  pthread_key_create(&nnctl_trace.key, trace_release);
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+  t0 = trace_clock();
+  nanosleep(&d, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &ts1);
+  t1 = trace_clock();
+  nnctl_trace.tsc0 = t0;
+  nnctl_trace.tsc_per_us = (t1 - t0) / ((ts1.tv_sec - ts0.tv_sec) * 1e6 +
+                                        (ts1.tv_nsec - ts0.tv_nsec) / 1e3);
+}
+
+/* give the calling thread a ring, reusing one from an exited thread */
+static nnctl_tring *trace_ring(void) {
+  nnctl_tring *r;
+  int unowned;
+
+  pthread_mutex_lock(&nnctl_trace.mutex);
+  for(r = nnctl_trace.rings; r; r = r->next) {
+    unowned = 0;
+    if (__atomic_compare_exchange_n(&r->owner, &unowned, 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+  }
+  if (r == NULL) {
+    if ( (r = calloc(1, sizeof(*r))) == NULL) exit(-1);
+    r->owner = 1;
+    r->next = nnctl_trace.rings;
+    nnctl_trace.rings = r;
+  }
+  r->tid = syscall(SYS_gettid);
+  pthread_mutex_unlock(&nnctl_trace.mutex);
+  pthread_setspecific(nnctl_trace.key, r);
+  return r;
+}
+
+static inline void trace_event(const char *name, int ph) {
+  nnctl_tring *r;
+  nnctl_tev *e;
+  uint64_t k;
+
+  if (!__atomic_load_n(&nnctl_trace.on, __ATOMIC_RELAXED)) return;
+  if ( (r = nnctl_ring) == NULL) r = nnctl_ring = trace_ring();
+  k = r->i;
+  __atomic_store_n(&r->started, k + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE); // started is seen before the slot changes
+  e = &r->d[k & (NNCTL_TRACE_EVENTS-1)];
+  __atomic_store_n(&e->tsc, trace_clock(), __ATOMIC_RELAXED);
+  __atomic_store_n(&e->name, name, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->ph, (uint64_t)ph, __ATOMIC_RELAXED);
+  __atomic_store_n(&r->i, k + 1, __ATOMIC_RELEASE);
+}
+
+void nnctl_trace_begin(const char *name)   { trace_event(name, 'B'); }
+void nnctl_trace_end(const char *name)     { trace_event(name, 'E'); }
+void nnctl_trace_instant(const char *name) { trace_event(name, 'i'); }
+
+/* copy the ring's records; those older than since are marked unnamed */
+static void trace_snapshot(nnctl_tring *r, uint64_t since, UT_array *evs) {
+  uint64_t i0, s1, k, lo;
+  nnctl_tev *e, t;
+
+  i0 = __atomic_load_n(&r->i, __ATOMIC_ACQUIRE);
+  lo = (i0 > NNCTL_TRACE_EVENTS) ? i0 - NNCTL_TRACE_EVENTS : 0;
+  for(k = lo; k < i0; k++) {
+    e = &r->d[k & (NNCTL_TRACE_EVENTS-1)];
+    t.tsc = __atomic_load_n(&e->tsc, __ATOMIC_RELAXED);
+    t.name = __atomic_load_n(&e->name, __ATOMIC_RELAXED);
+    t.ph = __atomic_load_n(&e->ph, __ATOMIC_RELAXED);
+    utarray_push_back(evs, &t);
+  }
+  /* record k is overwritten once the owner starts record k+N. pairs with
+   * the owner's fence: a slot we read mid-overwrite shows in started */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  s1 = __atomic_load_n(&r->started, __ATOMIC_RELAXED);
+  for(k = lo; k < i0; k++) {
+    e = (nnctl_tev*)utarray_eltptr(evs, k - lo);
+    if ((k + NNCTL_TRACE_EVENTS < s1) || (e->tsc < since)) e->name = NULL;
+  }
+}
+
+static void json_str(nnctl *cp, const char *s) {
+  nnctl_printf(cp, "\"");
+  for(; s && *s; s++) {
+    if (*s == '"' || *s == '\\') nnctl_printf(cp, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20) nnctl_printf(cp, "\\u%04x", *s);
+    else nnctl_printf(cp, "%c", *s);
+  }
+  nnctl_printf(cp, "\"");
+}
+
+/* trace on|off|dump [ms]
+ * dump pauses tracing, then exports the last ms milliseconds (default: all
+ * that the rings hold) in chrome trace format (chrome://tracing, perfetto) */
+static int trace_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
+  UT_icd tev_icd = {sizeof(nnctl_tev), NULL, NULL, NULL};
+  UT_array *evs;
+  nnctl_tring *r;
+  nnctl_tev *e;
+  uint64_t now, since = 0;
+  int was_on, ms, first = 1;
+  size_t k;
+
+  pthread_once(&nnctl_trace.once, trace_setup);
+  if ((arg->argc > 1) && !strcmp(arg->argv[1], "on")) {
+    __atomic_store_n(&nnctl_trace.on, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  if ((arg->argc > 1) && !strcmp(arg->argv[1], "off")) {
+    __atomic_store_n(&nnctl_trace.on, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+  if ((arg->argc < 2) || strcmp(arg->argv[1], "dump")) {
+    nnctl_printf(cp, "usage: trace on|off|dump [ms]\n");
+    return -1;
+  }
+
+  was_on = __atomic_exchange_n(&nnctl_trace.on, 0, __ATOMIC_RELAXED);
+  now = trace_clock();
+  ms = (arg->argc > 2) ? atoi(arg->argv[2]) : 0;
+  if (ms > 0 && now > ms * 1000 * nnctl_trace.tsc_per_us) {
+    since = now - ms * 1000 * nnctl_trace.tsc_per_us;
+  }
+
+  utarray_new(evs, &tev_icd);
+  nnctl_printf(cp, "{\"traceEvents\":[");
+  pthread_mutex_lock(&nnctl_trace.mutex);
+  for(r = nnctl_trace.rings; r; r = r->next) {
+    utarray_clear(evs);
+    trace_snapshot(r, since, evs);
+    for(k=0; k < utarray_len(evs); k++) {
+      e = (nnctl_tev*)utarray_eltptr(evs, k);
+      if (e->name == NULL || e->tsc < nnctl_trace.tsc0) continue;
+      nnctl_printf(cp, "%s\n{\"name\":", first ? "" : ",");
+      json_str(cp, e->name);
+      nnctl_printf(cp, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s}",
+        (int)e->ph, (e->tsc - nnctl_trace.tsc0) / nnctl_trace.tsc_per_us, (int)getpid(), r->tid,
+        (e->ph == 'i') ? ",\"s\":\"t\"" : "");
+      first = 0;
+    }
+  }
+  pthread_mutex_unlock(&nnctl_trace.mutex);
+  nnctl_printf(cp, "\n]}\n");
+  utarray_free(evs);
+  if (was_on) __atomic_store_n(&nnctl_trace.on, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* read a word of our own memory, failing instead of faulting if the frame
+ * pointer was garbage (e.g. code built without frame pointers) */
+static int prof_peek(uintptr_t addr, uintptr_t *w) {
+  struct iovec local = {w, sizeof(*w)}, remote = {(void*)addr, sizeof(*w)};
+  return (process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == sizeof(*w)) ? 0 : -1;
+}
+
+/* SIGPROF handler. async-signal-safe: atomics, and syscalls in prof_peek */
+static void prof_handler(int signo, siginfo_t *si, void *vuc) {
+  uintptr_t pc=0, fp=0, sp=0, next, ra, frames[NNCTL_PROF_DEPTH];
+  ucontext_t *uc = (ucontext_t*)vuc;
+  size_t depth=0, at;
+  int saved_errno = errno;
+
+  __atomic_fetch_add(&nnctl_prof.active, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&nnctl_prof.on, __ATOMIC_SEQ_CST)) goto done;
+
+#if defined(__x86_64__)
+  pc = uc->uc_mcontext.gregs[REG_RIP];
+  fp = uc->uc_mcontext.gregs[REG_RBP];
+  sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  pc = uc->uc_mcontext.pc;
+  fp = uc->uc_mcontext.regs[29];
+  sp = uc->uc_mcontext.sp;
+#endif
+  if (pc) frames[depth++] = pc;
+
+  /* each frame holds the caller's frame pointer, then the return address.
+   * the stack grows down, so the chain must move strictly upward. */
+  while (depth < NNCTL_PROF_DEPTH) {
+    if ((fp < sp) || (fp & (sizeof(uintptr_t)-1))) break;
+    if (prof_peek(fp, &next) || prof_peek(fp + sizeof(uintptr_t), &ra)) break;
+    if (ra == 0) break;
+    frames[depth++] = ra;
+    if (next <= fp) break;
+    sp = fp;
+    fp = next;
+  }
+  if (depth == 0) goto done;
+
+  /* reserve only if the sample fits, so n never covers unwritten words */
+  at = __atomic_load_n(&nnctl_prof.n, __ATOMIC_RELAXED);
+  do {
+    if (at + depth + 1 > NNCTL_PROF_WORDS) {
+      __atomic_fetch_add(&nnctl_prof.dropped, 1, __ATOMIC_RELAXED);
+      goto done;
+    }
+  } while (!__atomic_compare_exchange_n(&nnctl_prof.n, &at, at + depth + 1,
+    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  nnctl_prof.buf[at] = depth;
+  memcpy(&nnctl_prof.buf[at+1], frames, depth * sizeof(uintptr_t));
+
+ done:
+  __atomic_fetch_sub(&nnctl_prof.active, 1, __ATOMIC_RELEASE);
+  errno = saved_errno;
+}
+
+static int prof_start(nnctl *cp, int hz) {
+  struct sigevent sev;
+  struct itimerspec its;
+  struct sigaction sa;
+  int rc = -1;
+
+  if (nnctl_prof.buf) {
+    nnctl_printf(cp, "profiler already running\n");
+    goto done;
+  }
+  if ((hz <= 0) || (hz > 10000)) {
+    nnctl_printf(cp, "rate must be 1-10000 Hz\n");
+    goto done;
+  }
+  nnctl_prof.buf = malloc(NNCTL_PROF_WORDS * sizeof(uintptr_t));
+  if (nnctl_prof.buf == NULL) {
+    nnctl_printf(cp, "out of memory\n");
+    goto done;
+  }
+  nnctl_prof.n = 0;
+  nnctl_prof.dropped = 0;
+  nnctl_prof.hz = hz;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = prof_handler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigfillset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, &nnctl_prof.old);
+
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_SIGNAL;
+  sev.sigev_signo = SIGPROF;
+  if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &nnctl_prof.timer)) {
+    nnctl_printf(cp, "timer_create: %s\n", strerror(errno));
+    sigaction(SIGPROF, &nnctl_prof.old, NULL);
+    free(nnctl_prof.buf);
+    nnctl_prof.buf = NULL;
+    goto done;
+  }
+  __atomic_store_n(&nnctl_prof.on, 1, __ATOMIC_RELEASE);
+  its.it_interval.tv_sec = 0;
+  its.it_interval.tv_nsec = 1000000000L / hz;
+  its.it_value = its.it_interval;
+  timer_settime(nnctl_prof.timer, 0, &its, NULL);
+  nnctl_printf(cp, "profiling at %d Hz\n", hz);
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* name a pc as symbol+offset, or object+offset, or bare hex */
+static void prof_symbol(UT_string *s, uintptr_t pc) {
+  const char *obj;
+  Dl_info info;
+
+  if (dladdr((void*)pc, &info) && info.dli_sname) {
+    utstring_printf(s, "%s", info.dli_sname);
+  } else if (dladdr((void*)pc, &info) && info.dli_fname) {
+    obj = strrchr(info.dli_fname, '/');
+    utstring_printf(s, "%s+0x%lx", obj ? obj+1 : info.dli_fname,
+      (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+  } else utstring_printf(s, "0x%lx", (unsigned long)pc);
+}
+
+static int prof_stop(nnctl *cp) {
+  nnctl_folded *folded=NULL, *f, *tmp;
+  size_t at, n, depth, i;
+  UT_string *s;
+  uintptr_t pc;
+
+  if (nnctl_prof.buf == NULL) {
+    nnctl_printf(cp, "profiler not running\n");
+    return -1;
+  }
+  /* signals may still be pending or in progress after timer_delete. one
+   * still queued would terminate the process under SIG_DFL, so ignore it */
+  __atomic_store_n(&nnctl_prof.on, 0, __ATOMIC_SEQ_CST);
+  timer_delete(nnctl_prof.timer);
+  while (__atomic_load_n(&nnctl_prof.active, __ATOMIC_SEQ_CST)) sched_yield();
+  if (!(nnctl_prof.old.sa_flags & SA_SIGINFO) &&
+      (nnctl_prof.old.sa_handler == SIG_DFL)) nnctl_prof.old.sa_handler = SIG_IGN;
+  sigaction(SIGPROF, &nnctl_prof.old, NULL);
+
+  /* fold each sample root first, e.g. main;msg_loop;nnctl_exec 12 */
+  utstring_new(s);
+  n = nnctl_prof.n;
+  for(at = 0; at < n; at += depth + 1) {
+    depth = nnctl_prof.buf[at];
+    if (at + depth + 1 > n) break;
+    utstring_clear(s);
+    for(i = depth; i > 0; i--) {
+      pc = nnctl_prof.buf[at + i];
+      if (i > 1) pc--; // a return address may be past the end of the caller
+      if (i < depth) utstring_printf(s, ";");
+      prof_symbol(s, pc);
+    }
+    HASH_FIND(hh, folded, utstring_body(s), utstring_len(s), f);
+    if (f == NULL) {
+      if ( (f = calloc(1, sizeof(*f))) == NULL) exit(-1);
+      f->stack = strdup(utstring_body(s));
+      HASH_ADD_KEYPTR(hh, folded, f->stack, strlen(f->stack), f);
+    }
+    f->count++;
+  }
+  HASH_ITER(hh, folded, f, tmp) {
+    nnctl_printf(cp, "%s %zu\n", f->stack, f->count);
+    HASH_DEL(folded, f);
+    free(f->stack);
+    free(f);
+  }
+  if (nnctl_prof.dropped) {
+    nnctl_printf(cp, "# %zu samples dropped; buffer full\n", nnctl_prof.dropped);
+  }
+  utstring_free(s);
+  free(nnctl_prof.buf);
+  nnctl_prof.buf = NULL;
+  return 0;
+}
+
+/* profile start [hz] | profile stop
+ * stop replies with folded stacks, the input of flamegraph.pl */
+static int profile_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
+  if ((arg->argc > 1) && !strcmp(arg->argv[1], "start")) {
+    return prof_start(cp, (arg->argc > 2) ? atoi(arg->argv[2]) : 99);
+  }
+  if ((arg->argc > 1) && !strcmp(arg->argv[1], "stop")) return prof_stop(cp);
+  nnctl_printf(cp, "usage: profile start [hz] | profile stop\n");
+  return -1;
+}
+
+/* resident set size in bytes, or 0 */
+static size_t mem_rss(void) {
+  unsigned long size, rss = 0;
+  FILE *f;
+
+  if ( (f = fopen("/proc/self/statm", "r")) == NULL) return 0;
+  if (fscanf(f, "%lu %lu", &size, &rss) != 2) rss = 0;
+  fclose(f);
+  return rss * sysconf(_SC_PAGESIZE);
+}
+
+/* memory [trim]
+ * live and peak bytes, allocations and the allocation rate (bytes/s since
+ * the previous report) of each tag, then the malloc arena statistics. trim
+ * returns free heap memory to the kernel first */
+static int memory_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
+  uint64_t now = nnctl_now_ms(), bytes, ms;
+  size_t rss = 0;
+  nnctl_memtag *t;
+  int i, ntags;
+
+  if ((arg->argc > 1) && !strcmp(arg->argv[1], "trim")) {
+    rss = mem_rss();
+    malloc_trim(0);
+    nnctl_printf(cp, "trimmed: rss %zu -> %zu bytes\n", rss, mem_rss());
+  }
+  ms = now - nnctl_mem.last_ms;
+  nnctl_mem.last_ms = now;
+  ntags = __atomic_load_n(&nnctl_mem.ntags, __ATOMIC_RELAXED);
+  if (ntags > NNCTL_MEM_TAGS) ntags = NNCTL_MEM_TAGS;
+  nnctl_printf(cp, "%-16s %12s %12s %12s %12s\n", "tag", "live", "peak",
+    "allocs", "bytes/s");
+  for(i=0; i < ntags; i++) {
+    t = &nnctl_mem.tags[i];
+    if (t->name == NULL) continue;
+    bytes = __atomic_load_n(&t->bytes, __ATOMIC_RELAXED);
+    nnctl_printf(cp, "%-16s %12" PRId64 " %12" PRId64 " %12" PRIu64 " %12" PRIu64 "\n",
+      t->name, __atomic_load_n(&t->live, __ATOMIC_RELAXED),
+      __atomic_load_n(&t->peak, __ATOMIC_RELAXED),
+      __atomic_load_n(&t->allocs, __ATOMIC_RELAXED),
+      ms ? (bytes - t->last) * 1000 / ms : 0);
+    t->last = bytes;
+  }
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+#else
+  struct mallinfo mi = mallinfo();
+#endif
+  nnctl_printf(cp, "malloc: arena %zu mmap %zu in-use %zu free %zu releasable %zu\n",
+    (size_t)mi.arena, (size_t)mi.hblkhd, (size_t)mi.uordblks,
+    (size_t)mi.fordblks, (size_t)mi.keepcost);
+  if (rss == 0) nnctl_printf(cp, "rss %zu\n", mem_rss());
+  return 0;
+}
+
+/* free a job. a worker does so with the job mutex held; the owning thread
+ * only once no worker has the job */
+static void free_job(nnctl_job *j) {
+  if (j->watch) j->watch->job = NULL;
+  free_arg(&j->arg, j->arg_tag);
+  if (j->control) nn_freemsg(j->control);
+  nnctl_mem_free(NNCTL_MEM_SESSIONS, j->topic);
+  mem_count(NNCTL_MEM_REPLY, j->out_seen, 0);
+  utstring_done(&j->out);
+  nnctl_mem_free(NNCTL_MEM_SESSIONS, j);
+}
+
+static void *worker(void *_cp) {
+  nnctl *cp = (nnctl*)_cp;
+  uint64_t one = 1;
+  nnctl_job *j;
+
+  pthread_mutex_lock(&cp->job_mutex);
+  while (1) {
+    /* a worker that got unstuck is surplus to the replacement */
+    if (cp->nworkers - cp->nstuck > NNCTL_WORKERS) break;
+    while (!cp->stopping && (cp->pending == NULL)) {
+      pthread_cond_wait(&cp->job_cond, &cp->job_mutex);
+    }
+    if (cp->stopping) break;
+    j = cp->pending;
+    cp->pending = j->next;
+    if (cp->pending == NULL) cp->pending_tail = NULL;
+    j->state = NNCTL_JOB_RUNNING;
+    pthread_mutex_unlock(&cp->job_mutex);
+
+    nnctl_tjob = j;
+    j->cmdf(cp, &j->arg, j->data, &j->cookie);
+    nnctl_tjob = NULL;
+    reply_note(&j->out, &j->out_seen);
+
+    pthread_mutex_lock(&cp->job_mutex);
+    if (j->abandoned) {
+      fprintf(stderr,"abandoned command %s returned\n", j->arg.argv[0]);
+      cp->nstuck--;
+      nnctl_metric_add(cp->m_stuck, -1);
+      free_job(j);
+      continue;
+    }
+    j->state = NNCTL_JOB_DONE;
+    if (j->sync) {
+      pthread_cond_broadcast(&cp->done_cond);
+      continue;
+    }
+    j->next = NULL;
+    if (cp->done_tail) cp->done_tail->next = j;
+    else cp->done = j;
+    cp->done_tail = j;
+    if (write(cp->event_fd, &one, sizeof(one)) != sizeof(one)) {
+      fprintf(stderr,"eventfd write: %s\n", strerror(errno));
+    }
+  }
+  cp->nworkers--;
+  pthread_cond_broadcast(&cp->done_cond);
+  pthread_mutex_unlock(&cp->job_mutex);
+  return NULL;
+}
+
+/* keep the pool at strength; called with the job mutex held */
+static void spawn_workers(nnctl *cp) {
+  pthread_attr_t attr;
+  pthread_t t;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  while (cp->nworkers - cp->nstuck < NNCTL_WORKERS) {
+    if ( (errno = pthread_create(&t, &attr, worker, cp)) != 0) {
+      fprintf(stderr,"pthread_create: %s\n", strerror(errno));
+      break;
+    }
+    cp->nworkers++;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+/* queue a job for the pool, starting the pool if need be */
+static int offload(nnctl *cp, nnctl_job *j) {
+  int rc = -1;
+
+  pthread_mutex_lock(&cp->job_mutex);
+  spawn_workers(cp);
+  if (cp->nworkers - cp->nstuck == 0) goto done;
+  j->state = NNCTL_JOB_PENDING;
+  j->next = NULL;
+  if (cp->pending_tail) cp->pending_tail->next = j;
+  else cp->pending = j;
+  cp->pending_tail = j;
+  pthread_cond_signal(&cp->job_cond);
+  rc = 0;
+
+ done:
+  pthread_mutex_unlock(&cp->job_mutex);
+  return rc;
+}
+
+/* give up on a job whose deadline passed, with the job mutex held. returns
+ * 1 if the caller should free the job, 0 if its worker will, and -1 if
+ * it finished after all. a running job is flagged cancelled and left to
+ * its worker, which is replaced in the pool */
+static int abandon(nnctl *cp, nnctl_job *j) {
+  nnctl_job *p;
+
+  if (j->state == NNCTL_JOB_DONE) return -1;
+  nnctl_metric_add(cp->m_timeouts, 1);
+  if (j->state == NNCTL_JOB_PENDING) {
+    if (cp->pending == j) cp->pending = j->next;
+    else {
+      for(p = cp->pending; p->next != j; p = p->next) ;
+      p->next = j->next;
+      if (cp->pending_tail == j) cp->pending_tail = p;
+    }
+    if (cp->pending == NULL) cp->pending_tail = NULL;
+    return 1;
+  }
+  fprintf(stderr,"command %s exceeded its %u ms deadline; abandoning it\n",
+    j->arg.argv[0], j->timeout);
+  __atomic_store_n(&j->cancelled, 1, __ATOMIC_RELAXED);
+  j->abandoned = 1;
+  cp->nstuck++;
+  nnctl_metric_add(cp->m_stuck, 1);
+  spawn_workers(cp);
+  return 0;
+}
+
+static void timeout_reply(nnctl_job *j, UT_string *out) {
+  utstring_printf(out, "command timed out after %u ms\n", j->timeout);
+}
+
+int nnctl_cancelled(nnctl *cp) {
+  return nnctl_tjob ? __atomic_load_n(&nnctl_tjob->cancelled, __ATOMIC_RELAXED) : 0;
+}
+
+/* a command's own deadline, or the default if it is offloaded */
+static unsigned cmd_deadline(nnctl *cp, nnctl_cmd_w *cw) {
+  if (cw->cmd.flags & NNCTL_OWNER) return 0;
+  if (cw->cmd.timeout_ms) return cw->cmd.timeout_ms;
+  return (cw->cmd.flags & NNCTL_OFFLOAD) ? cp->timeout : 0;
+}
+
+void nnctl_set_timeout(nnctl *cp, char *name, unsigned ms) {
+  nnctl_cmd_w *cw;
+
+  if (name == NULL) { cp->timeout = ms; return; }
+  HASH_FIND(hh, cp->cmds, name, strlen(name), cw);
+  if (cw) cw->cmd.timeout_ms = ms;
+}
+
+/* the control port formats, compiled once: request, request with a
+ * deadline, and reply (which has the request's layout) */
+static struct {
+  pthread_once_t once;
+  tpl_schema *req;
+  tpl_schema *req_deadline;
+} nnctl_fmt = { .once = PTHREAD_ONCE_INIT };
+
+static void fmt_setup(void) {
+  nnctl_fmt.req = tpl_schema_compile("UA(B)");
+  nnctl_fmt.req_deadline = tpl_schema_compile("UuA(B)");
+}
+
+/* pack the reply and send it; control is the raw header, or NULL. the
+ * output buffer is packed by reference and gathered by nn_sendmsg, so a
+ * large reply is copied once, into the nanomsg message */
+#define NNCTL_REPLY_IOV 4
+static int send_reply(int nn_rep_socket, uint64_t cookie, UT_string *out, void *control) {
+  struct nn_msghdr hdr;
+  struct nn_iovec iov[NNCTL_REPLY_IOV];
+  struct iovec tiov[NNCTL_REPLY_IOV];
+  int rc, i, n = NNCTL_REPLY_IOV;
+  tpl_node *tr;
+  tpl_bin b;
+
+  tr = tpl_map_from_schema(nnctl_fmt.req, &cookie, &b);
+  tpl_pack(tr, 0);
+  b.sz = utstring_len(out);
+  b.addr = utstring_body(out);
+  tpl_pack_ex(tr, 1, TPL_NOCOPY);
+  rc = tpl_dump(tr, TPL_IOV, tiov, &n);
+  if (rc < 0) {
+    if (control) nn_freemsg(control);
+    goto done;
+  }
+  for(i=0; i < n; i++) {
+    iov[i].iov_base = tiov[i].iov_base;
+    iov[i].iov_len = tiov[i].iov_len;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = iov;
+  hdr.msg_iovlen = n;
+  if (control) {
+    hdr.msg_control = &control; // nn_sendmsg takes ownership
+    hdr.msg_controllen = NN_MSG;
+  }
+  rc = nn_sendmsg(nn_rep_socket, &hdr, 0);
+  if (rc < 0) {
+    fprintf(stderr,"nn_send: %s\n", nn_strerror(errno));
+    if (control) nn_freemsg(control);
+  }
+
+ done:
+  tpl_free(tr);
+  return (rc < 0) ? -1 : 0;
+}
+
+static void publish(nnctl *cp, char *topic, UT_string *out) {
+  UT_string *m;
+
+  utstring_new(m);
+  utstring_bincpy(m, topic, strlen(topic)+1);
+  utstring_concat(m, out);
+  if (nn_send(cp->pub_socket, utstring_body(m), utstring_len(m), NN_DONTWAIT) < 0) {
+    fprintf(stderr,"nn_send: %s\n", nn_strerror(errno));
+  }
+  utstring_free(m);
+}
+
+/* the deadline timer of an offloaded job on a raw socket, or of a watch */
+static void job_timeout(nnctl *cp, void *data) {
+  nnctl_job *j = (nnctl_job*)data;
+  UT_string out;
+  int rc;
+
+  pthread_mutex_lock(&cp->job_mutex);
+  rc = abandon(cp, j);
+  if (rc >= 0) {
+    utstring_init(&out);
+    timeout_reply(j, &out);
+    if (j->topic) {
+      if (cp->pub_socket != -1) publish(cp, j->topic, &out);
+    } else send_reply(j->socket, j->cookie, &out, j->control);
+    utstring_done(&out);
+    j->control = NULL;
+    nnctl_timer_free(j->timer);
+    j->timer = NULL;
+  }
+  pthread_mutex_unlock(&cp->job_mutex);
+  if (rc == 1) free_job(j);
+}
+
+/* run a job on the pool and wait for it, up to its deadline. for cooked
+ * sockets, which must reply before taking the next request */
+static void run_sync(nnctl *cp, nnctl_job *j, UT_string *out) {
+  struct timespec ts;
+  int rc = 0;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += j->timeout / 1000;
+  ts.tv_nsec += (j->timeout % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+
+  pthread_mutex_lock(&cp->job_mutex);
+  while ((j->state != NNCTL_JOB_DONE) && (rc != ETIMEDOUT)) {
+    rc = pthread_cond_timedwait(&cp->done_cond, &cp->job_mutex, &ts);
+  }
+  if (j->state == NNCTL_JOB_DONE) rc = 1;
+  else {
+    timeout_reply(j, out);
+    rc = abandon(cp, j);
+  }
+  pthread_mutex_unlock(&cp->job_mutex);
+  if (rc == 1) {
+    if (j->state == NNCTL_JOB_DONE) utstring_concat(out, &j->out);
+    free_job(j);
+  }
+}
+
+int nnctl_eventfd(nnctl *cp) {
+  return cp->event_fd;
+}
+
+/* send the replies of finished offloaded commands. returns the number of
+ * jobs completed, or -1 if a reply could not be sent */
+int nnctl_complete(nnctl *cp, int nn_rep_socket) {
+  nnctl_job *j, *done;
+  uint64_t n;
+  int rc = 0, count = 0;
+
+  if (read(cp->event_fd, &n, sizeof(n)) < 0 && (errno != EAGAIN)) {
+    fprintf(stderr,"eventfd read: %s\n", strerror(errno));
+  }
+  pthread_mutex_lock(&cp->job_mutex);
+  done = cp->done;
+  cp->done = cp->done_tail = NULL;
+  pthread_mutex_unlock(&cp->job_mutex);
+
+  while (done) {
+    j = done;
+    done = j->next;
+    nnctl_timer_free(j->timer);
+    if (j->topic) {
+      if (cp->pub_socket != -1) publish(cp, j->topic, &j->out);
+    } else {
+      if (send_reply(nn_rep_socket, j->cookie, &j->out, j->control)) rc = -1;
+      j->control = NULL;
+    }
+    free_job(j);
+    count++;
+  }
+  return rc ? rc : count;
+}
+
+/* run a watched command and publish its output, or end the watch if its
+ * lease ran out. like a request, a command that's offloaded or has a
+ * deadline runs on the pool; past the deadline, the timeout is published.
+ * a run is skipped while the previous one is still on the pool, even
+ * abandoned, so a slow command does not pile up jobs */
+static void watch_fire(nnctl *cp, void *data) {
+  nnctl_watch *w = (nnctl_watch*)data;
+  nnctl_cmd_w *cw;
+  nnctl_job *j;
+  uint64_t cookie;
+  unsigned timeout;
+
+  if (nnctl_now() >= w->expires) { free_watch(cp, w); return; }
+  nnctl_timer_set(w->timer, w->interval * 1000ULL);
+  pthread_mutex_lock(&cp->job_mutex);
+  j = w->job;
+  pthread_mutex_unlock(&cp->job_mutex);
+  if (j) {
+    nnctl_metric_add(cp->m_watch_skips, 1);
+    return;
+  }
+
+  cw = find_cmd(cp, w->arg.argv[0], w->arg.lenv[0]);
+  timeout = cmd_deadline(cp, cw);
+  if ((cw->cmd.flags & NNCTL_OFFLOAD) || timeout) {
+    if ( (j = mem_calloc(NNCTL_MEM_SESSIONS, sizeof(*j))) == NULL) exit(-1);
+    j->cmdf = cw->cmd.cmdf;
+    j->data = cw->data;
+    copy_arg(&j->arg, &w->arg, 0);
+    j->arg_tag = NNCTL_MEM_SESSIONS;
+    j->topic = mem_strdup(NNCTL_MEM_SESSIONS, w->topic);
+    j->timeout = timeout;
+    utstring_init(&j->out);
+    reply_note(&j->out, &j->out_seen);
+    if (timeout) {
+      j->timer = nnctl_timer_new(cp, job_timeout, j);
+      nnctl_timer_set(j->timer, timeout);
+    }
+    j->watch = w;
+    w->job = j;
+    if (offload(cp, j) == 0) return;
+    nnctl_timer_free(j->timer);
+    free_job(j);
+  }
+  cookie = 0;
+  utstring_clear(&cp->out);
+  cw->cmd.cmdf(cp, &w->arg, cw->data, &cookie);
+  reply_note(&cp->out, &cp->out_seen);
+  publish(cp, w->topic, &cp->out);
+  utstring_clear(&cp->out);
+}
+
+static void shm_fire(nnctl *cp, void *data) {
+  metrics_publish(cp);
+  nnctl_timer_set(cp->shm_timer, cp->shm_ms);
+}
+
+/* arm the timerfd for the wheel's next due tick, if that changed */
+static void timer_rearm(nnctl *cp) {
+  struct itimerspec its;
+  uint64_t next;
+
+  next = utwheel_next(&cp->wheel);
+  if (next == cp->armed) return;
+  memset(&its, 0, sizeof(its)); // disarms, if there are no timers
+  if (next != UINT64_MAX) {
+    its.it_value.tv_sec = next / 1000;
+    its.it_value.tv_nsec = (next % 1000) * 1000000 + 1; // 0 would disarm
+  }
+  if (timerfd_settime(cp->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+    fprintf(stderr,"timerfd_settime: %s\n", strerror(errno));
+  }
+  cp->armed = next;
+}
+
+static void timer_fire(void *data) {
+  nnctl_timer *t = (nnctl_timer*)data;
+  t->cb(t->cp, t->data);
+}
+
+nnctl_timer *nnctl_timer_new(nnctl *cp, nnctl_timer_cb *cb, void *data) {
+  nnctl_timer *t;
+
+  if ( (t = malloc(sizeof(*t))) == NULL) exit(-1);
+  utwheel_timer_init(&t->t, timer_fire, t);
+  t->cp = cp;
+  t->cb = cb;
+  t->data = data;
+  return t;
+}
+
+/* (re)arm the timer to run ms milliseconds from now */
+void nnctl_timer_set(nnctl_timer *t, uint64_t ms) {
+  utwheel_add(&t->cp->wheel, &t->t, nnctl_now_ms() + ms);
+  timer_rearm(t->cp);
+}
+
+void nnctl_timer_cancel(nnctl_timer *t) {
+  utwheel_cancel(&t->cp->wheel, &t->t);
+}
+
+void nnctl_timer_free(nnctl_timer *t) {
+  if (t == NULL) return;
+  nnctl_timer_cancel(t);
+  free(t);
+}
+
+int nnctl_timerfd(nnctl *cp) {
+  return cp->timer_fd;
+}
+
+/* run the due timers. returns the number run */
+int nnctl_timer_exec(nnctl *cp) {
+  uint64_t expirations;
+  size_t n;
+
+  if ((read(cp->timer_fd, &expirations, sizeof(expirations)) < 0) &&
+      (errno != EAGAIN)) {
+    fprintf(stderr,"timerfd read: %s\n", strerror(errno));
+  }
+  cp->armed = UINT64_MAX; // it fired, or is about to
+  n = utwheel_advance(&cp->wheel, nnctl_now_ms() + 1);
+  timer_rearm(cp);
+  return n;
+}
+
+void nnctl_tick(nnctl *cp) {
+  nnctl_timer_exec(cp);
+}
+
 nnctl *nnctl_init(nnctl_cmd *cmds, void *data) {
   nnctl_cmd *cmd;
   nnctl *cp;
   
   if ( (cp=calloc(1,sizeof(nnctl))) == NULL) goto done;
   cp->data = data;
-  nnctl_add_cmd(cp, "help", help_cmd, "this text", NULL);
+  cp->pub_socket = -1;
+  cp->rep_socket = -1;
+  cp->stop_fd = -1;
+  cp->cpu = -1;
+  cp->armed = UINT64_MAX;
+  utwheel_init(&cp->wheel, nnctl_now_ms());
+  if (nnctl_mem.last_ms == 0) nnctl_mem.last_ms = nnctl_now_ms();
+  pthread_once(&nnctl_fmt.once, fmt_setup);
+  cp->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (cp->timer_fd == -1) {
+    fprintf(stderr,"timerfd_create: %s\n", strerror(errno));
+    free(cp);
+    cp = NULL;
+    goto done;
+  }
+  pthread_mutex_init(&cp->metrics_mutex, NULL);
+  pthread_mutex_init(&cp->job_mutex, NULL);
+  pthread_cond_init(&cp->job_cond, NULL);
+  pthread_cond_init(&cp->done_cond, NULL);
+  cp->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (cp->event_fd == -1) {
+    fprintf(stderr,"eventfd: %s\n", strerror(errno));
+    close(cp->timer_fd);
+    free(cp);
+    cp = NULL;
+    goto done;
+  }
+  nnctl_add_cmd_ex(cp, "help", help_cmd, "this text", NULL, NNCTL_OWNER);
+  nnctl_add_cmd_ex(cp, "metrics", metrics_cmd, "metrics [prefix]", NULL, NNCTL_OWNER);
+  nnctl_add_cmd_ex(cp, "trace", trace_cmd, "trace on|off|dump [ms]", NULL, NNCTL_OWNER);
+  nnctl_add_cmd_ex(cp, "profile", profile_cmd, "profile start [hz] | profile stop", NULL, NNCTL_OWNER);
+  nnctl_add_cmd_ex(cp, "memory", memory_cmd, "memory [trim]", NULL, NNCTL_OWNER);
   for(cmd=cmds; cmd && cmd->name; cmd++) {
-    nnctl_add_cmd(cp,cmd->name,cmd->cmdf,cmd->help,data);
+    nnctl_add_cmd_ex(cp,cmd->name,cmd->cmdf,cmd->help,data,cmd->flags);
+    if (cmd->timeout_ms) nnctl_set_timeout(cp, cmd->name, cmd->timeout_ms);
   }
+  cp->m_timeouts = nnctl_metric_new(cp, "nnctl.command_timeouts", NNCTL_COUNTER);
+  cp->m_stuck = nnctl_metric_new(cp, "nnctl.stuck_workers", NNCTL_GAUGE);
+  cp->m_watch_skips = nnctl_metric_new(cp, "nnctl.watch_skips", NNCTL_COUNTER);
   utstring_init(&cp->out);
+  reply_note(&cp->out, &cp->out_seen);
 
  done:
   return cp;
 }
 
 void nnctl_add_cmd(nnctl *cp, char *name, nnctl_cmdf *cmdf, char *help, void *data) {
+  nnctl_add_cmd_ex(cp, name, cmdf, help, data, 0);
+}
+
+void nnctl_add_cmd_ex(nnctl *cp, char *name, nnctl_cmdf *cmdf, char *help, void *data, int flags) {
   nnctl_cmd_w *cw;
 
   /* create new command if it isn't in the hash; else update in place */
@@ -74,28 +1485,51 @@ void nnctl_add_cmd(nnctl *cp, char *name, nnctl_cmdf *cmdf, char *help, void *da
     HASH_ADD_KEYPTR(hh, cp->cmds, cw->cmd.name, strlen(cw->cmd.name), cw);
   }
   cw->cmd.cmdf = cmdf;
+  cw->cmd.flags = flags;
   cw->data = data;
 }
 
 #define MAX_ARGC 10
 int nnctl_exec(nnctl *cp, int nn_rep_socket) {
-  int rc=-1, argc, i=0;
+  int rc=-1, argc, i=0, nr, domain=AF_SP;
   nnctl_cmd_w *cw=NULL;
-  tpl_node *tn=NULL,*tr=NULL;
+  nnctl_job *j=NULL;
+  tpl_node *tn=NULL;
   tpl_bin b;
-  void *msg=NULL, *o;
-  size_t len, l;
+  void *msg=NULL, *control=NULL;
+  struct nn_msghdr hdr;
+  struct nn_iovec iov;
+  size_t len, sz=sizeof(domain);
   uint64_t cookie;
+  unsigned timeout=0, cmd_timeout;
+  char *fmt=NULL;
 
-  /* get the message buffer from nano */
-  len = nn_recv(nn_rep_socket, &msg, NN_MSG, 0);
-  if (len < 0) {
+  /* get the message buffer from nano. a raw socket also gives us the
+   * header that routes the reply back to the requester */
+  nn_getsockopt(nn_rep_socket, NN_SOL_SOCKET, NN_DOMAIN, &domain, &sz);
+  iov.iov_base = &msg;
+  iov.iov_len = NN_MSG;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  if (domain == AF_SP_RAW) {
+    hdr.msg_control = &control;
+    hdr.msg_controllen = NN_MSG;
+  }
+  nr = nn_recvmsg(nn_rep_socket, &hdr, 0);
+  if (nr < 0) {
      fprintf(stderr,"nn_recv: %s\n", nn_strerror(errno));
      goto done;
   }
+  len = nr;
 
-  /* unpack it, enforce a bit of reasonable size */
-  if ( (tn = tpl_map("UA(B)", &cookie, &b)) == NULL) goto done;
+  /* unpack it, enforce a bit of reasonable size. a client that sets a
+   * deadline sends it after the cookie */
+  fmt = tpl_peek(TPL_MEM, msg, len);
+  if (fmt && !strcmp(fmt, "UuA(B)")) 
+    tn = tpl_map_from_schema_ex(&nnctl_tpl_alloc, nnctl_fmt.req_deadline, &cookie, &timeout, &b);
+  else tn = tpl_map_from_schema_ex(&nnctl_tpl_alloc, nnctl_fmt.req, &cookie, &b);
+  if (tn == NULL) goto done;
   if (tpl_load(tn, TPL_MEM, msg, len) < 0) goto done;
   tpl_unpack(tn, 0);
   if ( (argc = tpl_Alen(tn,1)) > MAX_ARGC) {
@@ -118,10 +1552,10 @@ int nnctl_exec(nnctl *cp, int nn_rep_socket) {
    * It preserves the ability for callbacks to take binary buffers. */
   while (tpl_unpack(tn,1) > 0) {
     if (b.addr && (b.sz > 0) && (((char*)b.addr)[b.sz-1] != '\0')) {
-        char *tmp = malloc(b.sz + 1); if (!tmp) goto done;
+        char *tmp = nnctl_mem_alloc(NNCTL_MEM_TPL, b.sz + 1); if (!tmp) goto done;
         memcpy(tmp, b.addr, b.sz);
         tmp[b.sz] = '\0';
-        free(b.addr);
+        nnctl_mem_free(NNCTL_MEM_TPL, b.addr);
         b.addr = tmp;
     }
     cp->arg.argv[i] = b.addr;
@@ -129,49 +1563,339 @@ int nnctl_exec(nnctl *cp, int nn_rep_socket) {
     i++;
   }
 
-  /* find and invoke the command callback */
-  HASH_FIND(hh, cp->cmds, cp->arg.argv[0], cp->arg.lenv[0], cw);
-  if (!cw) cw = &unknown_cmdw;
+  /* find the command callback, and its deadline: the client's or the
+   * command's, whichever is sooner. the client's, and the default, only
+   * apply to a command that could run on the pool anyway: offloaded, or
+   * with a deadline of its own */
+  cw = find_cmd(cp, cp->arg.argv[0], cp->arg.lenv[0]);
+  cmd_timeout = cmd_deadline(cp, cw);
+  if (!cmd_timeout && !(cw->cmd.flags & NNCTL_OFFLOAD)) timeout = 0;
+  if (cmd_timeout && (!timeout || cmd_timeout < timeout)) timeout = cmd_timeout;
+  if ((cw == &unknown_cmdw) || (cw->cmd.flags & NNCTL_OWNER)) timeout = 0;
+
+  /* a command that's offloaded, or has a deadline, goes to the pool. on a
+   * raw socket, it replies when done; on a cooked one, we wait for it up 
+   * to the deadline. the job takes over the arguments */
   utstring_clear(&cp->out);
-  cw->cmd.cmdf(cp, &cp->arg, cw->data, &cookie);
+  if (((cw->cmd.flags & NNCTL_OFFLOAD) && control) || timeout) {
+    if ( (j = mem_calloc(NNCTL_MEM_SESSIONS, sizeof(*j))) == NULL) goto done;
+    j->cmdf = cw->cmd.cmdf;
+    j->data = cw->data;
+    j->arg = cp->arg;
+    j->arg_tag = NNCTL_MEM_TPL;
+    j->cookie = cookie;
+    j->control = control;
+    j->socket = nn_rep_socket;
+    j->timeout = timeout;
+    j->sync = (control == NULL);
+    utstring_init(&j->out);
+    reply_note(&j->out, &j->out_seen);
+    if (control && timeout) {
+      j->timer = nnctl_timer_new(cp, job_timeout, j);
+      nnctl_timer_set(j->timer, timeout);
+    }
+    if (offload(cp, j) == 0) {
+      memset(&cp->arg, 0, sizeof(cp->arg));
+      control = NULL;
+      rc = 0;
+      if (!j->sync) goto done;
+      run_sync(cp, j, &cp->out);
+      reply_note(&cp->out, &cp->out_seen);
+      rc = send_reply(nn_rep_socket, cookie, &cp->out, NULL);
+      goto done;
+    }
+    nnctl_timer_free(j->timer);
+    j->control = NULL;
+    memset(&j->arg, 0, sizeof(j->arg));
+    free_job(j);
+  }
 
-  /* reply to client */
-  tr = tpl_map("UA(B)", &cookie, &b);
-  tpl_pack(tr, 0);
-  b.sz = utstring_len(&cp->out);
-  b.addr = utstring_body(&cp->out);
-  tpl_pack(tr,1);
-  tpl_dump(tr, TPL_MEM, &o, &l);
-  //fprintf(stderr,"sent %ld bytes to client\n%.*s\n", l, (int)l, o);
-  rc = nn_send(nn_rep_socket, o, l, 0);
-  free(o);
-  if (rc < 0) goto done;
-  rc = 0;
+  /* invoke the command callback, reply to client */
+  cw->cmd.cmdf(cp, &cp->arg, cw->data, &cookie);
+  reply_note(&cp->out, &cp->out_seen);
+  rc = send_reply(nn_rep_socket, cookie, &cp->out, control);
+  control = NULL;
 
  done:
-  while(cp->arg.argc) free(cp->arg.argv[--cp->arg.argc]);
-  if (cp->arg.argv) { free(cp->arg.argv); cp->arg.argv=NULL; }
-  if (cp->arg.lenv) { free(cp->arg.lenv); cp->arg.lenv=NULL; }
+  free_arg(&cp->arg, NNCTL_MEM_TPL);
   if (msg) nn_freemsg(msg);
+  if (control) nn_freemsg(control);
+  if (fmt) tpl_get_hook()->free(fmt);
   if (tn) tpl_free(tn);
-  if (tr) tpl_free(tr);
   return rc;
 }
 
+/* create the NN_PUB socket on which watch subscriptions are published,
+ * and enable the watch command. returns -1 on error. */
+int nnctl_watch_bind(nnctl *cp, char *pub_addr) {
+  int rc = -1;
+
+  if (cp->pub_socket != -1) goto done;
+  cp->pub_socket = nn_socket(AF_SP, NN_PUB);
+  if (cp->pub_socket < 0) {
+    fprintf(stderr,"nn_socket: %s\n", nn_strerror(errno));
+    goto done;
+  }
+  if (nn_bind(cp->pub_socket, pub_addr) < 0) {
+    fprintf(stderr,"nn_bind: %s\n", nn_strerror(errno));
+    nn_close(cp->pub_socket);
+    cp->pub_socket = -1;
+    goto done;
+  }
+  cp->pub_addr = strdup(pub_addr);
+  nnctl_add_cmd_ex(cp, "watch", watch_cmd, "watch <secs> <cmd> - publish periodically", NULL, NNCTL_OWNER);
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* publish the metrics registry into a shared memory file so that readers
+ * such as nnctl -M snapshot it without a request to this process. a name
+ * without a slash is created under /dev/shm. it is refreshed every ms
+ * milliseconds by a timer, or every second if ms is 0. */
+int nnctl_metrics_shm(nnctl *cp, char *name, unsigned ms) {
+  int rc = -1, fd = -1;
+  char path[256];
+
+  if (cp->shm) goto done;
+  snprintf(path, sizeof(path), "%s%s", strchr(name,'/') ? "" : "/dev/shm/", name);
+  cp->shm_sz = sizeof(nnctl_shm_hdr) + NNCTL_SHM_CAPACITY * sizeof(nnctl_shm_ent);
+  if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1) {
+    fprintf(stderr,"open %s: %s\n", path, strerror(errno));
+    goto done;
+  }
+  if (ftruncate(fd, cp->shm_sz) == -1) {
+    fprintf(stderr,"ftruncate: %s\n", strerror(errno));
+    goto done;
+  }
+  cp->shm = mmap(NULL, cp->shm_sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (cp->shm == MAP_FAILED) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    cp->shm = NULL;
+    goto done;
+  }
+  cp->shm->capacity = NNCTL_SHM_CAPACITY;
+  cp->shm_path = strdup(path);
+  metrics_publish(cp);
+  cp->shm_ms = ms ? ms : 1000;
+  cp->shm_timer = nnctl_timer_new(cp, shm_fire, NULL);
+  nnctl_timer_set(cp->shm_timer, cp->shm_ms);
+  __atomic_store_n(&cp->shm->magic, NNCTL_SHM_MAGIC, __ATOMIC_RELEASE);
+  rc = 0;
+
+ done:
+  if (rc && (fd != -1)) unlink(path);
+  if (fd != -1) close(fd);
+  return rc;
+}
+
+/* the control thread: the recv/dispatch/send loop of nnctl_start_thread */
+static void *control_thread(void *_cp) {
+  nnctl *cp = (nnctl*)_cp;
+  struct pollfd fds[4];
+  size_t sz = sizeof(int);
+  int rcv_fd, rc;
+
+  if (nn_getsockopt(cp->rep_socket, NN_SOL_SOCKET, NN_RCVFD, &rcv_fd, &sz) < 0) {
+    fprintf(stderr,"nn_getsockopt: %s\n", nn_strerror(errno));
+    return NULL;
+  }
+  fds[0].fd = rcv_fd;
+  fds[1].fd = cp->event_fd;
+  fds[2].fd = cp->stop_fd;
+  fds[3].fd = cp->timer_fd;
+  fds[0].events = fds[1].events = fds[2].events = fds[3].events = POLLIN;
+
+  while (1) {
+    rc = poll(fds, 4, -1);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr,"poll: %s\n", strerror(errno));
+      break;
+    }
+    if (fds[2].revents) break;
+    if (fds[0].revents) nnctl_exec(cp, cp->rep_socket);
+    if (fds[1].revents) nnctl_complete(cp, cp->rep_socket);
+    if (fds[3].revents) nnctl_timer_exec(cp);
+  }
+  return NULL;
+}
+
+void nnctl_set_affinity(nnctl *cp, int cpu) {
+  cp->cpu = cpu;
+}
+
+int nnctl_start_thread(nnctl *cp, char *addr) {
+  pthread_attr_t attr;
+  cpu_set_t set;
+  int rc = -1;
+
+  if (cp->running) {
+    fprintf(stderr,"control thread already running\n");
+    return -1;
+  }
+  /* raw, so that offloaded commands can reply out of order */
+  if ( (cp->rep_socket = nn_socket(AF_SP_RAW, NN_REP)) < 0) {
+    fprintf(stderr,"nn_socket: %s\n", nn_strerror(errno));
+    goto done;
+  }
+  if (nn_bind(cp->rep_socket, addr) < 0) {
+    fprintf(stderr,"nn_bind: %s\n", nn_strerror(errno));
+    goto done;
+  }
+  if ( (cp->stop_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+    fprintf(stderr,"eventfd: %s\n", strerror(errno));
+    goto done;
+  }
+  pthread_attr_init(&attr);
+  if (cp->cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(cp->cpu, &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  }
+  errno = pthread_create(&cp->thread, &attr, control_thread, cp);
+  pthread_attr_destroy(&attr);
+  if (errno) {
+    fprintf(stderr,"pthread_create: %s\n", strerror(errno));
+    goto done;
+  }
+  cp->running = 1;
+  rc = 0;
+
+ done:
+  if (rc) {
+    if (cp->rep_socket != -1) { nn_close(cp->rep_socket); cp->rep_socket = -1; }
+    if (cp->stop_fd != -1) { close(cp->stop_fd); cp->stop_fd = -1; }
+  }
+  return rc;
+}
+
+void nnctl_stop(nnctl *cp) {
+  uint64_t one = 1;
+
+  if (!cp->running) return;
+  if (write(cp->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+    fprintf(stderr,"eventfd write: %s\n", strerror(errno));
+  }
+  pthread_join(cp->thread, NULL);
+  nn_close(cp->rep_socket);
+  close(cp->stop_fd);
+  cp->rep_socket = -1;
+  cp->stop_fd = -1;
+  cp->running = 0;
+}
+
+/* register a metric, or look up one of the same name and type.
+ * the handle is then updated from any thread without locking. */
+nnctl_metric *nnctl_metric_new(nnctl *cp, char *name, int type) {
+  nnctl_metric *m;
+  size_t sz;
+
+  pthread_mutex_lock(&cp->metrics_mutex);
+  HASH_FIND(hh, cp->metrics, name, strlen(name), m);
+  if (m) {
+    if (m->type != type) m = NULL;
+    goto done;
+  }
+  switch(type) {
+    case NNCTL_COUNTER:   sz = NNCTL_MAX_THREADS * sizeof(nnctl_slot); break;
+    case NNCTL_GAUGE:     sz = sizeof(nnctl_slot); break;
+    case NNCTL_HISTOGRAM: sz = NNCTL_MAX_THREADS * sizeof(nnctl_hslot); break;
+    default: goto done;
+  }
+  if ( (m = calloc(1, sizeof(*m))) == NULL) exit(-1);
+  if (posix_memalign(&m->slots, NNCTL_CACHELINE, sz)) exit(-1);
+  memset(m->slots, 0, sz);
+  m->name = strdup(name);
+  m->type = type;
+  HASH_ADD_KEYPTR(hh, cp->metrics, m->name, strlen(m->name), m);
+
+ done:
+  pthread_mutex_unlock(&cp->metrics_mutex);
+  return m;
+}
+
+/* add to a counter or gauge */
+void nnctl_metric_add(nnctl_metric *m, int64_t v) {
+  nnctl_slot *s = m->slots;
+  if (m->type == NNCTL_COUNTER) s += slot_index();
+  __atomic_fetch_add(&s->v, v, __ATOMIC_RELAXED);
+}
+
+/* set a gauge */
+void nnctl_metric_set(nnctl_metric *m, int64_t v) {
+  nnctl_slot *s = m->slots;
+  __atomic_store_n(&s->v, v, __ATOMIC_RELAXED);
+}
+
+/* record a value in a histogram */
+void nnctl_metric_observe(nnctl_metric *m, uint64_t v) {
+  nnctl_hslot *h = (nnctl_hslot*)m->slots + slot_index();
+  int i = v ? (64 - __builtin_clzll(v)) : 0;
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->b[i], 1, __ATOMIC_RELAXED);
+}
+
 void nnctl_free(nnctl *cp) {
   nnctl_cmd_w *cw, *tmp;
+  nnctl_watch *w, *wtmp;
+  nnctl_metric *m, *mtmp;
+  nnctl_job *j;
+
+  nnctl_stop(cp);
+  HASH_ITER(hh, cp->watches, w, wtmp) free_watch(cp, w);
+
+  /* stop the pool; unfinished jobs are dropped without a reply. a stuck
+   * worker may still return and use the control port state, so if there
+   * are any, it is left allocated */
+  pthread_mutex_lock(&cp->job_mutex);
+  cp->stopping = 1;
+  pthread_cond_broadcast(&cp->job_cond);
+  while (cp->nworkers > cp->nstuck) pthread_cond_wait(&cp->done_cond, &cp->job_mutex);
+  pthread_mutex_unlock(&cp->job_mutex);
+  if (cp->nstuck) {
+    fprintf(stderr,"nnctl_free: %d commands stuck; not freeing\n", cp->nstuck);
+    return;
+  }
+  while ( (j = cp->pending) != NULL) { cp->pending = j->next; nnctl_timer_free(j->timer); free_job(j); }
+  while ( (j = cp->done) != NULL) { cp->done = j->next; nnctl_timer_free(j->timer); free_job(j); }
+  pthread_mutex_destroy(&cp->job_mutex);
+  pthread_cond_destroy(&cp->job_cond);
+  pthread_cond_destroy(&cp->done_cond);
+  close(cp->event_fd);
+  close(cp->timer_fd);
+
   HASH_ITER(hh, cp->cmds, cw, tmp) {
     HASH_DEL(cp->cmds, cw);
     free(cw->cmd.name);
     free(cw->cmd.help);
     free(cw);
   }
+  HASH_ITER(hh, cp->metrics, m, mtmp) {
+    HASH_DEL(cp->metrics, m);
+    free(m->name);
+    free(m->slots);
+    free(m);
+  }
+  pthread_mutex_destroy(&cp->metrics_mutex);
+  nnctl_timer_free(cp->shm_timer);
+  if (cp->shm) {
+    munmap(cp->shm, cp->shm_sz);
+    unlink(cp->shm_path);
+    free(cp->shm_path);
+  }
+  if (cp->pub_socket != -1) nn_close(cp->pub_socket);
+  if (cp->pub_addr) free(cp->pub_addr);
+  if (nnctl_prof.buf) prof_stop(cp);
+  mem_count(NNCTL_MEM_REPLY, cp->out_seen, 0);
   utstring_done(&cp->out);
   free(cp);
 }
 
 void nnctl_append(nnctl *cp, void *buf, size_t len) { 
-  utstring_bincpy(&cp->out, buf, len);
+  utstring_bincpy(nnctl_tjob ? &nnctl_tjob->out : &cp->out, buf, len);
 }
 
 static void nnctl_printf_va(nnctl *cp, const char *fmt, va_list _ap) {
@@ -25,13 +25,150 @@ typedef struct {
   char *name;
   nnctl_cmdf *cmdf;
   char *help;
+  int flags;
+  unsigned timeout_ms; /* deadline, or 0 (see nnctl_set_timeout) */
 } nnctl_cmd;
 
+/* command flags */
+#define NNCTL_OFFLOAD 1  /* run on the internal thread pool */
+
 nnctl *nnctl_init(nnctl_cmd *cmds, void *data);
 void nnctl_free(nnctl *cp);
 void nnctl_add_cmd(nnctl *, char *name, nnctl_cmdf *cmdf, char *help, void *data);
+void nnctl_add_cmd_ex(nnctl *, char *name, nnctl_cmdf *cmdf, char *help, void *data, int flags);
 int nnctl_exec(nnctl *cp, int nn_rep_socket);
 
+/* offloaded commands run on worker threads, so their callbacks must be
+ * thread-safe. a finished command makes the eventfd readable; then call
+ * nnctl_complete on the owning thread to send its reply. offload needs a
+ * raw (AF_SP_RAW) REP socket, since a cooked one only allows one request
+ * in flight; on a cooked socket offloaded commands run inline. */
+int nnctl_eventfd(nnctl *cp);
+int nnctl_complete(nnctl *cp, int nn_rep_socket);
+
+/* deadlines. a command with a deadline runs on the thread pool; if it
+ * has not finished in time, the client gets a timeout reply, and the
+ * command is abandoned to finish on its own, its worker replaced. a
+ * client may also send one, for a command with a deadline or flagged
+ * NNCTL_OFFLOAD; the sooner one applies. name NULL sets the default
+ * for NNCTL_OFFLOAD commands without their own. a long-running
+ * callback should poll nnctl_cancelled and return once it is set. */
+void nnctl_set_timeout(nnctl *cp, char *name, unsigned ms);
+int nnctl_cancelled(nnctl *cp);
+
+/* optional: run the control port on a background thread, instead of
+ * polling it from the application's loop. the thread binds a REP socket
+ * at addr, and runs nnctl_exec, nnctl_complete and nnctl_timer_exec
+ * itself. set up commands, watch_bind and metrics_shm first;
+ * the application must not call those three functions while it runs.
+ *
+ * memory ordering: callbacks then run concurrently with the application.
+ * state that other threads write must be read with atomics or under a
+ * lock. a word written with __atomic_store_n(..., __ATOMIC_RELEASE) and
+ * read with __atomic_load_n(..., __ATOMIC_ACQUIRE) also makes visible
+ * whatever the writer stored before it; plain loads of shared state are
+ * data races. metrics are already safe to update from any thread. */
+void nnctl_set_affinity(nnctl *cp, int cpu); /* pin the thread; call first */
+int nnctl_start_thread(nnctl *cp, char *addr);
+void nnctl_stop(nnctl *cp); /* also done by nnctl_free */
+
+/* timers. a hierarchical timing wheel in milliseconds, behind one timerfd.
+ * poll nnctl_timerfd in the event loop and call nnctl_timer_exec when it
+ * is readable; callbacks run there. watches and the shared memory export
+ * run on these timers. timers are not thread-safe: use them on the thread
+ * that calls nnctl_timer_exec (in control thread mode, from commands). */
+struct _nnctl_timer; /* defined internally in libnnctl.c */
+typedef struct _nnctl_timer nnctl_timer;
+typedef void (nnctl_timer_cb)(nnctl *cp, void *data);
+
+nnctl_timer *nnctl_timer_new(nnctl *cp, nnctl_timer_cb *cb, void *data);
+void nnctl_timer_set(nnctl_timer *t, uint64_t ms); /* (re)arm, ms from now */
+void nnctl_timer_cancel(nnctl_timer *t);
+void nnctl_timer_free(nnctl_timer *t);              /* cancels it, too */
+int nnctl_timerfd(nnctl *cp);
+int nnctl_timer_exec(nnctl *cp);
+void nnctl_tick(nnctl *cp); /* instead of the timerfd: call periodically */
+
+/* optional: publish "watch" subscriptions on a NN_PUB socket */
+int nnctl_watch_bind(nnctl *cp, char *pub_addr);
+
+/* metrics registry, reported by the built-in metrics command. metrics are
+ * registered once, then updated from any thread with relaxed atomics into
+ * per-thread slots- no locks. each metric is summed independently, so a
+ * snapshot is not an atomic cut across metrics. */
+struct _nnctl_metric; /* defined internally in libnnctl.c */
+typedef struct _nnctl_metric nnctl_metric;
+
+#define NNCTL_COUNTER   1
+#define NNCTL_GAUGE     2
+#define NNCTL_HISTOGRAM 3  /* power-of-two buckets */
+
+#define NNCTL_HIST_BUCKETS 65 /* bucket i counts values < 2^i, >= 2^(i-1) */
+
+/* approximate a histogram's quantile q (0 to 1) from its buckets and count,
+ * as the upper bound of the bucket reaching it */
+static inline uint64_t nnctl_hist_quantile(const int64_t *b, int64_t count, double q) {
+  int64_t n = 0;
+  int i;
+  for(i=0; i < NNCTL_HIST_BUCKETS; i++) {
+    n += b[i];
+    if (n >= q * count) break;
+  }
+  return (i == 0) ? 0 : (i >= 64) ? UINT64_MAX : (((uint64_t)1 << i) - 1);
+}
+
+nnctl_metric *nnctl_metric_new(nnctl *cp, char *name, int type);
+void nnctl_metric_add(nnctl_metric *m, int64_t v);      /* counter, gauge */
+void nnctl_metric_set(nnctl_metric *m, int64_t v);      /* gauge */
+void nnctl_metric_observe(nnctl_metric *m, uint64_t v); /* histogram */
+
+/* optional: export the metrics in a shared memory file (refreshed every ms
+ * milliseconds by a timer, or every second if ms is 0), so that a reader
+ * maps it instead of sending a request */
+int nnctl_metrics_shm(nnctl *cp, char *name, unsigned ms);
+
+/* shared memory export layout. a header, then nmetrics entries. the writer
+ * makes seq odd while it updates; a reader copies the entries and retries
+ * if seq was odd or changed. */
+#define NNCTL_SHM_MAGIC 0x31306d6c74636e6eULL /* "nnctlm01" */
+typedef struct {
+  uint64_t magic;
+  uint64_t seq;
+  uint64_t updated;   /* CLOCK_REALTIME nanoseconds of last refresh */
+  uint32_t nmetrics;
+  uint32_t capacity;
+} nnctl_shm_hdr;
+
+typedef struct {
+  char name[48];
+  uint32_t type;
+  uint32_t pad;
+  int64_t v;          /* counter or gauge value, or histogram count */
+  int64_t sum;        /* histogram sum */
+  int64_t b[NNCTL_HIST_BUCKETS];
+} nnctl_shm_ent;
+
+/* hot-path tracing into per-thread rings, enabled and exported as chrome
+ * trace JSON by the built-in trace command. the name is kept by pointer,
+ * so it should be a string constant. */
+void nnctl_trace_begin(const char *name);
+void nnctl_trace_end(const char *name);
+void nnctl_trace_instant(const char *name);
+
+/* memory accounting, reported by the built-in memory command. the library
+ * counts what tpl, its hash tables, reply buffers and sessions (watches and
+ * offloaded jobs) allocate. an application can register tags of its own and
+ * allocate through them; a block must be freed with the tag it got. */
+#define NNCTL_MEM_TPL      0
+#define NNCTL_MEM_HASH     1
+#define NNCTL_MEM_REPLY    2
+#define NNCTL_MEM_SESSIONS 3
+#define NNCTL_MEM_TAGS    16 /* including application tags */
+int nnctl_mem_tag(const char *name); /* returns a tag, or -1 if full */
+void *nnctl_mem_alloc(int tag, size_t sz);
+void *nnctl_mem_realloc(int tag, void *ptr, size_t sz);
+void nnctl_mem_free(int tag, void *ptr);
+
 /* these are used within command callbacks */
 void nnctl_append(nnctl *, void *buf, size_t len);
 void nnctl_printf(nnctl *, const char *fmt, ...);
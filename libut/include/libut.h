@@ -10,5 +10,6 @@
 #include "uthash.h"
 #include "utringbuffer.h"
 #include "utlist.h"
+#include "utwheel.h"
 
 #endif /* __LIBUT_H_ */
@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2003-2015, Troy D. Hanson     http://troydhanson.github.com/uthash/
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* utwheel
+ *
+ * hierarchical timing wheel. time is counted in ticks, of whatever unit
+ * the caller chooses. a timer in the next 256 ticks sits in a slot of the
+ * first wheel; farther ones sit in a coarser wheel and move down a level
+ * each time the finer wheel wraps. add and cancel are O(1). the timers
+ * are embedded in the caller's structures; utwheel allocates nothing.
+ */
+
+#ifndef __UTWHEEL_H_
+#define __UTWHEEL_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#define UTWHEEL_BITS   8
+#define UTWHEEL_SLOTS  (1 << UTWHEEL_BITS)
+#define UTWHEEL_LEVELS 4   /* span 2^32 ticks; later timers re-cascade */
+
+typedef struct utwheel_timer {
+  uint64_t expires;                 /* tick at which cb runs */
+  void (*cb)(void *data);
+  void *data;
+  struct utwheel_timer **slot;      /* list we're on, or NULL if idle */
+  struct utwheel_timer *next, *prev;
+} utwheel_timer;
+
+typedef struct {
+  uint64_t now;                     /* ticks up to now have run */
+  size_t count;                     /* pending timers */
+  utwheel_timer *slots[UTWHEEL_LEVELS][UTWHEEL_SLOTS];
+  utwheel_timer *running;           /* due timers, during advance */
+} utwheel;
+
+void utwheel_init(utwheel *w, uint64_t now);
+void utwheel_timer_init(utwheel_timer *t, void (*cb)(void *data), void *data);
+void utwheel_add(utwheel *w, utwheel_timer *t, uint64_t expires);
+void utwheel_cancel(utwheel *w, utwheel_timer *t);
+uint64_t utwheel_next(utwheel *w);
+size_t utwheel_advance(utwheel *w, uint64_t now);
+
+#define utwheel_pending(t) ((t)->slot != NULL)
+
+#endif /* __UTWHEEL_H_ */
@@ -0,0 +1,140 @@
+/*
+Copyright (c) 2003-2015, Troy D. Hanson     http://troydhanson.github.com/uthash/
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include "utlist.h"
+#include "utwheel.h"
+
+#define SLOT_MASK (UTWHEEL_SLOTS-1)
+#define SPAN(level) (1ULL << (UTWHEEL_BITS * ((level)+1)))
+
+void utwheel_init(utwheel *w, uint64_t now) {
+  memset(w, 0, sizeof(*w));
+  w->now = now;
+}
+
+void utwheel_timer_init(utwheel_timer *t, void (*cb)(void *data), void *data) {
+  memset(t, 0, sizeof(*t));
+  t->cb = cb;
+  t->data = data;
+}
+
+/* put the timer in the finest wheel whose span reaches its expiry */
+static void place(utwheel *w, utwheel_timer *t) {
+  uint64_t e = t->expires, d;
+  int level;
+
+  if (e < w->now) e = w->now;
+  d = e - w->now;
+  if (d >= SPAN(UTWHEEL_LEVELS-1)) {  /* beyond the top wheel */
+    d = SPAN(UTWHEEL_LEVELS-1) - 1;
+    e = w->now + d;
+  }
+  for(level=0; d >= SPAN(level); level++) ;
+  t->slot = &w->slots[level][(e >> (UTWHEEL_BITS * level)) & SLOT_MASK];
+  DL_APPEND(*t->slot, t);
+}
+
+/* (re)arm the timer. expires is in ticks; past ticks run on next advance */
+void utwheel_add(utwheel *w, utwheel_timer *t, uint64_t expires) {
+  utwheel_cancel(w, t);
+  t->expires = expires;
+  place(w, t);
+  w->count++;
+}
+
+void utwheel_cancel(utwheel *w, utwheel_timer *t) {
+  if (t->slot == NULL) return;
+  DL_DELETE(*t->slot, t);
+  t->slot = NULL;
+  w->count--;
+}
+
+/* move the timers of a coarse slot down into finer wheels */
+static void cascade(utwheel *w, int level) {
+  utwheel_timer **slot, *t;
+  
+  slot = &w->slots[level][(w->now >> (UTWHEEL_BITS * level)) & SLOT_MASK];
+  while ( (t = *slot) != NULL) {
+    DL_DELETE(*slot, t);
+    place(w, t);
+  }
+}
+
+/* the next tick, from now, at which a timer runs or timers move down from
+ * a coarser wheel; UINT64_MAX if there are no timers. level L moves slot
+ * by slot, at ticks that are multiples of the span of level L-1. */
+uint64_t utwheel_next(utwheel *w) {
+  uint64_t t, t0, step, next = UINT64_MAX;
+  int level, k;
+
+  if (w->count == 0) return next;
+  for(level=0; level < UTWHEEL_LEVELS; level++) {
+    step = level ? SPAN(level-1) : 1;
+    t0 = (w->now + step - 1) & ~(step - 1);
+    for(k=0, t=t0; (k < UTWHEEL_SLOTS) && (t < next); k++, t += step) {
+      if (w->slots[level][(t >> (UTWHEEL_BITS * level)) & SLOT_MASK]) {
+        next = t;
+        break;
+      }
+    }
+  }
+  return next;
+}
+
+/* run the timers that expire before tick now. returns the number run.
+ * a callback may add or cancel any timer, including its own. */
+size_t utwheel_advance(utwheel *w, uint64_t now) {
+  utwheel_timer **slot, *t;
+  uint64_t next;
+  size_t n = 0;
+  int level;
+
+  while (w->now < now) {
+    /* skip ahead over ticks at which nothing happens */
+    next = utwheel_next(w);
+    if (next >= now) { w->now = now; break; }
+    w->now = next;
+    /* when a wheel wraps, the next slot of the coarser wheel comes due */
+    for(level=1; level < UTWHEEL_LEVELS; level++) {
+      if (w->now & (SPAN(level-1) - 1)) break;
+      cascade(w, level);
+    }
+    /* move the due slot to the run list, since a callback may add a
+     * timer that lands in this same slot, a full turn of the wheel later */
+    slot = &w->slots[0][w->now & SLOT_MASK];
+    w->running = *slot;
+    *slot = NULL;
+    for(t = w->running; t; t = t->next) t->slot = &w->running;
+    w->now++;
+    while ( (t = w->running) != NULL) {
+      DL_DELETE(w->running, t);
+      t->slot = NULL;
+      w->count--;
+      if (t->expires >= w->now) { utwheel_add(w, t, t->expires); continue; }
+      t->cb(t->data);
+      n++;
+    }
+  }
+  return n;
+}
@@ -2,44 +2,65 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <nanomsg/nn.h>
 #include <nanomsg/reqrep.h>
+#include <nanomsg/pubsub.h>
+#include "utstring.h"
 #include "tpl.h"
+#include "libnnctl.h"
 
 /* 
  * nnctl
  *
- * usage:  nnctl <nnctl-remote-address>
+ * usage:  nnctl [-t ms] <nnctl-remote-address>
+ *         nnctl -W <pub-address> [-i secs] <nnctl-remote-address> command ...
+ *         nnctl -M <shm-name>
  * 
  */
 
+#define WATCH_RENEW 30 /* seconds; renew watch before server lease ends */
+
 struct _CF {
   int run;
   int verbose;
+  int quiet;
   char *prompt;
   char *nn_addr; 
   int nn_socket;
   int nn_eid;
   uint64_t cookie;
+  unsigned timeout;   /* deadline sent with each request, in ms, or 0 */
+  char *pub_addr;     /* watch mode */
+  int watch_interval;
+  char *shm_name;     /* shared memory metrics mode */
 } CF = {
   .run = 1,
   .nn_addr = "tcp://127.0.0.1:9995",
   .nn_socket = -1,
   .prompt = "nnctl> ",
+  .watch_interval = 1,
 };
 
 void usage(char *prog) {
-  fprintf(stderr, "usage: %s [-v] <address>\n", prog);
+  fprintf(stderr, "usage: %s [-v] [-t ms] <address>\n", prog);
+  fprintf(stderr, "       %s -W <pub-address> [-i secs] <address> command ...\n", prog);
+  fprintf(stderr, "       %s -M <shm-name>\n", prog);
   fprintf(stderr, "options:\n");  
   fprintf(stderr, "\t-v verbose\n");  
+  fprintf(stderr, "\t-t deadline for each command in milliseconds\n");  
+  fprintf(stderr, "\t-W watch command output published at pub-address\n");  
+  fprintf(stderr, "\t-i watch interval in seconds (default 1)\n");  
+  fprintf(stderr, "\t-M read metrics a server exports in shared memory\n");  
   exit(-1);
 }
 
@@ -80,7 +101,9 @@ int do_rqst(char *line) {
   tpl_node *tn=NULL,*tr=NULL;
   tpl_bin b;
 
-  tn = tpl_map("UA(B)", &CF.cookie, &b);
+  /* the deadline, if any, rides after the cookie */
+  if (CF.timeout) tn = tpl_map("UuA(B)", &CF.cookie, &CF.timeout, &b);
+  else tn = tpl_map("UA(B)", &CF.cookie, &b);
   if (tn == NULL) goto done;
   tpl_pack(tn,0);
 
@@ -121,7 +144,7 @@ int do_rqst(char *line) {
   }
   while (tpl_unpack(tr, 1) > 0) {
     if (b.addr == NULL) continue;
-    printf("%.*s\n", b.sz, (char*)b.addr);
+    if (!CF.quiet) printf("%.*s\n", b.sz, (char*)b.addr);
     free(b.addr);
   }
 
@@ -158,18 +181,175 @@ int setup_nn() {
   return rc;
 }
 
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* subscribe to a command's output. the server runs the command once
+ * per interval for all its watchers, and publishes the output prefixed
+ * by the topic- the command words joined by a space- and a NUL. */
+int do_watch(int argc, char *argv[]) {
+  UT_string *line, *topic;
+  int i, rc = -1, sub = -1, timeo;
+  char *msg;
+  size_t tlen;
+  uint64_t renew, now;
+
+  utstring_new(line);
+  utstring_new(topic);
+  utstring_printf(line, "watch %d", CF.watch_interval);
+  for(i=0; i < argc; i++) {
+    utstring_printf(line, strchr(argv[i],' ') ? " \"%s\"" : " %s", argv[i]);
+    utstring_printf(topic, "%s%s", i ? " " : "", argv[i]);
+  }
+  tlen = utstring_len(topic) + 1; /* the NUL ends the topic */
+
+  sub = nn_socket(AF_SP, NN_SUB);
+  if (sub < 0) {
+    fprintf(stderr,"nn_socket: %s\n", nn_strerror(errno));
+    goto done;
+  }
+  if (nn_setsockopt(sub, NN_SUB, NN_SUB_SUBSCRIBE, utstring_body(topic), tlen) < 0) {
+    fprintf(stderr,"nn_setsockopt: %s\n", nn_strerror(errno));
+    goto done;
+  }
+  if (nn_connect(sub, CF.pub_addr) < 0) {
+    fprintf(stderr,"nn_connect: %s\n", nn_strerror(errno));
+    goto done;
+  }
+
+  /* the watch request is re-sent every WATCH_RENEW seconds, whether or not
+   * publications are arriving, so the server's lease never runs out. each
+   * receive waits no longer than until the next renewal */
+  while (CF.run) {
+    if (do_rqst(utstring_body(line)) < 0) goto done;
+    CF.quiet = 1;
+    renew = now_ms() + WATCH_RENEW * 1000;
+    while (CF.run && ((now = now_ms()) < renew)) {
+      timeo = renew - now;
+      nn_setsockopt(sub, NN_SOL_SOCKET, NN_RCVTIMEO, &timeo, sizeof(timeo));
+      if ( (rc = nn_recv(sub, &msg, NN_MSG, 0)) < 0) {
+        if (errno == ETIMEDOUT) continue;
+        fprintf(stderr,"nn_recv: %s\n", nn_strerror(errno));
+        goto done;
+      }
+      if (rc >= tlen) printf("%.*s", (int)(rc - tlen), msg + tlen);
+      fflush(stdout);
+      nn_freemsg(msg);
+    }
+  }
+
+  rc = 0;
+
+ done:
+  if (sub != -1) nn_close(sub);
+  utstring_free(line);
+  utstring_free(topic);
+  return rc;
+}
+
+/* snapshot the metrics a server exports with nnctl_metrics_shm. this maps
+ * the file and copies it under its seqlock; the server is not involved. */
+int do_shm(char *name) {
+  char path[256], *types[] = {"", "counter", "gauge", "histogram"};
+  int fd=-1, rc=-1, tries=0;
+  nnctl_shm_hdr *hdr=MAP_FAILED;
+  nnctl_shm_ent *ent=NULL, *e;
+  uint64_t seq;
+  uint32_t n=0, m, i;
+  struct stat sb;
+
+  snprintf(path, sizeof(path), "%s%s", strchr(name,'/') ? "" : "/dev/shm/", name);
+  if ( (fd = open(path, O_RDONLY)) == -1) {
+    fprintf(stderr,"open %s: %s\n", path, strerror(errno));
+    goto done;
+  }
+  if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(nnctl_shm_hdr)) {
+    fprintf(stderr,"%s: not a metrics export\n", path);
+    goto done;
+  }
+  hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (hdr == MAP_FAILED) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    goto done;
+  }
+  if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != NNCTL_SHM_MAGIC) {
+    fprintf(stderr,"%s: not a metrics export\n", path);
+    goto done;
+  }
+  if ( (ent = malloc(sb.st_size)) == NULL) goto done;
+
+  /* retry while the writer is mid-update (seq odd), or the count read
+   * under it does not fit, or seq changed while we copied */
+  for(;;) {
+    if (++tries > 1000) {
+      fprintf(stderr,"%s: no consistent snapshot\n", path);
+      goto done;
+    }
+    seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+    m = __atomic_load_n(&hdr->nmetrics, __ATOMIC_RELAXED);
+    if ((seq & 1) ||
+        (sizeof(nnctl_shm_hdr) + (size_t)m * sizeof(nnctl_shm_ent) > sb.st_size)) {
+      usleep(100);
+      continue;
+    }
+    memcpy(ent, hdr + 1, m * sizeof(nnctl_shm_ent));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq) {
+      n = m;
+      break;
+    }
+  }
+
+  for(i=0; i < n; i++) {
+    e = &ent[i];
+    e->name[sizeof(e->name)-1] = '\0';
+    if (e->type > NNCTL_HISTOGRAM) continue;
+    printf("%-30s %-10s ", e->name, types[e->type]);
+    if (e->type != NNCTL_HISTOGRAM) {
+      printf("%" PRId64 "\n", e->v);
+      continue;
+    }
+    printf("count=%" PRId64 " sum=%" PRId64, e->v, e->sum);
+    if (e->v) printf(" p50<=%" PRIu64 " p99<=%" PRIu64 " max<=%" PRIu64,
+      nnctl_hist_quantile(e->b, e->v, 0.5), nnctl_hist_quantile(e->b, e->v, 0.99),
+      nnctl_hist_quantile(e->b, e->v, 1.0));
+    printf("\n");
+  }
+  rc = 0;
+
+ done:
+  if (hdr != MAP_FAILED) munmap(hdr, sb.st_size);
+  if (fd != -1) close(fd);
+  if (ent) free(ent);
+  return rc;
+}
+
 int main(int argc, char *argv[]) {
   int opt,quit;
   char *line;
 
-  while ( (opt = getopt(argc, argv, "v+h")) != -1) {
+  while ( (opt = getopt(argc, argv, "v+hW:i:M:t:")) != -1) {
     switch (opt) {
       case 'v': CF.verbose++; break;
+      case 'M': CF.shm_name = strdup(optarg); break;
+      case 'W': CF.pub_addr = strdup(optarg); break;
+      case 'i': CF.watch_interval = atoi(optarg); break;
+      case 't': CF.timeout = atoi(optarg); break;
       case 'h': default: usage(argv[0]); break;
     }
   }
+  if (CF.shm_name) return do_shm(CF.shm_name) ? -1 : 0;
   if (optind < argc) CF.nn_addr = strdup(argv[optind++]);
+  if (CF.pub_addr && (optind >= argc)) usage(argv[0]);
   if (setup_nn()) goto done;
+
+  if (CF.pub_addr) {
+    do_watch(argc - optind, &argv[optind]);
+    goto done;
+  }
   using_history();
 
   while(CF.run) {
@@ -21,7 +21,11 @@ struct _CF {
   int rep_socket;
   int rep_socket_fd;
   char *rep_addr;
+  char *pub_addr;
+  char *shm_name;
   void *nnctl;
+  nnctl_timer *tick_timer;
+  nnctl_timer *periodic_timer;
 } CF = {
   .signal_fd = -1,
   .epoll_fd = -1,
@@ -31,11 +35,12 @@ struct _CF {
 };
 
 /* signals that we'll accept via signalfd in epoll */
-int sigs[] = {SIGHUP,SIGTERM,SIGINT,SIGQUIT,SIGALRM};
+int sigs[] = {SIGHUP,SIGTERM,SIGINT,SIGQUIT};
 
 /* place holder for periodic (every 10sec) worker */
-void periodic_work() {
+void periodic_work(nnctl *cp, void *data) {
   if (CF.verbose) fprintf(stderr,"periodic work...\n");
+  nnctl_timer_set(CF.periodic_timer, 10000);
 }
 
 int handle_signal() {
@@ -48,10 +53,6 @@ int handle_signal() {
   }
 
   switch(info.ssi_signo) {
-    case SIGALRM: 
-      if ((++CF.ticks % 10) == 0) periodic_work();
-      alarm(1); 
-      break;
     default: 
       fprintf(stderr,"got signal %d\n", info.ssi_signo);  
       goto done;
@@ -64,6 +65,11 @@ int handle_signal() {
   return rc;
 }
 
+void tick(nnctl *cp, void *data) {
+  CF.ticks++;
+  nnctl_timer_set(CF.tick_timer, 1000);
+}
+
 int new_epoll(int events, int fd) {
   int rc;
   struct epoll_event ev;
@@ -90,6 +96,11 @@ int symbols_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
   return 0;
 }
 
+int ticks_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
+  nnctl_printf(cp,"%d\n", CF.ticks);
+  return 0;
+}
+
 int shutdown_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
   nnctl_printf(cp,"Shutting down\n");
   CF.request_exit=1;
@@ -97,20 +108,22 @@ int shutdown_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
 }
 
 nnctl_cmd cmds[] = { 
-  {"symbols",      symbols_cmd,      "symbol info"},
+  {"symbols",      symbols_cmd,      "symbol info", NNCTL_OFFLOAD, 2000},
+  {"ticks",        ticks_cmd,        "seconds since start"},
   {"shutdown",     shutdown_cmd,     "shutdown server"},
   {NULL,           NULL,             NULL},
 };
 
 void usage(char *prog) {
-  fprintf(stderr, "usage: %s [-v] <local-address>\n", prog);
+  fprintf(stderr, "usage: %s [-v] [-p <pub-address>] [-m <shm-name>] <local-address>\n", prog);
   exit(-1);
 }
 
 int setup_nano(void) {
   int rc = -1, eid;
 
-  rc = (CF.rep_socket = nn_socket(AF_SP, NN_REP));
+  /* raw, so that offloaded commands can reply out of order */
+  rc = (CF.rep_socket = nn_socket(AF_SP_RAW, NN_REP));
   if (rc < 0) goto done;
   rc = (eid = nn_bind(CF.rep_socket, CF.rep_addr));
   if (rc < 0) goto done;
@@ -132,12 +145,17 @@ int msg_loop(void) {
   if (rc < 0) goto done;
   if (new_epoll(EPOLLIN, CF.rep_socket_fd)) goto done;
   if (new_epoll(EPOLLIN, CF.signal_fd)) goto done;
+  if (new_epoll(EPOLLIN, nnctl_eventfd(CF.nnctl))) goto done;
+  if (new_epoll(EPOLLIN, nnctl_timerfd(CF.nnctl))) goto done;
 
-  alarm(1);
   while (epoll_wait(CF.epoll_fd, &ev, 1, -1) > 0) {
     if (CF.verbose > 1)  fprintf(stderr,"epoll reports fd %d\n", ev.data.fd);
+    nnctl_trace_begin("event");
     if (ev.data.fd == CF.rep_socket_fd) rc = nnctl_exec(CF.nnctl, CF.rep_socket);
     if (ev.data.fd == CF.signal_fd)     rc = handle_signal();
+    if (ev.data.fd == nnctl_eventfd(CF.nnctl)) rc = nnctl_complete(CF.nnctl, CF.rep_socket);
+    if (ev.data.fd == nnctl_timerfd(CF.nnctl)) rc = nnctl_timer_exec(CF.nnctl);
+    nnctl_trace_end("event");
     if (rc < 0) goto done;
     if (CF.request_exit) break;
   }
@@ -151,18 +169,22 @@ int msg_loop(void) {
 int main(int argc, char *argv[]) {
   int opt, n, rc=-1;
 
-  while ( (opt = getopt(argc, argv, "v+")) != -1) {
+  while ( (opt = getopt(argc, argv, "v+p:m:")) != -1) {
     switch (opt) {
       case 'v': CF.verbose++; break;
+      case 'p': CF.pub_addr = strdup(optarg); break;
+      case 'm': CF.shm_name = strdup(optarg); break;
       default: usage(argv[0]); break;
     }
   }
 
   if (optind < argc) CF.rep_addr = strdup(argv[optind++]);
 
-  /* block all signals. we take signals synchronously via signalfd */
+  /* block all signals. we take signals synchronously via signalfd. 
+   * SIGPROF stays unblocked for the profiler in the control port */
   sigset_t all;
   sigfillset(&all);
+  sigdelset(&all, SIGPROF);
   sigprocmask(SIG_SETMASK,&all,NULL);
 
   /* a few signals we'll accept via our signalfd */
@@ -187,6 +209,12 @@ int main(int argc, char *argv[]) {
   /* fire up nano socket. begin loop */
   if (setup_nano() == -1) goto done;
   CF.nnctl = nnctl_init(cmds,NULL);
+  if (CF.pub_addr && nnctl_watch_bind(CF.nnctl, CF.pub_addr)) goto done;
+  if (CF.shm_name && nnctl_metrics_shm(CF.nnctl, CF.shm_name, 100)) goto done;
+  CF.tick_timer = nnctl_timer_new(CF.nnctl, tick, NULL);
+  CF.periodic_timer = nnctl_timer_new(CF.nnctl, periodic_work, NULL);
+  nnctl_timer_set(CF.tick_timer, 1000);
+  nnctl_timer_set(CF.periodic_timer, 10000);
   if (msg_loop() < 0) goto done;
   
   rc = 0;
@@ -195,6 +223,8 @@ int main(int argc, char *argv[]) {
   if (CF.rep_socket != -1) nn_close(CF.rep_socket);
   if (CF.epoll_fd != -1) close(CF.epoll_fd);
   if (CF.signal_fd != -1) close(CF.signal_fd);
+  if (CF.tick_timer) nnctl_timer_free(CF.tick_timer);
+  if (CF.periodic_timer) nnctl_timer_free(CF.periodic_timer);
   if (CF.nnctl) nnctl_free(CF.nnctl);
   return rc;
 }
@@ -0,0 +1,70 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "libnnctl.h"
+
+/* a service without an event loop. the control port runs on its own 
+ * thread; the main thread stands in for the data plane. */
+
+struct _CF {
+  int verbose;
+  int cpu;
+  char *rep_addr;
+  nnctl *nnctl;
+  nnctl_metric *loops;
+  int request_exit;  /* written by the control thread; atomic access */
+} CF = {
+  .cpu = -1,
+  .rep_addr = "tcp://127.0.0.1:9995",
+};
+
+int shutdown_cmd(nnctl *cp, nnctl_arg *arg, void *data, uint64_t *cookie) {
+  nnctl_printf(cp,"Shutting down\n");
+  __atomic_store_n(&CF.request_exit, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+nnctl_cmd cmds[] = { 
+  {"shutdown",     shutdown_cmd,     "shutdown server"},
+  {NULL,           NULL,             NULL},
+};
+
+void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-v] [-c <cpu>] <local-address>\n", prog);
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, rc=-1;
+
+  while ( (opt = getopt(argc, argv, "v+c:")) != -1) {
+    switch (opt) {
+      case 'v': CF.verbose++; break;
+      case 'c': CF.cpu = atoi(optarg); break;
+      default: usage(argv[0]); break;
+    }
+  }
+
+  if (optind < argc) CF.rep_addr = strdup(argv[optind++]);
+
+  CF.nnctl = nnctl_init(cmds,NULL);
+  if (CF.nnctl == NULL) goto done;
+  CF.loops = nnctl_metric_new(CF.nnctl, "loops", NNCTL_COUNTER);
+  nnctl_set_affinity(CF.nnctl, CF.cpu);
+  if (nnctl_start_thread(CF.nnctl, CF.rep_addr)) goto done;
+
+  /* the data plane */
+  while (!__atomic_load_n(&CF.request_exit, __ATOMIC_ACQUIRE)) {
+    nnctl_metric_add(CF.loops, 1);
+    usleep(1000);
+  }
+
+  rc = 0;
+
+ done:
+  if (CF.nnctl) nnctl_free(CF.nnctl);
+  return rc;
+}
@@ -30,12 +30,16 @@ static const char id[]="$Id: tpl.c 192 2009-04-24 10:35:30Z thanson $";
 #include <stdarg.h>  /* va_list */
 #include <string.h>  /* memcpy, memset, strchr */
 #include <stdio.h>   /* printf (tpl_hook.oops default function) */
+#include <time.h>    /* clock_gettime, for TPL_STATS */
 
 #ifndef _WIN32
 #include <unistd.h>     /* for ftruncate */
+#include <sys/uio.h>    /* struct iovec */
 #else
 #include <io.h>
 #define ftruncate(x,y) _chsize(x,y)
+#define fdatasync(x) _commit(x)
+struct iovec { void *iov_base; size_t iov_len; };
 #endif
 #include <sys/types.h>  /* for 'open' */
 #include <sys/stat.h>   /* for 'open' */
@@ -65,6 +69,11 @@ typedef unsigned __int64 uint64_t;
 
 #include "tpl.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>  /* pshufb, for byteswapping */
+#define TPL_SIMD_X86
+#endif
+
 #define TPL_GATHER_BUFLEN 8192
 #define TPL_MAGIC "tpl"
 
@@ -83,18 +92,36 @@ typedef unsigned __int64 uint64_t;
         }                                                       \
     } while (0);
 
-#define fatal_oom() tpl_hook.fatal("out of memory\n")
+#define fatal_oom() TPL_HOOK.fatal("out of memory\n")
 
-/* bit flags (internal). preceded by the external flags in tpl.h */
-#define TPL_WRONLY         (1 << 9)  /* app has initiated tpl packing  */
-#define TPL_RDONLY         (1 << 10)  /* tpl was loaded (for unpacking) */
-#define TPL_XENDIAN        (1 << 11)  /* swap endianness when unpacking */
-#define TPL_OLD_STRING_FMT (1 << 12) /* tpl has strings in 1.2 format */
+/* bit flags (internal). preceded by the external flags in tpl.h, which
+ * may grow up to bit 23 */
+#define TPL_WRONLY         (1 << 24) /* app has initiated tpl packing  */
+#define TPL_RDONLY         (1 << 25) /* tpl was loaded (for unpacking) */
+#define TPL_XENDIAN        (1 << 26) /* swap endianness when unpacking */
+#define TPL_OLD_STRING_FMT (1 << 27) /* tpl has strings in 1.2 format */
+#define TPL_ROOT_UNPACKED  (1 << 28) /* tpl_unpack(r,0) ran since the load */
 
 /* values for the flags byte that appears after the magic prefix */
-#define TPL_SUPPORTED_BITFLAGS 3
+#define TPL_SUPPORTED_BITFLAGS 31
 #define TPL_FL_BIGENDIAN   (1 << 0)
 #define TPL_FL_NULLSTRINGS (1 << 1)
+#define TPL_FL_WIDE        (1 << 2) /* overall length is 64 bits (image > 4GB) */
+#define TPL_FL_INDEX       (1 << 3) /* ends with an index of array elements */
+#define TPL_FL_CRC         (1 << 4) /* ends with a CRC32C of all before it */
+
+/* the index footer (TPL_INDEX) comes after the data, inside the overall
+ * length. for each A(...) at the top level, a table of the image offsets
+ * of its elements; then a directory entry for each such A; then the
+ * number of entries, and the length of the footer. all in image order */
+#define TPL_INDEX_ENT_SZ (2*sizeof(uint32_t) + 2*sizeof(uint64_t))
+#define TPL_INDEX_TAIL_SZ (sizeof(uint32_t) + sizeof(uint64_t))
+typedef struct tpl_index_ent {
+    uint32_t i;         /* as in tpl_unpack(tn, i) */
+    uint32_t num;       /* elements */
+    uint64_t len;       /* serialized length of the A, with its count word */
+    uint64_t table;     /* image offset of its element offsets */
+} tpl_index_ent;
 
 /* char values for node type */
 #define TPL_TYPE_ROOT   0
@@ -123,6 +150,8 @@ typedef unsigned __int64 uint64_t;
 #define ERR_INCONSISTENT_SZ3   (-9)
 #define ERR_INCONSISTENT_SZ4   (-10)
 #define ERR_UNSUPPORTED_FLAGS  (-11)
+#define ERR_INCONSISTENT_SZ5   (-12)
+#define ERR_CRC_MISMATCH       (-13)
 
 /* access to A(...) nodes by index */
 typedef struct tpl_pidx {
@@ -134,21 +163,50 @@ typedef struct tpl_pidx {
 typedef struct tpl_atyp {
     uint32_t num;    /* num elements */
     size_t sz;       /* size of each backbone's datum */
-    struct tpl_backbone *bb,*bbtail; 
+    char *bb;        /* the backbone: num datums, contiguous */
+    uint32_t cap;    /* datums the backbone has room for */
     void *cur;                       
 } tpl_atyp;
 
-/* backbone to extend A(...) lists dynamically */
-typedef struct tpl_backbone {
-    struct tpl_backbone *next;
-    /* when this structure is malloc'd, extra space is alloc'd at the
-     * end to store the backbone "datum", and data points to it. */
-#if __STDC_VERSION__ < 199901
-    char *data;  
-#else
-    char data[];
-#endif
-} tpl_backbone;
+#define TPL_BB_MIN 8 /* initial backbone capacity; it doubles as it fills */
+
+/* a packed B buffer. ref is set if addr is the caller's (TPL_NOCOPY) */
+typedef struct tpl_pbin {
+    tpl_bin b;
+    int ref;
+} tpl_pbin;
+
+/* staging space for TPL_IOV dumps, kept by the map and reused */
+typedef struct tpl_chunk {
+    struct tpl_chunk *next;
+    size_t sz;          /* bytes of space following this header */
+} tpl_chunk;
+
+/* where tpl_dump puts the image. bytes are copied to dv: the image itself
+ * in memory, or staging space that is passed to a sink or an iovec when
+ * full. large B buffers go to a sink or iovec by reference, uncopied. */
+typedef struct tpl_out {
+    char *dv, *end;     /* next byte goes here; end of the space */
+    char *mark;         /* bytes from here to dv are not yet passed on */
+    size_t left;        /* bytes of the image still to come */
+    tpl_sink_cb *cb;    /* TPL_SINK (and TPL_FD) */
+    void *data;
+    char *stage;
+    struct iovec *iov;  /* TPL_IOV */
+    int iovcnt, iovmax;
+    tpl_chunk **next_chunk;
+    const tpl_alloc_t *a;
+    int rc;
+    int index;          /* TPL_INDEX: append the index footer */
+    size_t total;       /* image size; total - left is the offset of dv */
+    uint64_t *offs;     /* where the next A records its element offsets */
+    int sum;            /* TPL_CRC: checksum the image, as it goes out */
+    uint32_t crc;
+    char *summed;       /* bytes from here to dv are not yet checksummed */
+} tpl_out;
+
+#define TPL_CHUNK   (64*1024) /* staging space for sinks and iovecs */
+#define TPL_REF_MIN 1024      /* B buffers this long are passed by reference */
 
 /* mmap record */
 typedef struct tpl_mmap_rec {
@@ -164,8 +222,71 @@ typedef struct tpl_root_data {
     tpl_mmap_rec mmap;
     char *fmt;
     int *fxlens, num_fxlens;
+    tpl_alloc_t alloc;  /* allocates the map and everything it packs/unpacks */
+    tpl_chunk *chunks;  /* staging space of TPL_IOV dumps */
+    char *index;        /* directory of a loaded image's index footer */
+    uint32_t nindex;    /* its entries */
+    uint64_t index_at;  /* image offset of the footer */
 } tpl_root_data;
 
+/* where tpl_map_a gets its arguments. when compiling a schema there are
+ * no pointers yet: each field's node is bound to the argument it will get */
+typedef struct tpl_bind {
+    tpl_node *n;
+    int arg;
+} tpl_bind;
+
+typedef struct tpl_args {
+    va_list *ap;
+    int compile;
+    int nptrs;          /* pointer arguments taken */
+    tpl_bind *binds;
+    int nbinds, maxbinds;
+} tpl_args;
+
+/* a compiled format. the template map holds everything tpl_map derives
+ * from the format- node types, fxlens, sizes, serialized overhead- and,
+ * in the addr of each S field, its offset in the structure */
+struct tpl_schema {
+    tpl_node *map;
+    int *arg;           /* for each node in preorder: its pointer argument, or -1 */
+    size_t *dsz;        /* and the size of its data, if it is an atom */
+    int nnodes, nptrs;
+};
+
+/* a pull parser over an image arriving in pieces. its buffer holds image
+ * bytes [seen, seen+have), of which pos are used up; it is compacted only
+ * when it runs short, so what the last element points into stays put */
+struct tpl_stream {
+    tpl_node *r;
+    int fd;             /* read as needed, or -1 if fed */
+    int state;
+    char *buf;
+    size_t max, have, pos;
+    uint64_t seen;
+    uint64_t len;       /* overall image length, once pre is known */
+    size_t pre;         /* length of the preamble through its length word */
+    char intlflags;
+    tpl_node *c;        /* next root node to unpack */
+    uint32_t left;      /* elements left in A c */
+    uint32_t crc;       /* of the image up to summed, if it has a CRC */
+    uint64_t summed;
+    char trailer[4];    /* the CRC at the end of the image */
+};
+
+#define TPL_STREAM_PRE  0   /* wants the preamble */
+#define TPL_STREAM_ROOT 1   /* at root node c */
+#define TPL_STREAM_ELT  2   /* in the elements of root A c */
+#define TPL_STREAM_TAIL 3   /* skipping any index footer */
+#define TPL_STREAM_DONE 4
+#define TPL_STREAM_FAIL 5
+
+/* a log of images appended by tpl_append, mapped for reading */
+struct tpl_frames {
+    tpl_mmap_rec mmap;
+    size_t off;         /* where the next frame starts */
+};
+
 /* node type to size mapping */
 struct tpl_type_t {
     char c;
@@ -174,22 +295,36 @@ struct tpl_type_t {
 
 
 /* Internal prototypes */
-static tpl_node *tpl_node_new(tpl_node *parent);
+static tpl_node *tpl_node_new(tpl_node *parent, const tpl_alloc_t *a);
+static tpl_node *tpl_map_a(const tpl_alloc_t *a, char *fmt, tpl_args *args);
 static tpl_node *tpl_find_i(tpl_node *n, int i);
 static void *tpl_cpv(void *datav, const void *data, size_t sz);
 static void *tpl_extend_backbone(tpl_node *n);
 static char *tpl_fmt(tpl_node *r);
-static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv);
+static void tpl_dump_atyp(tpl_node *n, tpl_atyp* at, tpl_out *o);
 static size_t tpl_ser_osz(tpl_node *n);
 static void tpl_free_atyp(tpl_node *n,tpl_atyp *atyp);
-static int tpl_dump_to_mem(tpl_node *r, void *addr, size_t sz);
-static int tpl_mmap_file(char *filename, tpl_mmap_rec *map_rec);
-static int tpl_mmap_output_file(char *filename, size_t sz, void **text_out);
+static int tpl_dump_to_mem(tpl_node *r, void *addr, size_t sz, int mode);
+static int tpl_dump_out(tpl_node *r, tpl_out *o, size_t sz);
+static void tpl_free_bin(const tpl_alloc_t *a, tpl_bin *binp);
+static int tpl_mmap_file(char *filename, tpl_mmap_rec *map_rec, int mode);
+static int tpl_mmap_output_file(char *filename, size_t sz, void **text_out, int mode);
+static int tpl_load_a(tpl_node *r, int mode, char *filename, void *addr, size_t sz, int fd);
+static double tpl_now(void);
 static int tpl_cpu_bigendian(void);
 static int tpl_needs_endian_swap(void *);
+static size_t tpl_img_len(void *d, size_t avail, uint64_t *len);
 static void tpl_byteswap(void *word, int len);
+static void tpl_byteswap_n(void *buf, int len, size_t count);
+static uint32_t tpl_crc32c(uint32_t crc, const void *buf, size_t len);
 static void tpl_fatal(const char *fmt, ...);
 static int tpl_serlen(tpl_node *r, tpl_node *n, void *dv, size_t *serlen);
+static int tpl_serlen_n(tpl_node *r, tpl_node *n, void *dv, int num, size_t *serlen);
+static size_t tpl_index_sz(tpl_node *r);
+static int tpl_index_get(tpl_node *r, int i, tpl_index_ent *e);
+static int tpl_index_off(tpl_node *r, tpl_index_ent *e, uint32_t k, uint64_t *off);
+static int tpl_index_open(tpl_node *r, size_t data, uint64_t len, int trust);
+static int tpl_node_i(tpl_node *r, tpl_node *n);
 static int tpl_unpackA0(tpl_node *r);
 static int tpl_oops(const char *fmt, ...);
 static int tpl_gather_mem( char *buf, size_t len, tpl_gather_t **gs, tpl_gather_cb *cb, void *data);
@@ -230,6 +365,28 @@ tpl_hook_t tpl_hook = {
     /* .gather_max = */ 0 /* max tpl size (bytes) for tpl_gather */
 };
 
+/* a thread given hooks of its own by tpl_set_hook uses them instead */
+#ifdef _MSC_VER
+#define TPL_THREAD __declspec(thread)
+#else
+#define TPL_THREAD __thread
+#endif
+static TPL_THREAD tpl_hook_t tpl_thread_hook;
+static TPL_THREAD int tpl_thread_hooked;
+#define TPL_HOOK (*(tpl_thread_hooked ? &tpl_thread_hook : &tpl_hook))
+
+/* maps made by tpl_map use the hooks, looked up at each call */
+static void *tpl_hook_malloc(void *ctx, size_t sz) { return TPL_HOOK.malloc(sz); }
+static void *tpl_hook_realloc(void *ctx, void *ptr, size_t sz) { return TPL_HOOK.realloc(ptr,sz); }
+static void tpl_hook_free(void *ctx, void *ptr) { TPL_HOOK.free(ptr); }
+static const tpl_alloc_t tpl_hook_alloc = {
+    tpl_hook_malloc, tpl_hook_realloc, tpl_hook_free, NULL
+};
+
+#define tpl_amalloc(a,sz)     ((a)->malloc((a)->ctx,(sz)))
+#define tpl_arealloc(a,p,sz)  ((a)->realloc((a)->ctx,(p),(sz)))
+#define tpl_afree(a,p)        ((a)->free((a)->ctx,(p)))
+
 static const char tpl_fmt_chars[] = "AS($)BiucsfIUjv#"; /* valid format chars */
 static const char tpl_S_fmt_chars[] = "iucsfIUjv#$()"; /* valid within S(...) */
 static const char tpl_datapeek_ok_chars[] = "iucsfIUjv"; /* valid in datapeek */
@@ -259,9 +416,9 @@ static int tpl_oops(const char *fmt, ...) {
 }
 
 
-static tpl_node *tpl_node_new(tpl_node *parent) {
+static tpl_node *tpl_node_new(tpl_node *parent, const tpl_alloc_t *a) {
     tpl_node *n;
-    if ((n=tpl_hook.malloc(sizeof(tpl_node))) == NULL) {
+    if ((n=tpl_amalloc(a,sizeof(tpl_node))) == NULL) {
         fatal_oom();
     }
     n->addr=NULL;
@@ -309,6 +466,28 @@ char *calc_field_addr(tpl_node *parent, int type,char *struct_addr, int ordinal)
     return struct_addr + offset;
 }
 
+/* give the calling thread hooks of its own, copied from h, with any it
+ * leaves NULL taken from tpl_hook. NULL puts it back on tpl_hook */
+TPL_API void tpl_set_hook(const tpl_hook_t *h) {
+    if (h == NULL) {
+        tpl_thread_hooked = 0;
+        return;
+    }
+    tpl_thread_hook = *h;
+    if (!h->oops) tpl_thread_hook.oops = tpl_hook.oops;
+    if (!h->malloc) tpl_thread_hook.malloc = tpl_hook.malloc;
+    if (!h->realloc) tpl_thread_hook.realloc = tpl_hook.realloc;
+    if (!h->free) tpl_thread_hook.free = tpl_hook.free;
+    if (!h->fatal) tpl_thread_hook.fatal = tpl_hook.fatal;
+    tpl_thread_hooked = 1;
+}
+
+/* the hooks in effect for the calling thread, to free what tpl allocated
+ * through them (tpl_peek's format string, a dumped image) */
+TPL_API const tpl_hook_t *tpl_get_hook(void) {
+    return &TPL_HOOK;
+}
+
 TPL_API tpl_node *tpl_map(char *fmt,...) {
   va_list ap;
   tpl_node *tn;
@@ -319,9 +498,56 @@ TPL_API tpl_node *tpl_map(char *fmt,...) {
   return tn;
 }
 
+TPL_API tpl_node *tpl_map_ex(const tpl_alloc_t *alloc, char *fmt,...) {
+  va_list ap;
+  tpl_node *tn;
+  tpl_args args;
+
+  memset(&args,0,sizeof(args));
+  va_start(ap,fmt);
+  args.ap = &ap;
+  tn = tpl_map_a(alloc ? alloc : &tpl_hook_alloc, fmt, &args);
+  va_end(ap);
+  return tn;
+}
+
 TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
+    va_list aq;
+    tpl_node *tn;
+    tpl_args args;
+
+    memset(&args,0,sizeof(args));
+    va_copy(aq,ap);
+    args.ap = &aq;
+    tn = tpl_map_a(&tpl_hook_alloc, fmt, &args);
+    va_end(aq);
+    return tn;
+}
+
+/* next pointer argument; a placeholder when compiling a schema */
+static void *tpl_arg_ptr(tpl_args *args) {
+    args->nptrs++;
+    if (args->compile) return NULL;
+    return va_arg(*args->ap, void*);
+}
+
+/* when compiling, note that node n gets its address from pointer arg */
+static void tpl_arg_bind(tpl_args *args, tpl_node *n, int arg) {
+    if (!args->compile) return;
+    if (args->nbinds == args->maxbinds) {
+        args->maxbinds = args->maxbinds ? args->maxbinds*2 : 16;
+        args->binds = TPL_HOOK.realloc(args->binds, 
+                                       args->maxbinds * sizeof(tpl_bind));
+        if (!args->binds) fatal_oom();
+    }
+    args->binds[args->nbinds].n = n;
+    args->binds[args->nbinds].arg = arg;
+    args->nbinds++;
+}
+
+static tpl_node *tpl_map_a(const tpl_alloc_t *a, char *fmt, tpl_args *args) {
     int lparen_level=0,expect_lparen=0,t=0,in_structure=0,ordinal=0;
-    int in_nested_structure=0;
+    int in_nested_structure=0,struct_arg=0;
     char *c, *peek, *struct_addr=NULL, *struct_next;
     tpl_node *root,*parent,*n=NULL,*preceding,*iter_start_node=NULL,
              *struct_widest_node=NULL, *np; tpl_pidx *pidx;
@@ -332,11 +558,12 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
     ptrdiff_t inter_elt_len=0; /* padded element length of contiguous structs in array */
 
 
-    root = tpl_node_new(NULL);
+    root = tpl_node_new(NULL,a);
     root->type = TPL_TYPE_ROOT; 
-    root->data = (tpl_root_data*)tpl_hook.malloc(sizeof(tpl_root_data));
+    root->data = (tpl_root_data*)tpl_amalloc(a,sizeof(tpl_root_data));
     if (!root->data) fatal_oom();
     memset((tpl_root_data*)root->data,0,sizeof(tpl_root_data));
+    ((tpl_root_data*)root->data)->alloc = *a;
 
     /* set up root nodes special ser_osz to reflect overhead of preamble */
     root->ser_osz =  sizeof(uint32_t); /* tpl leading length */
@@ -366,7 +593,7 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                 else if (*c=='f') t=TPL_TYPE_DOUBLE;
 
                 if (expect_lparen) goto fail;
-                n = tpl_node_new(parent);
+                n = tpl_node_new(parent,a);
                 n->type = t;
                 if (in_structure) {
                     if (ordinal == 1) {
@@ -378,8 +605,12 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                       struct_widest_node = n;
                     }
                     n->addr = calc_field_addr(parent,n->type,struct_addr,ordinal++);
-                } else n->addr = (void*)va_arg(ap,void*);
-                n->data = tpl_hook.malloc(tpl_types[t].sz);
+                    tpl_arg_bind(args,n,struct_arg);
+                } else {
+                    n->addr = tpl_arg_ptr(args);
+                    tpl_arg_bind(args,n,args->nptrs-1);
+                }
+                n->data = tpl_amalloc(a,tpl_types[t].sz);
                 if (!n->data) fatal_oom();
                 if (n->parent->type == TPL_TYPE_ARY) 
                     ((tpl_atyp*)(n->parent->data))->sz += tpl_types[t].sz;
@@ -387,7 +618,7 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                 break;
             case 's':
                 if (expect_lparen) goto fail;
-                n = tpl_node_new(parent);
+                n = tpl_node_new(parent,a);
                 n->type = TPL_TYPE_STR;
                 if (in_structure) {
                     if (ordinal == 1) {
@@ -398,8 +629,12 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                       struct_widest_node = n;
                     }
                     n->addr = calc_field_addr(parent,n->type,struct_addr,ordinal++);
-                } else n->addr = (void*)va_arg(ap,void*);
-                n->data = tpl_hook.malloc(sizeof(char*));
+                    tpl_arg_bind(args,n,struct_arg);
+                } else {
+                    n->addr = tpl_arg_ptr(args);
+                    tpl_arg_bind(args,n,args->nptrs-1);
+                }
+                n->data = tpl_amalloc(a,sizeof(char*));
                 if (!n->data) fatal_oom();
                 *(char**)(n->data) = NULL;
                 if (n->parent->type == TPL_TYPE_ARY) 
@@ -423,12 +658,12 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                 pound_prod=1;
                 num_contig_fxlens=0;
                 for(peek=c; *peek == '#'; peek++) {
-                  pound_num = va_arg(ap, int);
+                  pound_num = va_arg(*args->ap, int);
                   if (pound_num < 1) {
-                    tpl_hook.fatal("non-positive iteration count %d\n", pound_num);
+                    TPL_HOOK.fatal("non-positive iteration count %d\n", pound_num);
                   }
                   if (num_contig_fxlens >= (sizeof(contig_fxlens)/sizeof(contig_fxlens[0]))) {
-                    tpl_hook.fatal("contiguous # exceeds hardcoded limit\n");
+                    TPL_HOOK.fatal("contiguous # exceeds hardcoded limit\n");
                   }
                   contig_fxlens[num_contig_fxlens++] = pound_num;
                   pound_prod *= pound_num;
@@ -437,10 +672,10 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                 c = peek-1;
                 /* differentiate atom-# from struct-# by noting preceding rparen */
                 if (applies_to_struct) { /* insert # node to induce looping */
-                  n = tpl_node_new(parent);
+                  n = tpl_node_new(parent,a);
                   n->type = TPL_TYPE_POUND;
                   n->num = pound_prod;
-                  n->data = tpl_hook.malloc(sizeof(tpl_pound_data));
+                  n->data = tpl_amalloc(a,sizeof(tpl_pound_data));
                   if (!n->data) fatal_oom();
                   pd = (tpl_pound_data*)n->data;
                   pd->inter_elt_len = inter_elt_len;
@@ -453,14 +688,14 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                       ((tpl_atyp*)(n->parent->data))->sz += 
                          tpl_types[np->type].sz * (np->num * (n->num - 1));
                     }
-                    np->data = tpl_hook.realloc(np->data, tpl_types[np->type].sz * 
+                    np->data = tpl_arealloc(a,np->data, tpl_types[np->type].sz * 
                                                           np->num * n->num);
                     if (!np->data) fatal_oom();
                     memset(np->data, 0, tpl_types[np->type].sz * np->num * n->num);
                   }
                 } else { /* simple atom-# form does not require a loop */
                   preceding->num = pound_prod;
-                  preceding->data = tpl_hook.realloc(preceding->data, 
+                  preceding->data = tpl_arealloc(a,preceding->data, 
                       tpl_types[t].sz * preceding->num);
                   if (!preceding->data) fatal_oom();
                   memset(preceding->data,0,tpl_types[t].sz * preceding->num);
@@ -475,7 +710,7 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                 (((tpl_root_data*)root->data)->num_fxlens) += num_contig_fxlens;
                 num_fxlens = ((tpl_root_data*)root->data)->num_fxlens; /* new value */
                 fxlens = ((tpl_root_data*)root->data)->fxlens;
-                fxlens = tpl_hook.realloc(fxlens, sizeof(int) * num_fxlens);
+                fxlens = tpl_arealloc(a,fxlens, sizeof(int) * num_fxlens);
                 if (!fxlens) fatal_oom();
                 ((tpl_root_data*)root->data)->fxlens = fxlens;
                 for(i=0; i < num_contig_fxlens; i++) fxlens[j++] = contig_fxlens[i];
@@ -484,10 +719,11 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
             case 'B':
                 if (expect_lparen) goto fail;
                 if (in_structure) goto fail;
-                n = tpl_node_new(parent);
+                n = tpl_node_new(parent,a);
                 n->type = TPL_TYPE_BIN;
-                n->addr = (tpl_bin*)va_arg(ap,void*);
-                n->data = tpl_hook.malloc(sizeof(tpl_bin*));
+                n->addr = (tpl_bin*)tpl_arg_ptr(args);
+                tpl_arg_bind(args,n,args->nptrs-1);
+                n->data = tpl_amalloc(a,sizeof(tpl_bin*));
                 if (!n->data) fatal_oom();
                 *((tpl_bin**)n->data) = NULL;
                 if (n->parent->type == TPL_TYPE_ARY) 
@@ -496,23 +732,23 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                 break;
             case 'A':
                 if (in_structure) goto fail;
-                n = tpl_node_new(parent);
+                n = tpl_node_new(parent,a);
                 n->type = TPL_TYPE_ARY;
                 DL_ADD(parent->children,n);
                 parent = n;
                 expect_lparen=1;
-                pidx = (tpl_pidx*)tpl_hook.malloc(sizeof(tpl_pidx));
+                pidx = (tpl_pidx*)tpl_amalloc(a,sizeof(tpl_pidx));
                 if (!pidx) fatal_oom();
                 pidx->node = n;
                 pidx->next = NULL;
                 DL_ADD(((tpl_root_data*)(root->data))->pidx,pidx);
                 /* set up the A's tpl_atyp */
-                n->data = (tpl_atyp*)tpl_hook.malloc(sizeof(tpl_atyp));
+                n->data = (tpl_atyp*)tpl_amalloc(a,sizeof(tpl_atyp));
                 if (!n->data) fatal_oom();
                 ((tpl_atyp*)(n->data))->num = 0;
                 ((tpl_atyp*)(n->data))->sz = 0;
                 ((tpl_atyp*)(n->data))->bb = NULL;
-                ((tpl_atyp*)(n->data))->bbtail = NULL;
+                ((tpl_atyp*)(n->data))->cap = 0;
                 ((tpl_atyp*)(n->data))->cur = NULL;
                 if (n->parent->type == TPL_TYPE_ARY) 
                     ((tpl_atyp*)(n->parent->data))->sz += sizeof(void*);
@@ -522,7 +758,8 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                 expect_lparen=1;
                 ordinal=1;  /* index upcoming atoms in S(..) */
                 in_structure=1+lparen_level; /* so we can tell where S fmt ends */
-                struct_addr = (char*)va_arg(ap,void*);
+                struct_addr = (char*)tpl_arg_ptr(args);
+                struct_arg = args->nptrs-1;
                 break;
             case '$': /* nested structure */
                 if (!in_structure) goto fail;
@@ -549,7 +786,7 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
                 lparen_level++;
                 break;
             default:
-                tpl_hook.oops("unsupported option %c\n", *c);
+                TPL_HOOK.oops("unsupported option %c\n", *c);
                 goto fail;
         }
         c++;
@@ -557,7 +794,7 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
     if (lparen_level != 0) goto fail;
 
     /* copy the format string, save for convenience */
-    ((tpl_root_data*)(root->data))->fmt = tpl_hook.malloc(strlen(fmt)+1);
+    ((tpl_root_data*)(root->data))->fmt = tpl_amalloc(a,strlen(fmt)+1);
     if (((tpl_root_data*)(root->data))->fmt == NULL) 
         fatal_oom();
     memcpy(((tpl_root_data*)(root->data))->fmt,fmt,strlen(fmt)+1);
@@ -565,15 +802,207 @@ TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap) {
     return root;
 
 fail:
-    tpl_hook.oops("failed to parse %s\n", fmt);
+    TPL_HOOK.oops("failed to parse %s\n", fmt);
     tpl_free(root);
     return NULL;
 }
 
+/* number of nodes in the tree under n, including n */
+static int tpl_schema_count(tpl_node *n) {
+    tpl_node *c;
+    int num = 1;
+
+    for(c = n->children; c; c = c->next) num += tpl_schema_count(c);
+    return num;
+}
+
+/* record the pointer argument and data size of each node, numbering them
+ * in preorder. the atoms of an S(...)# have room for all its iterations */
+static void tpl_schema_bind(tpl_schema *s, tpl_node *n, tpl_args *args, int *i) {
+    tpl_node *c, *np;
+    int b, j;
+
+    s->arg[*i] = -1;
+    for(b = 0; b < args->nbinds; b++) {
+        if (args->binds[b].n == n) s->arg[*i] = args->binds[b].arg;
+    }
+    s->dsz[*i] = tpl_types[n->type].sz * n->num;
+    if (n->type == TPL_TYPE_POUND) {
+        np = ((tpl_pound_data*)n->data)->iter_start_node;
+        for(j = *i - 1, c = n->prev; ; j--, c = c->prev) {
+            s->dsz[j] *= n->num;
+            if (c == np) break;
+        }
+    }
+    (*i)++;
+    for(c = n->children; c; c = c->next) tpl_schema_bind(s, c, args, i);
+}
+
+/* compile fmt once. only its # counts are given here; the pointers come
+ * later, to tpl_map_from_schema, which copies the template instead of
+ * parsing the format again. the schema is never modified, so any number
+ * of threads may instantiate it at once. */
+TPL_API tpl_schema *tpl_schema_compile(char *fmt, ...) {
+    va_list ap;
+    tpl_args args;
+    tpl_schema *s=NULL;
+    tpl_node *map;
+    int i;
+
+    memset(&args,0,sizeof(args));
+    args.compile = 1;
+    va_start(ap,fmt);
+    args.ap = &ap;
+    map = tpl_map_a(&tpl_hook_alloc, fmt, &args);
+    va_end(ap);
+    if (!map) goto done;
+
+    s = TPL_HOOK.malloc(sizeof(tpl_schema));
+    if (!s) fatal_oom();
+    s->map = map;
+    s->nptrs = args.nptrs;
+    s->nnodes = tpl_schema_count(map);
+    s->arg = TPL_HOOK.malloc(s->nnodes * sizeof(int));
+    s->dsz = TPL_HOOK.malloc(s->nnodes * sizeof(size_t));
+    if (!s->arg || !s->dsz) fatal_oom();
+    i = 0;
+    tpl_schema_bind(s, map, &args, &i);
+
+ done:
+    if (args.binds) TPL_HOOK.free(args.binds);
+    return s;
+}
+
+TPL_API void tpl_schema_free(tpl_schema *s) {
+    tpl_free(s->map);
+    TPL_HOOK.free(s->arg);
+    TPL_HOOK.free(s->dsz);
+    TPL_HOOK.free(s);
+}
+
+/* copy template node t, its children and the data derived from the format */
+static void tpl_clone_node(const tpl_alloc_t *a, const tpl_schema *s, tpl_node *t,
+                           tpl_node *parent, tpl_node *root, void **ptrs, int *k) {
+    tpl_node *n, *c, *tc;
+    tpl_pound_data *pd;
+    tpl_pidx *pidx;
+    size_t sz;
+    int i;
+
+    n = tpl_node_new(parent,a);
+    n->type = t->type;
+    n->num = t->num;
+    i = (*k)++;
+    if (s->arg[i] >= 0) n->addr = (char*)ptrs[s->arg[i]] + (uintptr_t)t->addr;
+    DL_ADD(parent->children,n);
+
+    switch (t->type) {
+        case TPL_TYPE_BIN:
+            n->data = tpl_amalloc(a,sizeof(tpl_bin*));
+            if (!n->data) fatal_oom();
+            *((tpl_bin**)n->data) = NULL;
+            break;
+        case TPL_TYPE_POUND:
+            n->data = tpl_amalloc(a,sizeof(tpl_pound_data));
+            if (!n->data) fatal_oom();
+            pd = (tpl_pound_data*)n->data;
+            pd->inter_elt_len = ((tpl_pound_data*)t->data)->inter_elt_len;
+            pd->iternum = 0;
+            /* the iteration starts at the same position among our siblings */
+            pd->iter_start_node = NULL;
+            for(tc = t->parent->children, c = parent->children; tc != t; 
+                tc = tc->next, c = c->next) {
+                if (tc == ((tpl_pound_data*)t->data)->iter_start_node) {
+                    pd->iter_start_node = c;
+                    break;
+                }
+            }
+            break;
+        case TPL_TYPE_ARY:
+            n->data = tpl_amalloc(a,sizeof(tpl_atyp));
+            if (!n->data) fatal_oom();
+            memset(n->data,0,sizeof(tpl_atyp));
+            ((tpl_atyp*)(n->data))->sz = ((tpl_atyp*)(t->data))->sz;
+            pidx = (tpl_pidx*)tpl_amalloc(a,sizeof(tpl_pidx));
+            if (!pidx) fatal_oom();
+            pidx->node = n;
+            pidx->next = NULL;
+            DL_ADD(((tpl_root_data*)(root->data))->pidx,pidx);
+            for(tc = t->children; tc; tc = tc->next) {
+                tpl_clone_node(a,s,tc,n,root,ptrs,k);
+            }
+            break;
+        default: /* atoms and strings; zeroed, as for a # */
+            sz = s->dsz[i];
+            n->data = tpl_amalloc(a,sz);
+            if (!n->data) fatal_oom();
+            memset(n->data,0,sz);
+            break;
+    }
+}
+
+static tpl_node *tpl_map_schema_a(const tpl_alloc_t *a, const tpl_schema *s, va_list ap) {
+    tpl_root_data *rd, *td = (tpl_root_data*)s->map->data;
+    tpl_node *root, *tc;
+    void *ptrs_s[16], **ptrs = ptrs_s;
+    size_t sz;
+    int i, k=1;
+
+    if (s->nptrs > (int)(sizeof(ptrs_s)/sizeof(*ptrs_s))) {
+        ptrs = tpl_amalloc(a, s->nptrs * sizeof(void*));
+        if (!ptrs) fatal_oom();
+    }
+    for(i=0; i < s->nptrs; i++) ptrs[i] = va_arg(ap, void*);
+
+    root = tpl_node_new(NULL,a);
+    root->type = TPL_TYPE_ROOT;
+    root->ser_osz = s->map->ser_osz;
+    root->data = rd = (tpl_root_data*)tpl_amalloc(a,sizeof(tpl_root_data));
+    if (!rd) fatal_oom();
+    memset(rd,0,sizeof(tpl_root_data));
+    rd->alloc = *a;
+    sz = strlen(td->fmt)+1;
+    if ( (rd->fmt = tpl_amalloc(a,sz)) == NULL) fatal_oom();
+    memcpy(rd->fmt,td->fmt,sz);
+    if (td->num_fxlens) {
+        sz = td->num_fxlens * sizeof(int);
+        if ( (rd->fxlens = tpl_amalloc(a,sz)) == NULL) fatal_oom();
+        memcpy(rd->fxlens,td->fxlens,sz);
+        rd->num_fxlens = td->num_fxlens;
+    }
+    for(tc = s->map->children; tc; tc = tc->next) {
+        tpl_clone_node(a,s,tc,root,root,ptrs,&k);
+    }
+
+    if (ptrs != ptrs_s) tpl_afree(a,ptrs);
+    return root;
+}
+
+/* the pointers, in the order tpl_map would take them (# counts excluded) */
+TPL_API tpl_node *tpl_map_from_schema(const tpl_schema *s, ...) {
+    va_list ap;
+    tpl_node *tn;
+
+    va_start(ap,s);
+    tn = tpl_map_schema_a(&tpl_hook_alloc, s, ap);
+    va_end(ap);
+    return tn;
+}
+
+TPL_API tpl_node *tpl_map_from_schema_ex(const tpl_alloc_t *alloc, const tpl_schema *s, ...) {
+    va_list ap;
+    tpl_node *tn;
+
+    va_start(ap,s);
+    tn = tpl_map_schema_a(alloc ? alloc : &tpl_hook_alloc, s, ap);
+    va_end(ap);
+    return tn;
+}
+
 static int tpl_unmap_file( tpl_mmap_rec *mr) {
 
     if ( munmap( mr->text, mr->text_sz ) == -1 ) {
-        tpl_hook.oops("Failed to munmap: %s\n", strerror(errno));
+        TPL_HOOK.oops("Failed to munmap: %s\n", strerror(errno));
     }
     close(mr->fd);
     mr->text = NULL;
@@ -582,6 +1011,7 @@ static int tpl_unmap_file( tpl_mmap_rec *mr) {
 }
 
 static void tpl_free_keep_map(tpl_node *r) {
+    const tpl_alloc_t *a = &((tpl_root_data*)(r->data))->alloc;
     int mmap_bits = (TPL_RDONLY|TPL_FILE);
     int ufree_bits = (TPL_MEM|TPL_UFREE);
     tpl_node *nxtc,*c;
@@ -592,7 +1022,7 @@ static void tpl_free_keep_map(tpl_node *r) {
     if ((((tpl_root_data*)(r->data))->flags & mmap_bits) == mmap_bits) {
         tpl_unmap_file( &((tpl_root_data*)(r->data))->mmap); 
     } else if ((((tpl_root_data*)(r->data))->flags & ufree_bits) == ufree_bits) {
-        tpl_hook.free( ((tpl_root_data*)(r->data))->mmap.text );
+        TPL_HOOK.free( ((tpl_root_data*)(r->data))->mmap.text );
     }
 
     c = r->children;
@@ -601,12 +1031,8 @@ static void tpl_free_keep_map(tpl_node *r) {
             switch (c->type) {
                 case TPL_TYPE_BIN:
                     /* free any binary buffer hanging from tpl_bin */
-                    if ( *((tpl_bin**)(c->data)) ) {
-                        if ( (*((tpl_bin**)(c->data)))->addr ) {
-                            tpl_hook.free( (*((tpl_bin**)(c->data)))->addr );
-                        }
-                        *((tpl_bin**)c->data) = NULL; /* reset tpl_bin */
-                    }
+                    tpl_free_bin(a, *((tpl_bin**)(c->data)));
+                    *((tpl_bin**)c->data) = NULL; /* reset tpl_bin */
                     find_next_node=1;
                     break;
                 case TPL_TYPE_STR:
@@ -614,7 +1040,7 @@ static void tpl_free_keep_map(tpl_node *r) {
                     for(i=0; i < c->num; i++) {
                       char *str = ((char**)c->data)[i];
                       if (str) {
-                        tpl_hook.free(str);
+                        tpl_afree(a,str);
                         ((char**)c->data)[i] = NULL;
                       }
                     }
@@ -638,18 +1064,18 @@ static void tpl_free_keep_map(tpl_node *r) {
                     tpl_free_atyp(c,c->data);
 
                     /* make new atyp */
-                    c->data = (tpl_atyp*)tpl_hook.malloc(sizeof(tpl_atyp));
+                    c->data = (tpl_atyp*)tpl_amalloc(a,sizeof(tpl_atyp));
                     if (!c->data) fatal_oom();
                     ((tpl_atyp*)(c->data))->num = 0;
                     ((tpl_atyp*)(c->data))->sz = sz;  /* restore bb datum sz */
                     ((tpl_atyp*)(c->data))->bb = NULL;
-                    ((tpl_atyp*)(c->data))->bbtail = NULL;
+                    ((tpl_atyp*)(c->data))->cap = 0;
                     ((tpl_atyp*)(c->data))->cur = NULL;
 
                     c = c->children; 
                     break;
                 default:
-                    tpl_hook.fatal("unsupported format character\n");
+                    TPL_HOOK.fatal("unsupported format character\n");
                     break;
             }
 
@@ -682,12 +1108,15 @@ TPL_API void tpl_free(tpl_node *r) {
     tpl_node *nxtc,*c;
     int find_next_node=0,looking,i;
     tpl_pidx *pidx,*pidx_nxt;
+    tpl_chunk *chunk;
+    tpl_alloc_t alloc = ((tpl_root_data*)(r->data))->alloc; /* outlives r */
+    const tpl_alloc_t *a = &alloc;
 
     /* For mmap'd files, or for 'ufree' memory images , do appropriate release */
     if ((((tpl_root_data*)(r->data))->flags & mmap_bits) == mmap_bits) {
         tpl_unmap_file( &((tpl_root_data*)(r->data))->mmap); 
     } else if ((((tpl_root_data*)(r->data))->flags & ufree_bits) == ufree_bits) {
-        tpl_hook.free( ((tpl_root_data*)(r->data))->mmap.text );
+        TPL_HOOK.free( ((tpl_root_data*)(r->data))->mmap.text );
     }
 
     c = r->children;
@@ -696,13 +1125,8 @@ TPL_API void tpl_free(tpl_node *r) {
             switch (c->type) {
                 case TPL_TYPE_BIN:
                     /* free any binary buffer hanging from tpl_bin */
-                    if ( *((tpl_bin**)(c->data)) ) {
-                        if ( (*((tpl_bin**)(c->data)))->sz != 0 ) {
-                            tpl_hook.free( (*((tpl_bin**)(c->data)))->addr );
-                        }
-                        tpl_hook.free(*((tpl_bin**)c->data)); /* free tpl_bin */
-                    }
-                    tpl_hook.free(c->data);  /* free tpl_bin* */
+                    tpl_free_bin(a, *((tpl_bin**)(c->data)));
+                    tpl_afree(a,c->data);  /* free tpl_bin* */
                     find_next_node=1;
                     break;
                 case TPL_TYPE_STR:
@@ -710,11 +1134,11 @@ TPL_API void tpl_free(tpl_node *r) {
                     for(i=0; i < c->num; i++) {
                       char *str = ((char**)c->data)[i];
                       if (str) {
-                        tpl_hook.free(str);
+                        tpl_afree(a,str);
                         ((char**)c->data)[i] = NULL;
                       }
                     }
-                    tpl_hook.free(c->data);
+                    tpl_afree(a,c->data);
                     find_next_node=1;
                     break;
                 case TPL_TYPE_INT32:
@@ -726,7 +1150,7 @@ TPL_API void tpl_free(tpl_node *r) {
                 case TPL_TYPE_INT16:
                 case TPL_TYPE_UINT16:
                 case TPL_TYPE_POUND:
-                    tpl_hook.free(c->data);
+                    tpl_afree(a,c->data);
                     find_next_node=1;
                     break;
                 case TPL_TYPE_ARY:
@@ -735,7 +1159,7 @@ TPL_API void tpl_free(tpl_node *r) {
                     else find_next_node=1; /* edge case, handle bad format A() */
                     break;
                 default:
-                    tpl_hook.fatal("unsupported format character\n");
+                    TPL_HOOK.fatal("unsupported format character\n");
                     break;
             }
 
@@ -745,14 +1169,14 @@ TPL_API void tpl_free(tpl_node *r) {
                 while(looking) {
                     if (c->next) {
                         nxtc=c->next;
-                        tpl_hook.free(c);
+                        tpl_afree(a,c);
                         c=nxtc;
                         looking=0;
                     } else {
                         if (c->type == TPL_TYPE_ROOT) break; /* root node */
                         else {
                             nxtc=c->parent;
-                            tpl_hook.free(c);
+                            tpl_afree(a,c);
                             c=nxtc;
                         }
                     }
@@ -762,20 +1186,48 @@ TPL_API void tpl_free(tpl_node *r) {
     }
 
     /* free root */
+    while ( (chunk = ((tpl_root_data*)(r->data))->chunks) != NULL) {
+        ((tpl_root_data*)(r->data))->chunks = chunk->next;
+        tpl_afree(a, chunk);
+    }
     for(pidx=((tpl_root_data*)(r->data))->pidx; pidx; pidx=pidx_nxt) {
         pidx_nxt = pidx->next;
-        tpl_hook.free(pidx);
+        tpl_afree(a,pidx);
     }
-    tpl_hook.free(((tpl_root_data*)(r->data))->fmt);
+    tpl_afree(a,((tpl_root_data*)(r->data))->fmt);
     if (((tpl_root_data*)(r->data))->num_fxlens > 0) {
-        tpl_hook.free(((tpl_root_data*)(r->data))->fxlens);
+        tpl_afree(a,((tpl_root_data*)(r->data))->fxlens);
     }
-    tpl_hook.free(r->data);  /* tpl_root_data */
-    tpl_hook.free(r);
+    tpl_afree(a,r->data);  /* tpl_root_data */
+    tpl_afree(a,r);
+}
+
+
+/* the allocator of the map that n belongs to */
+static const tpl_alloc_t *tpl_alloc_of(tpl_node *n) {
+    while (n->parent) n = n->parent;
+    return &((tpl_root_data*)(n->data))->alloc;
 }
 
+/* free a packed B buffer and, unless it is the caller's, its contents */
+static void tpl_free_bin(const tpl_alloc_t *a, tpl_bin *binp) {
+    if (binp == NULL) return;
+    if (binp->addr && !((tpl_pbin*)binp)->ref) tpl_afree(a, binp->addr);
+    tpl_afree(a, binp);
+}
 
 /* Find the i'th packable ('A' node) */
+/* the inverse of tpl_find_i: the index of A node n */
+static int tpl_node_i(tpl_node *r, tpl_node *n) {
+    int j=0;
+    tpl_pidx *pidx;
+    for(pidx=((tpl_root_data*)(r->data))->pidx; pidx; pidx=pidx->next) {
+        ++j;
+        if (pidx->node == n) return j;
+    }
+    return -1;
+}
+
 static tpl_node *tpl_find_i(tpl_node *n, int i) {
     int j=0;
     tpl_pidx *pidx;
@@ -792,27 +1244,60 @@ static void *tpl_cpv(void *datav, const void *data, size_t sz) {
     return (void*)((uintptr_t)datav + sz);
 }
 
-static void *tpl_extend_backbone(tpl_node *n) {
-    tpl_backbone *bb;
-    bb = (tpl_backbone*)tpl_hook.malloc(sizeof(tpl_backbone) +
-      ((tpl_atyp*)(n->data))->sz );  /* datum hangs on coattails of bb */
-    if (!bb) fatal_oom();
-#if __STDC_VERSION__ < 199901
-    bb->data = (char*)((uintptr_t)bb + sizeof(tpl_backbone)); 
-#endif
-    memset(bb->data,0,((tpl_atyp*)(n->data))->sz);
-    bb->next = NULL;
-    /* Add the new backbone to the tail, also setting head if necessary  */
-    if (((tpl_atyp*)(n->data))->bb == NULL) {
-        ((tpl_atyp*)(n->data))->bb = bb;
-        ((tpl_atyp*)(n->data))->bbtail = bb;
-    } else {
-        ((tpl_atyp*)(n->data))->bbtail->next = bb;
-        ((tpl_atyp*)(n->data))->bbtail = bb;
+/* make room in the backbone for count more datums, growing it geometrically */
+static void tpl_reserve_backbone(tpl_node *n, uint32_t count) {
+    tpl_atyp *at = (tpl_atyp*)n->data;
+    const tpl_alloc_t *a;
+    uint32_t cap;
+    char *bb;
+
+    if (at->num + count < at->num) TPL_HOOK.fatal("array exceeds %u elements\n", at->num);
+    if (at->num + count <= at->cap) return;
+    cap = at->cap ? at->cap : TPL_BB_MIN;
+    while (cap < at->num + count) {
+        cap = (cap*2 > cap) ? cap*2 : UINT32_MAX;
     }
+    a = tpl_alloc_of(n);
+    bb = tpl_arealloc(a, at->bb, (size_t)cap * at->sz);
+    if (!bb) fatal_oom();
+    at->bb = bb;
+    at->cap = cap;
+}
 
-    ((tpl_atyp*)(n->data))->num++;
-    return bb->data;
+/* append a zeroed datum to the backbone */
+static void *tpl_extend_backbone(tpl_node *n) {
+    tpl_atyp *at = (tpl_atyp*)n->data;
+    char *datum;
+
+    tpl_reserve_backbone(n, 1);
+    datum = at->bb + (size_t)at->num * at->sz;
+    memset(datum,0,at->sz);
+    at->num++;
+    return datum;
+}
+
+/* an A whose datum is laid out just as it is serialized: fixed width
+ * atoms, perhaps iterated by a # */
+static int tpl_atyp_flat(tpl_node *n) {
+    tpl_node *c;
+
+    for(c=n->children; c; c=c->next) {
+        switch (c->type) {
+            case TPL_TYPE_BYTE:
+            case TPL_TYPE_DOUBLE:
+            case TPL_TYPE_INT32:
+            case TPL_TYPE_UINT32:
+            case TPL_TYPE_INT64:
+            case TPL_TYPE_UINT64:
+            case TPL_TYPE_INT16:
+            case TPL_TYPE_UINT16:
+            case TPL_TYPE_POUND:
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 1;
 }
 
 /* Get the format string corresponding to a given tpl (root node) */
@@ -826,12 +1311,97 @@ static int *tpl_fxlens(tpl_node *r, int *num_fxlens) {
     return ((tpl_root_data*)(r->data))->fxlens;
 }
 
-/* called when serializing an 'A' type node into a buffer which has
- * already been set up with the proper space. The backbone is walked
- * which was obtained from the tpl_atyp header passed in. 
+/* TPL_CRC: checksum what was written since the last time */
+static void tpl_out_sum(tpl_out *o) {
+    o->crc = tpl_crc32c(o->crc, o->summed, o->dv - o->summed);
+    o->summed = o->dv;
+}
+
+/* pass on the bytes copied since the last time: to the sink, which
+ * frees the staging space for reuse, or as an iovec */
+
+static void tpl_out_flush(tpl_out *o) {
+    size_t n = o->dv - o->mark;
+
+    if (o->sum) tpl_out_sum(o);
+    if (n == 0) return;
+    if (o->cb) {
+        if ((o->rc == 0) && (o->cb(o->mark, n, o->data) < 0)) o->rc = -1;
+        o->dv = o->mark = o->summed = o->stage;
+    } else if (o->iov) {
+        if (o->iovcnt < o->iovmax) {
+            o->iov[o->iovcnt].iov_base = o->mark;
+            o->iov[o->iovcnt].iov_len = n;
+        }
+        o->iovcnt++;  /* counted past iovmax, to report the number needed */
+        o->mark = o->dv;
+    }
+}
+
+/* the space is full. for an iovec, move on to the next staging chunk */
+static void tpl_out_more(tpl_out *o) {
+    tpl_chunk *ch;
+    size_t sz;
+
+    tpl_out_flush(o);
+    if (o->cb) return;
+    if (o->iov == NULL) TPL_HOOK.fatal("internal error: tpl_dump overflow\n");
+    if ( (ch = *o->next_chunk) == NULL) {
+        sz = (o->left < TPL_CHUNK) ? o->left : TPL_CHUNK;
+        if ( (ch = tpl_amalloc(o->a, sizeof(tpl_chunk) + sz)) == NULL) fatal_oom();
+        ch->next = NULL;
+        ch->sz = sz;
+        *o->next_chunk = ch;
+    }
+    o->next_chunk = &ch->next;
+    o->dv = o->mark = o->summed = (char*)(ch + 1);
+    o->end = o->dv + ch->sz;
+}
+
+static void tpl_out_cpv(tpl_out *o, const void *data, size_t sz) {
+    size_t n;
+
+    while (sz > 0) {
+        if (o->dv == o->end) tpl_out_more(o);
+        n = o->end - o->dv;
+        if (n > sz) n = sz;
+        memcpy(o->dv, data, n);
+        o->dv += n;
+        o->left -= n;
+        data = (const char*)data + n;
+        sz -= n;
+    }
+    /* into memory, checksum in pieces while they are still in cache */
+    if (o->sum && (o->dv - o->summed >= TPL_CHUNK)) tpl_out_sum(o);
+}
+
+/* a B buffer: large ones go out by reference, if not into memory */
+static void tpl_out_ref(tpl_out *o, const void *data, size_t sz) {
+    if ((sz < TPL_REF_MIN) || ((o->cb == NULL) && (o->iov == NULL))) {
+        tpl_out_cpv(o, data, sz);
+        return;
+    }
+    tpl_out_flush(o);
+    o->left -= sz;
+    if (o->sum) o->crc = tpl_crc32c(o->crc, data, sz);
+    if (o->cb) {
+        if ((o->rc == 0) && (o->cb(data, sz, o->data) < 0)) o->rc = -1;
+        return;
+    }
+    if (o->iovcnt < o->iovmax) {
+        o->iov[o->iovcnt].iov_base = (void*)data;
+        o->iov[o->iovcnt].iov_len = sz;
+    }
+    o->iovcnt++;
+}
+
+/* called when serializing an 'A' type node. The backbone is walked
+ * which was obtained from the tpl_atyp header passed in. A backbone of
+ * fixed width atoms is already in serialized form, and goes in one piece.
  */
-static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv) {
-    tpl_backbone *bb;
+static void tpl_dump_atyp(tpl_node *n, tpl_atyp* at, tpl_out *o) {
+    uint64_t *offs = o->offs, pos;  /* element offsets, for the index */
+    uint32_t k;
     tpl_node *c;
     void *datav;
     uint32_t slen;
@@ -843,9 +1413,17 @@ static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv) {
     size_t itermax;
 
     /* handle 'A' nodes */
-    dv = tpl_cpv(dv,&at->num,sizeof(uint32_t));  /* array len */
-    for(bb=at->bb; bb; bb=bb->next) {
-        datav = bb->data;
+    o->offs = NULL; /* only the top level A is indexed */
+    tpl_out_cpv(o,&at->num,sizeof(uint32_t));  /* array len */
+    if (at->num && tpl_atyp_flat(n)) {
+        pos = o->total - o->left;
+        for(k=0; offs && (k < at->num); k++) offs[k] = pos + (uint64_t)k * at->sz;
+        tpl_out_ref(o,at->bb,(size_t)at->num * at->sz);
+        return;
+    }
+    for(k=0; k < at->num; k++) {
+        if (offs) offs[k] = o->total - o->left;
+        datav = at->bb + (size_t)k * at->sz;
         c=n->children;
         while(c) {
             switch (c->type) {
@@ -857,15 +1435,15 @@ static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv) {
                 case TPL_TYPE_UINT64:
                 case TPL_TYPE_INT16:
                 case TPL_TYPE_UINT16:
-                    dv = tpl_cpv(dv,datav,tpl_types[c->type].sz * c->num);
+                    tpl_out_cpv(o,datav,tpl_types[c->type].sz * c->num);
                     datav = (void*)((uintptr_t)datav + tpl_types[c->type].sz * c->num);
                     break;
                 case TPL_TYPE_BIN:
                     /* dump the buffer length followed by the buffer */
                     memcpy(&binp,datav,sizeof(tpl_bin*)); /* cp to aligned */
                     slen = binp->sz;
-                    dv = tpl_cpv(dv,&slen,sizeof(uint32_t));
-                    dv = tpl_cpv(dv,binp->addr,slen);
+                    tpl_out_cpv(o,&slen,sizeof(uint32_t));
+                    tpl_out_ref(o,binp->addr,slen);
                     datav = (void*)((uintptr_t)datav + sizeof(tpl_bin*));
                     break;
                 case TPL_TYPE_STR:
@@ -873,14 +1451,14 @@ static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv) {
                     for(i=0; i < c->num; i++) {
                       memcpy(&strp,datav,sizeof(char*)); /* cp to aligned */
                       slen = strp ? (strlen(strp)+1) : 0;
-                      dv = tpl_cpv(dv,&slen,sizeof(uint32_t));
-                      if (slen > 1) dv = tpl_cpv(dv,strp,slen-1);
+                      tpl_out_cpv(o,&slen,sizeof(uint32_t));
+                      if (slen > 1) tpl_out_cpv(o,strp,slen-1);
                       datav = (void*)((uintptr_t)datav + sizeof(char*));
                     }
                     break;
                 case TPL_TYPE_ARY:
                     memcpy(&atypp,datav,sizeof(tpl_atyp*)); /* cp to aligned */
-                    dv = tpl_dump_atyp(c,atypp,dv);
+                    tpl_dump_atyp(c,atypp,o);
                     datav = (void*)((uintptr_t)datav + sizeof(void*));
                     break;
                 case TPL_TYPE_POUND:
@@ -895,13 +1473,12 @@ static void *tpl_dump_atyp(tpl_node *n, tpl_atyp* at, void *dv) {
                     }
                     break;
                 default:
-                    tpl_hook.fatal("unsupported format character\n");
+                    TPL_HOOK.fatal("unsupported format character\n");
                     break;
             }
             c=c->next;
         }
     }
-    return dv;
 }
 
 /* figure the serialization output size needed for tpl whose root is n*/
@@ -915,7 +1492,7 @@ static size_t tpl_ser_osz(tpl_node *n) {
 
     /* handle the root node ONLY (subtree's ser_osz have been bubbled-up) */
     if (n->type != TPL_TYPE_ROOT) {
-        tpl_hook.fatal("internal error: tpl_ser_osz on non-root node\n");
+        TPL_HOOK.fatal("internal error: tpl_ser_osz on non-root node\n");
     }
 
     sz = n->ser_osz;    /* start with fixed overhead, already stored */
@@ -969,7 +1546,7 @@ static size_t tpl_ser_osz(tpl_node *n) {
                 }
                 break;
             default:
-                tpl_hook.fatal("unsupported format character\n");
+                TPL_HOOK.fatal("unsupported format character\n");
                 break;
         }
         c=c->next;
@@ -978,85 +1555,163 @@ static size_t tpl_ser_osz(tpl_node *n) {
 }
 
 
+static double tpl_now(void) {
+#ifndef _WIN32
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* TPL_STATS: a dump or load of sz bytes, begun at t0 */
+static void tpl_stats_set(tpl_io_stats *st, size_t sz, double t0) {
+    st->bytes = sz;
+    st->secs = tpl_now() - t0;
+    st->bytes_per_sec = (st->secs > 0) ? sz / st->secs : 0;
+}
+
+/* TPL_FD sink: write all of it, counting what was written */
+typedef struct tpl_fd_sink {
+    int fd;
+    size_t written;
+} tpl_fd_sink;
+
+static int tpl_write_fd(const void *buf, size_t sz, void *data) {
+    tpl_fd_sink *fs = (tpl_fd_sink*)data;
+    int rc;
+
+    while (sz > 0) {
+        rc = write(fs->fd,buf,sz);
+        if (rc > 0) {
+            sz -= rc;
+            buf = (const char*)buf + rc;
+            fs->written += rc;
+        } else if (rc == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            TPL_HOOK.oops("error writing to fd %d: %s\n", fs->fd, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
 TPL_API int tpl_dump(tpl_node *r, int mode, ...) {
     va_list ap;
-    char *filename, *bufv;
+    char *filename;
     void **addr_out,*buf, *pa_addr;
-    int fd,rc=0;
-    size_t sz,*sz_out, pa_sz;
+    int fd,rc=0,*iovcnt;
+    size_t sz,*sz_out, pa_sz, *cap;
     struct stat sbuf;
+    tpl_fd_sink fs;
+    tpl_out o;
+    tpl_io_stats *st;
+    double t0;
 
     if (((tpl_root_data*)(r->data))->flags & TPL_RDONLY) {  /* unusual */
-        tpl_hook.oops("error: tpl_dump called for a loaded tpl\n");
+        TPL_HOOK.oops("error: tpl_dump called for a loaded tpl\n");
         return -1;
     }
+    t0 = (mode & TPL_STATS) ? tpl_now() : 0;
 
     sz = tpl_ser_osz(r); /* compute the size needed to serialize  */
+    if (mode & TPL_INDEX) sz += tpl_index_sz(r);
+    if (mode & TPL_CRC) sz += sizeof(uint32_t);
+    if ((uint64_t)sz > UINT32_MAX) sz += sizeof(uint64_t) - sizeof(uint32_t); /* wide */
+    memset(&o,0,sizeof(o));
+    o.index = (mode & TPL_INDEX) ? 1 : 0;
+    o.sum = (mode & TPL_CRC) ? 1 : 0;
 
     va_start(ap,mode);
     if (mode & TPL_FILE) {
         filename = va_arg(ap,char*);
-        fd = tpl_mmap_output_file(filename, sz, &buf);
+        fd = tpl_mmap_output_file(filename, sz, &buf, mode);
         if (fd == -1) rc = -1;
         else {
-            rc = tpl_dump_to_mem(r,buf,sz);
+            rc = tpl_dump_to_mem(r,buf,sz,mode);
             if (msync(buf,sz,MS_SYNC) == -1) {
-                tpl_hook.oops("msync failed on fd %d: %s\n", fd, strerror(errno));
+                TPL_HOOK.oops("msync failed on fd %d: %s\n", fd, strerror(errno));
             }
             if (munmap(buf, sz) == -1) {
-                tpl_hook.oops("munmap failed on fd %d: %s\n", fd, strerror(errno));
+                TPL_HOOK.oops("munmap failed on fd %d: %s\n", fd, strerror(errno));
             }
             close(fd);
         }
-    } else if (mode & TPL_FD) {
-        fd = va_arg(ap, int);
-        if ( (buf = tpl_hook.malloc(sz)) == NULL) fatal_oom();
-        tpl_dump_to_mem(r,buf,sz);
-        bufv = buf;
-        do {
-            rc = write(fd,bufv,sz);
-            if (rc > 0) {
-                sz -= rc;
-                bufv += rc;
-            } else if (rc == -1) {
-                if (errno == EINTR || errno == EAGAIN) continue;
-                tpl_hook.oops("error writing to fd %d: %s\n", fd, strerror(errno));
-                free(buf);
-                /* attempt to rewind partial write to a regular file */
-                if (fstat(fd,&sbuf) == 0 && S_ISREG(sbuf.st_mode)) {
-                  if (ftruncate(fd,sbuf.st_size - (bufv-(char*)buf)) == -1) {
-                    tpl_hook.oops("can't rewind: %s\n", strerror(errno));
-                  }
-                }
-                return -1;
+    } else if (mode & (TPL_FD|TPL_SINK)) {
+        /* stream through a staging buffer; large B buffers go direct */
+        if (mode & TPL_FD) {
+            fs.fd = va_arg(ap, int);
+            fs.written = 0;
+            o.cb = tpl_write_fd;
+            o.data = &fs;
+        } else {
+            o.cb = va_arg(ap, tpl_sink_cb*);
+            o.data = va_arg(ap, void*);
+        }
+        pa_sz = (sz < TPL_CHUNK) ? sz : TPL_CHUNK;
+        if ( (o.stage = TPL_HOOK.malloc(pa_sz)) == NULL) fatal_oom();
+        o.dv = o.mark = o.stage;
+        o.end = o.stage + pa_sz;
+        rc = tpl_dump_out(r,&o,sz);
+        TPL_HOOK.free(o.stage);
+        /* attempt to rewind partial write to a regular file */
+        if ((rc == -1) && (mode & TPL_FD) && fs.written &&
+            (fstat(fs.fd,&sbuf) == 0) && S_ISREG(sbuf.st_mode)) {
+            if (ftruncate(fs.fd,sbuf.st_size - fs.written) == -1) {
+                TPL_HOOK.oops("can't rewind: %s\n", strerror(errno));
             }
-        } while (sz > 0);
-        free(buf);
-        rc = 0;
+        }
+    } else if (mode & TPL_IOV) {
+        o.iov = va_arg(ap, struct iovec*);
+        iovcnt = va_arg(ap, int*);
+        o.iovmax = *iovcnt;
+        o.next_chunk = &((tpl_root_data*)(r->data))->chunks;
+        o.a = tpl_alloc_of(r);
+        rc = tpl_dump_out(r,&o,sz);
+        if (o.iovcnt > o.iovmax) {
+            TPL_HOOK.oops("tpl_dump: need %d iovecs\n", o.iovcnt);
+            rc = -1;
+        }
+        *iovcnt = o.iovcnt;
     } else if (mode & TPL_MEM) {
         if (mode & TPL_PREALLOCD) { /* caller allocated */
           pa_addr = (void*)va_arg(ap, void*);
           pa_sz = va_arg(ap, size_t);
           if (pa_sz < sz) {
-              tpl_hook.oops("tpl_dump: buffer too small, need %d bytes\n", sz);
-              return -1;
+              TPL_HOOK.oops("tpl_dump: buffer too small, need %d bytes\n", sz);
+              rc = -1;
+          } else rc=tpl_dump_to_mem(r,pa_addr,sz,mode);
+        } else if (mode & TPL_GROW) { /* caller's buffer, grown if need be */
+          addr_out = (void**)va_arg(ap, void*);
+          sz_out = va_arg(ap, size_t*);
+          cap = va_arg(ap, size_t*);
+          if (*cap < sz) {
+              if ( (buf = TPL_HOOK.realloc(*addr_out, sz)) == NULL) fatal_oom();
+              *addr_out = buf;
+              *cap = sz;
           }
-          rc=tpl_dump_to_mem(r,pa_addr,sz);
+          *sz_out = sz;
+          rc=tpl_dump_to_mem(r,*addr_out,sz,mode);
         } else { /* we allocate */
           addr_out = (void**)va_arg(ap, void*);
           sz_out = va_arg(ap, size_t*);
-          if ( (buf = tpl_hook.malloc(sz)) == NULL) fatal_oom();
+          if ( (buf = TPL_HOOK.malloc(sz)) == NULL) fatal_oom();
           *sz_out = sz;
           *addr_out = buf;
-          rc=tpl_dump_to_mem(r,buf,sz);
+          rc=tpl_dump_to_mem(r,buf,sz,mode);
         }
     } else if (mode & TPL_GETSIZE) {
         sz_out = va_arg(ap, size_t*);
         *sz_out = sz;
     } else {
-        tpl_hook.oops("unsupported tpl_dump mode %d\n", mode);
+        TPL_HOOK.oops("unsupported tpl_dump mode %d\n", mode);
         rc=-1;
     }
+    if (mode & TPL_STATS) {
+        st = va_arg(ap, tpl_io_stats*);
+        tpl_stats_set(st, sz, t0);
+    }
     va_end(ap);
     return rc;
 }
@@ -1065,28 +1720,64 @@ TPL_API int tpl_dump(tpl_node *r, int mode, ...) {
  * adequate size to hold the serialized tpl. The sz parameter must be
  * the result of tpl_ser_osz(r).
  */
-static int tpl_dump_to_mem(tpl_node *r,void *addr,size_t sz) {
+static int tpl_dump_to_mem(tpl_node *r,void *addr,size_t sz,int mode) {
+    tpl_out o;
+
+    memset(&o,0,sizeof(o));
+    o.dv = o.mark = addr;
+    o.end = (char*)addr + sz;
+    o.index = (mode & TPL_INDEX) ? 1 : 0;
+    o.sum = (mode & TPL_CRC) ? 1 : 0;
+    return tpl_dump_out(r,&o,sz);
+}
+
+/* serialize the tpl, whose size is sz, in one pass into o. an image over
+ * 4GB is written with a 64 bit overall length, and the wide flag. with
+ * o->sum, the image ends with a CRC32C of everything before it */
+static int tpl_dump_out(tpl_node *r, tpl_out *o, size_t sz) {
     uint32_t slen, sz32;
-    int *fxlens, num_fxlens, i;
-    void *dv;
+    uint64_t sz64, *offs=NULL, at;
+    int *fxlens, num_fxlens, i, nent=0;
     char *fmt,flags;
     tpl_node *c, *np;
     tpl_pound_data *pd;
-    size_t itermax;
+    tpl_index_ent *ents=NULL;
+    size_t itermax, nel=0;
 
     fmt = tpl_fmt(r);
     flags = 0;
     if (tpl_cpu_bigendian()) flags |= TPL_FL_BIGENDIAN;
     if (strchr(fmt,'s')) flags |= TPL_FL_NULLSTRINGS;
+    if ((uint64_t)sz > UINT32_MAX) flags |= TPL_FL_WIDE;
+    if (o->sum) flags |= TPL_FL_CRC;
+    if (o->index) {
+        flags |= TPL_FL_INDEX;
+        for(c = r->children; c; c = c->next) {
+            if (c->type != TPL_TYPE_ARY) continue;
+            nent++;
+            nel += ((tpl_atyp*)c->data)->num;
+        }
+        ents = TPL_HOOK.malloc(nent * sizeof(tpl_index_ent) + 1);
+        offs = TPL_HOOK.malloc(nel * sizeof(uint64_t) + 1);
+        if (!ents || !offs) fatal_oom();
+        nent = 0;
+        nel = 0;
+    }
     sz32 = sz; 
-
-    dv = addr;
-    dv = tpl_cpv(dv,TPL_MAGIC,3);         /* copy tpl magic prefix */
-    dv = tpl_cpv(dv,&flags,1);            /* copy flags byte */
-    dv = tpl_cpv(dv,&sz32,sizeof(uint32_t));/* overall length (inclusive) */
-    dv = tpl_cpv(dv,fmt,strlen(fmt)+1);   /* copy format with NUL-term */
+    sz64 = sz;
+    o->left = sz;
+    o->total = sz;
+    o->summed = o->dv;
+    o->crc = 0;
+
+    tpl_out_cpv(o,TPL_MAGIC,3);         /* copy tpl magic prefix */
+    tpl_out_cpv(o,&flags,1);            /* copy flags byte */
+    if (flags & TPL_FL_WIDE)            /* overall length (inclusive) */
+        tpl_out_cpv(o,&sz64,sizeof(uint64_t));
+    else tpl_out_cpv(o,&sz32,sizeof(uint32_t));
+    tpl_out_cpv(o,fmt,strlen(fmt)+1);   /* copy format with NUL-term */
     fxlens = tpl_fxlens(r,&num_fxlens);
-    dv = tpl_cpv(dv,fxlens,num_fxlens*sizeof(uint32_t));/* fmt # lengths */
+    tpl_out_cpv(o,fxlens,num_fxlens*sizeof(uint32_t));/* fmt # lengths */
 
     /* serialize the tpl content, iterating over direct children of root */
     c = r->children;
@@ -1100,23 +1791,35 @@ static int tpl_dump_to_mem(tpl_node *r,void *addr,size_t sz) {
             case TPL_TYPE_UINT64:
             case TPL_TYPE_INT16:
             case TPL_TYPE_UINT16:
-                dv = tpl_cpv(dv,c->data,tpl_types[c->type].sz * c->num);
+                tpl_out_cpv(o,c->data,tpl_types[c->type].sz * c->num);
                 break;
             case TPL_TYPE_BIN:
                 slen = (*(tpl_bin**)(c->data))->sz;
-                dv = tpl_cpv(dv,&slen,sizeof(uint32_t));  /* buffer len */
-                dv = tpl_cpv(dv,(*(tpl_bin**)(c->data))->addr,slen); /* buf */
+                tpl_out_cpv(o,&slen,sizeof(uint32_t));  /* buffer len */
+                tpl_out_ref(o,(*(tpl_bin**)(c->data))->addr,slen); /* buf */
                 break;
             case TPL_TYPE_STR:
                 for(i=0; i < c->num; i++) {
                   char *str = ((char**)c->data)[i];
                   slen = str ? strlen(str)+1 : 0;
-                  dv = tpl_cpv(dv,&slen,sizeof(uint32_t));  /* string len */
-                  if (slen>1) dv = tpl_cpv(dv,str,slen-1); /*string*/
+                  tpl_out_cpv(o,&slen,sizeof(uint32_t));  /* string len */
+                  if (slen>1) tpl_out_cpv(o,str,slen-1); /*string*/
                 }
                 break;
             case TPL_TYPE_ARY:
-                dv = tpl_dump_atyp(c,(tpl_atyp*)c->data,dv);
+                if (ents) { /* note the A's extent and its element offsets */
+                    ents[nent].i = tpl_node_i(r,c);
+                    ents[nent].num = ((tpl_atyp*)c->data)->num;
+                    ents[nent].len = o->total - o->left;
+                    ents[nent].table = nel; /* made an offset below */
+                    o->offs = &offs[nel];
+                    nel += ents[nent].num;
+                }
+                tpl_dump_atyp(c,(tpl_atyp*)c->data,o);
+                if (ents) {
+                    ents[nent].len = (o->total - o->left) - ents[nent].len;
+                    nent++;
+                }
                 break;
             case TPL_TYPE_POUND:
                  pd = (tpl_pound_data*)c->data;
@@ -1145,13 +1848,49 @@ static int tpl_dump_to_mem(tpl_node *r,void *addr,size_t sz) {
                  }
                  break;
             default:
-                tpl_hook.fatal("unsupported format character\n");
+                TPL_HOOK.fatal("unsupported format character\n");
                 break;
         }
         c = c->next;
     }
+    if (ents) { /* the index footer */
+        at = o->total - o->left;
+        tpl_out_cpv(o,offs,nel*sizeof(uint64_t));
+        for(i=0; i < nent; i++) {
+            ents[i].table = at + ents[i].table * sizeof(uint64_t);
+            tpl_out_cpv(o,&ents[i].i,sizeof(uint32_t));
+            tpl_out_cpv(o,&ents[i].num,sizeof(uint32_t));
+            tpl_out_cpv(o,&ents[i].len,sizeof(uint64_t));
+            tpl_out_cpv(o,&ents[i].table,sizeof(uint64_t));
+        }
+        slen = nent;
+        tpl_out_cpv(o,&slen,sizeof(uint32_t));
+        at = o->total - at;  /* footer length; this word ends the image, */
+        if (o->sum) at -= sizeof(uint32_t); /* but for a CRC */
+        tpl_out_cpv(o,&at,sizeof(uint64_t));
+        TPL_HOOK.free(ents);
+        TPL_HOOK.free(offs);
+    }
+    if (o->sum) {
+        tpl_out_sum(o);
+        o->sum = 0;
+        tpl_out_cpv(o,&o->crc,sizeof(uint32_t));
+    }
+    tpl_out_flush(o);
+    return o->rc;
+}
 
-    return 0;
+/* the size of the index footer, for tpl_dump(TPL_INDEX) */
+static size_t tpl_index_sz(tpl_node *r) {
+    tpl_node *c;
+    size_t sz = TPL_INDEX_TAIL_SZ;
+
+    for(c = r->children; c; c = c->next) {
+        if (c->type != TPL_TYPE_ARY) continue;
+        sz += TPL_INDEX_ENT_SZ;
+        sz += ((tpl_atyp*)c->data)->num * sizeof(uint64_t);
+    }
+    return sz;
 }
 
 static int tpl_cpu_bigendian() {
@@ -1170,12 +1909,17 @@ static int tpl_cpu_bigendian() {
  * should exactly match the buffer size (bufsz) and the internal
  * recorded size (intlsz)
  */
-static int tpl_sanity(tpl_node *r, int excess_ok) {
-    uint32_t intlsz;
+/* check the preamble of the image at the map's text against the map: its
+ * magic, flags, overall length, format and # lengths. on success, *len is
+ * the image's overall length, *data the offset of its data and *intlflags
+ * its flags byte. 0, or an ERR_ code */
+static int tpl_preamble(tpl_node *r, int excess_ok, uint64_t *len, size_t *data,
+                        char *intlflags_out) {
+    uint64_t intlsz;
     int found_nul=0,rc, octothorpes=0, num_fxlens, *fxlens, flen;
     void *d, *dv;
     char intlflags, *fmt, c, *mapfmt;
-    size_t bufsz, serlen;
+    size_t bufsz, pre;
 
     d = ((tpl_root_data*)(r->data))->mmap.text;
     bufsz = ((tpl_root_data*)(r->data))->mmap.text_sz;
@@ -1193,11 +1937,9 @@ static int tpl_sanity(tpl_node *r, int excess_ok) {
     if (!(intlflags & TPL_FL_NULLSTRINGS)) {
       ((tpl_root_data*)(r->data))->flags |= TPL_OLD_STRING_FMT;
     }
-    dv = (void*)((uintptr_t)dv + 1);
-    memcpy(&intlsz,dv,sizeof(uint32_t));  /* extract internal size */
-    if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN) tpl_byteswap(&intlsz, sizeof(uint32_t));
+    if ( (pre = tpl_img_len(d,bufsz,&intlsz)) == 0) return ERR_NOT_MINSIZE; /* extract internal size */
     if (!excess_ok && (intlsz != bufsz)) return ERR_INCONSISTENT_SZ;  /* inconsisent buffer/internal size */
-    dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
+    dv = (void*)((uintptr_t)d + pre);
 
     /* dv points to the start of the format string. Look for nul w/in buf sz */
     fmt = (char*)dv;
@@ -1228,20 +1970,121 @@ static int tpl_sanity(tpl_node *r, int excess_ok) {
         dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
         fxlens++;
     }
+    *len = intlsz;
+    *data = (uintptr_t)dv - (uintptr_t)d;
+    *intlflags_out = intlflags;
+    return 0;
+}
+
+static int tpl_sanity(tpl_node *r, int excess_ok, int trust_index) {
+    uint64_t intlsz;
+    int rc;
+    void *d, *dv;
+    char intlflags;
+    size_t bufsz, serlen, data, trailer=0;
+    uint32_t crc;
+
+    d = ((tpl_root_data*)(r->data))->mmap.text;
+    bufsz = ((tpl_root_data*)(r->data))->mmap.text_sz;
+    ((tpl_root_data*)(r->data))->index = NULL;
+    ((tpl_root_data*)(r->data))->nindex = 0;
+
+    if ( (rc = tpl_preamble(r, excess_ok, &intlsz, &data, &intlflags)) != 0) return rc;
+    dv = (void*)((uintptr_t)d + data);
+
+    /* check the CRC, then treat the image as ending before it */
+    if (intlflags & TPL_FL_CRC) {
+        trailer = sizeof(uint32_t);
+        if ((intlsz > bufsz) || (intlsz < data + trailer)) return ERR_INCONSISTENT_SZ;
+        memcpy(&crc, (char*)d + intlsz - trailer, sizeof(uint32_t));
+        if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN) tpl_byteswap(&crc, sizeof(uint32_t));
+        if (tpl_crc32c(0, d, intlsz - trailer) != crc) return ERR_CRC_MISMATCH;
+        intlsz -= trailer;
+    }
 
-    /* dv now points to beginning of data */
+    /* dv now points to beginning of data. locate any index footer after it */
+    if (intlflags & TPL_FL_INDEX) {
+        if ((intlsz > bufsz) || 
+            (tpl_index_open(r, (uintptr_t)dv - (uintptr_t)d, intlsz, trust_index) != 0))
+            return ERR_INCONSISTENT_SZ5;
+    }
     rc = tpl_serlen(r,r,dv,&serlen);  /* get computed serlen of data part */
     if (rc == -1) return ERR_INCONSISTENT_SZ2; /* internal inconsistency in tpl image */
     serlen += ((uintptr_t)dv - (uintptr_t)d);   /* add back serlen of preamble part */
+    if (intlflags & TPL_FL_INDEX) serlen += intlsz - ((tpl_root_data*)(r->data))->index_at;
+    serlen += trailer;
     if (excess_ok && (bufsz < serlen)) return ERR_INCONSISTENT_SZ3;  
     if (!excess_ok && (serlen != bufsz)) return ERR_INCONSISTENT_SZ3;  /* buffer/internal sz exceeds serlen */
     return 0;
 }
 
+/* find the index footer of the image at the map's text, whose data begins
+ * at offset data and which is len bytes long. if trust is set, tpl_serlen
+ * takes the length of each top level A from it, rather than walking the A;
+ * otherwise it checks each A's count and element offsets against its walk */
+static int tpl_index_open(tpl_node *r, size_t data, uint64_t len, int trust) {
+    tpl_root_data *rd = (tpl_root_data*)(r->data);
+    char *d = (char*)rd->mmap.text;
+    uint64_t flen;
+    uint32_t n;
+
+    if (len < data + TPL_INDEX_TAIL_SZ) return -1;
+    memcpy(&flen, d + len - sizeof(uint64_t), sizeof(uint64_t));
+    memcpy(&n, d + len - TPL_INDEX_TAIL_SZ, sizeof(uint32_t));
+    if (rd->flags & TPL_XENDIAN) {
+        tpl_byteswap(&flen, sizeof(uint64_t));
+        tpl_byteswap(&n, sizeof(uint32_t));
+    }
+    if ((flen < TPL_INDEX_TAIL_SZ) || (flen > len - data)) return -1;
+    if ((uint64_t)n * TPL_INDEX_ENT_SZ > flen - TPL_INDEX_TAIL_SZ) return -1;
+    rd->index = d + len - TPL_INDEX_TAIL_SZ - (size_t)n * TPL_INDEX_ENT_SZ;
+    rd->nindex = n;
+    rd->index_at = len - flen;
+    if (trust) rd->flags |= TPL_INDEX;
+    return 0;
+}
+
+/* get the index entry of A(...) i of a loaded image. 0, or -1 if none */
+static int tpl_index_get(tpl_node *r, int i, tpl_index_ent *e) {
+    tpl_root_data *rd = (tpl_root_data*)(r->data);
+    char *p;
+    uint32_t k;
+
+    for(k=0, p=rd->index; k < rd->nindex; k++, p += TPL_INDEX_ENT_SZ) {
+        memcpy(&e->i, p, sizeof(uint32_t));
+        memcpy(&e->num, p + 4, sizeof(uint32_t));
+        memcpy(&e->len, p + 8, sizeof(uint64_t));
+        memcpy(&e->table, p + 16, sizeof(uint64_t));
+        if (rd->flags & TPL_XENDIAN) {
+            tpl_byteswap(&e->i, sizeof(uint32_t));
+            tpl_byteswap(&e->num, sizeof(uint32_t));
+            tpl_byteswap(&e->len, sizeof(uint64_t));
+            tpl_byteswap(&e->table, sizeof(uint64_t));
+        }
+        if ((int)e->i == i) return 0;
+    }
+    return -1;
+}
+
+/* the image offset of element k of the A with index entry e, from its
+ * table. 0, or -1 if the table does not lie within the footer */
+static int tpl_index_off(tpl_node *r, tpl_index_ent *e, uint32_t k, uint64_t *off) {
+    tpl_root_data *rd = (tpl_root_data*)(r->data);
+    char *text = (char*)rd->mmap.text;
+    uint64_t dir = rd->index - text;
+
+    if ((e->table < rd->index_at) || (e->table > dir) ||
+        (e->num > (dir - e->table) / sizeof(uint64_t)) || (k >= e->num)) return -1;
+    memcpy(off, text + e->table + (uint64_t)k * sizeof(uint64_t), sizeof(uint64_t));
+    if (rd->flags & TPL_XENDIAN) tpl_byteswap(off, sizeof(uint64_t));
+    return 0;
+}
+
 static void *tpl_find_data_start(void *d) {
     int octothorpes=0;
-    d = (void*)((uintptr_t)d + 4); /* skip TPL_MAGIC and flags byte */
-    d = (void*)((uintptr_t)d + 4); /* skip int32 overall len */
+    if (((char*)d)[3] & TPL_FL_WIDE) /* skip TPL_MAGIC and flags byte */
+        d = (void*)((uintptr_t)d + 4 + sizeof(uint64_t)); /* and int64 overall len */
+    else d = (void*)((uintptr_t)d + 4 + sizeof(uint32_t)); /* or int32 */
     while(*(char*)d != '\0') {
         if (*(char*)d == '#') octothorpes++;
         d = (void*)((uintptr_t)d + 1);
@@ -1251,6 +2094,26 @@ static void *tpl_find_data_start(void *d) {
     return d;
 }
 
+/* get the overall length of the image at d from its preamble, of which
+ * avail bytes are at hand. returns the preamble's length up to the end of
+ * the length word (8, or 12 if wide), or 0 if avail doesn't reach it */
+static size_t tpl_img_len(void *d, size_t avail, uint64_t *len) {
+    char *c = (char*)d;
+    uint32_t len32;
+
+    if (avail < 4 + sizeof(uint32_t)) return 0;
+    if (c[3] & TPL_FL_WIDE) {
+        if (avail < 4 + sizeof(uint64_t)) return 0;
+        memcpy(len, c+4, sizeof(uint64_t));
+        if (tpl_needs_endian_swap(d)) tpl_byteswap(len, sizeof(uint64_t));
+        return 4 + sizeof(uint64_t);
+    }
+    memcpy(&len32, c+4, sizeof(uint32_t));
+    if (tpl_needs_endian_swap(d)) tpl_byteswap(&len32, sizeof(uint32_t));
+    *len = len32;
+    return 4 + sizeof(uint32_t);
+}
+
 static int tpl_needs_endian_swap(void *d) {
     char *c;
     int cpu_is_bigendian;
@@ -1276,11 +2139,13 @@ TPL_API char* tpl_peek(int mode, ...) {
     uint32_t datapeek_ssz, datapeek_csz, datapeek_flen;
     tpl_mmap_rec mr = {0,NULL,0};
     char *fmt,*fmt_cpy=NULL,c;
-    uint32_t intlsz, **fxlens=NULL, *num_fxlens_out=NULL, *fxlensv;
+    uint32_t **fxlens=NULL, *num_fxlens_out=NULL, *fxlensv;
+    uint64_t intlsz;
+    size_t pre;
 
     va_start(ap,mode);
     if ((mode & TPL_FXLENS) && (mode & TPL_DATAPEEK)) {
-        tpl_hook.oops("TPL_FXLENS and TPL_DATAPEEK mutually exclusive\n");
+        TPL_HOOK.oops("TPL_FXLENS and TPL_DATAPEEK mutually exclusive\n");
         goto fail;
     }
     if (mode & TPL_FILE) filename = va_arg(ap,char *);
@@ -1288,7 +2153,7 @@ TPL_API char* tpl_peek(int mode, ...) {
         addr = va_arg(ap,void *);
         sz = va_arg(ap,size_t);
     } else {
-        tpl_hook.oops("unsupported tpl_peek mode %d\n", mode);
+        TPL_HOOK.oops("unsupported tpl_peek mode %d\n", mode);
         goto fail;
     }
     if (mode & TPL_DATAPEEK) {
@@ -1302,8 +2167,8 @@ TPL_API char* tpl_peek(int mode, ...) {
     }
 
     if (mode & TPL_FILE) {
-        if (tpl_mmap_file(filename, &mr) != 0) {
-            tpl_hook.oops("tpl_peek failed for file %s\n", filename);
+        if (tpl_mmap_file(filename, &mr, 0) != 0) {
+            TPL_HOOK.oops("tpl_peek failed for file %s\n", filename);
             goto fail;
         }
         addr = mr.text;
@@ -1315,11 +2180,10 @@ TPL_API char* tpl_peek(int mode, ...) {
     if (memcmp(dv,TPL_MAGIC, 3) != 0) goto fail; /* missing tpl magic prefix */
     if (tpl_needs_endian_swap(dv)) xendian=1;
     if ((((char*)dv)[3] & TPL_FL_NULLSTRINGS)==0) old_string_format=1;
-    dv = (void*)((uintptr_t)dv + 4);
-    memcpy(&intlsz,dv,sizeof(uint32_t));  /* extract internal size */
-    if (xendian) tpl_byteswap(&intlsz, sizeof(uint32_t));
+    if ((((char*)dv)[3] & ~TPL_SUPPORTED_BITFLAGS) != 0) goto fail;
+    if ( (pre = tpl_img_len(dv,sz,&intlsz)) == 0) goto fail; /* extract internal size */
     if (intlsz != sz) goto fail;  /* inconsisent buffer/internal size */
-    dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
+    dv = (void*)((uintptr_t)dv + pre);
 
     /* dv points to the start of the format string. Look for nul w/in buf sz */
     fmt = (char*)dv;
@@ -1333,7 +2197,7 @@ TPL_API char* tpl_peek(int mode, ...) {
     }
     if (!found_nul) goto fail;  /* runaway format string */
     fmt_len = (char*)dv - fmt;  /* include space for \0 */
-    fmt_cpy = tpl_hook.malloc(fmt_len);
+    fmt_cpy = TPL_HOOK.malloc(fmt_len);
     if (fmt_cpy == NULL) {
         fatal_oom();
     }
@@ -1346,8 +2210,8 @@ TPL_API char* tpl_peek(int mode, ...) {
       }
     }
     if ((mode & TPL_FXLENS) && (num_fxlens > 0)) {
-      *fxlens = tpl_hook.malloc(num_fxlens * sizeof(uint32_t));
-      if (*fxlens == NULL) tpl_hook.fatal("out of memory");
+      *fxlens = TPL_HOOK.malloc(num_fxlens * sizeof(uint32_t));
+      if (*fxlens == NULL) TPL_HOOK.fatal("out of memory");
       *num_fxlens_out = num_fxlens;
       fxlensv = *fxlens;
       while(num_fxlens--) {
@@ -1364,14 +2228,14 @@ TPL_API char* tpl_peek(int mode, ...) {
 
        datapeek_flen = strlen(datapeek_f);
        if (strspn(datapeek_f, tpl_datapeek_ok_chars) < datapeek_flen) {
-         tpl_hook.oops("invalid TPL_DATAPEEK format: %s\n", datapeek_f);
-         tpl_hook.free(fmt_cpy); fmt_cpy = NULL; /* fail */
+         TPL_HOOK.oops("invalid TPL_DATAPEEK format: %s\n", datapeek_f);
+         TPL_HOOK.free(fmt_cpy); fmt_cpy = NULL; /* fail */
          goto fail;
        }
 
        if (strncmp( &fmt[first_atom], datapeek_f, datapeek_flen) != 0) {
-         tpl_hook.oops("TPL_DATAPEEK format mismatches tpl iamge\n");
-         tpl_hook.free(fmt_cpy); fmt_cpy = NULL; /* fail */
+         TPL_HOOK.oops("TPL_DATAPEEK format mismatches tpl iamge\n");
+         TPL_HOOK.free(fmt_cpy); fmt_cpy = NULL; /* fail */
          goto fail;
        }
 
@@ -1381,8 +2245,8 @@ TPL_API char* tpl_peek(int mode, ...) {
          datapeek_p = va_arg(ap, void*);
          if (*datapeek_c == 's') {  /* special handling for strings */
            if ((uintptr_t)dv-(uintptr_t)addr + sizeof(uint32_t) > sz) {
-             tpl_hook.oops("tpl_peek: tpl has insufficient length\n");
-             tpl_hook.free(fmt_cpy); fmt_cpy = NULL; /* fail */
+             TPL_HOOK.oops("tpl_peek: tpl has insufficient length\n");
+             TPL_HOOK.free(fmt_cpy); fmt_cpy = NULL; /* fail */
              goto fail;
            }
            memcpy(&datapeek_ssz,dv,sizeof(uint32_t)); /* get slen */
@@ -1392,11 +2256,11 @@ TPL_API char* tpl_peek(int mode, ...) {
            if (datapeek_ssz == 0) datapeek_s = NULL;
            else {
              if ((uintptr_t)dv-(uintptr_t)addr + datapeek_ssz-1 > sz) {
-               tpl_hook.oops("tpl_peek: tpl has insufficient length\n");
-               tpl_hook.free(fmt_cpy); fmt_cpy = NULL; /* fail */
+               TPL_HOOK.oops("tpl_peek: tpl has insufficient length\n");
+               TPL_HOOK.free(fmt_cpy); fmt_cpy = NULL; /* fail */
                goto fail;
              }
-             datapeek_s = tpl_hook.malloc(datapeek_ssz);
+             datapeek_s = TPL_HOOK.malloc(datapeek_ssz);
              if (datapeek_s == NULL) fatal_oom();
              memcpy(datapeek_s, dv, datapeek_ssz-1);
              datapeek_s[datapeek_ssz-1] = '\0';
@@ -1406,8 +2270,8 @@ TPL_API char* tpl_peek(int mode, ...) {
          } else {
            datapeek_csz = tpl_size_for(*datapeek_c);
            if ((uintptr_t)dv-(uintptr_t)addr + datapeek_csz > sz) {
-             tpl_hook.oops("tpl_peek: tpl has insufficient length\n");
-             tpl_hook.free(fmt_cpy); fmt_cpy = NULL; /* fail */
+             TPL_HOOK.oops("tpl_peek: tpl has insufficient length\n");
+             TPL_HOOK.free(fmt_cpy); fmt_cpy = NULL; /* fail */
              goto fail;
            }
            memcpy(datapeek_p, dv, datapeek_csz);
@@ -1461,7 +2325,7 @@ TPL_API int tpl_jot(int mode, ...) {
       rc = tpl_dump(tn, TPL_FD, fd);
       tpl_free(tn);
     } else {
-      tpl_hook.fatal("invalid tpl_jot mode\n");
+      TPL_HOOK.fatal("invalid tpl_jot mode\n");
     }
 
 fail:
@@ -1473,9 +2337,12 @@ TPL_API int tpl_load(tpl_node *r, int mode, ...) {
     va_list ap;
     int rc=0,fd=0;
     char *filename=NULL;
-    void *addr;
-    size_t sz;
+    void *addr=NULL;
+    size_t sz=0;
+    tpl_io_stats *st;
+    double t0;
 
+    t0 = (mode & TPL_STATS) ? tpl_now() : 0;
     va_start(ap,mode);
     if (mode & TPL_FILE) filename = va_arg(ap,char *);
     else if (mode & TPL_MEM) {
@@ -1484,13 +2351,24 @@ TPL_API int tpl_load(tpl_node *r, int mode, ...) {
     } else if (mode & TPL_FD) {
         fd = va_arg(ap,int);
     } else {
-        tpl_hook.oops("unsupported tpl_load mode %d\n", mode);
+        TPL_HOOK.oops("unsupported tpl_load mode %d\n", mode);
+        va_end(ap);
         return -1;
     }
+    rc = tpl_load_a(r, mode, filename, addr, sz, fd);
+    if (mode & TPL_STATS) {
+        st = va_arg(ap, tpl_io_stats*);
+        tpl_stats_set(st, (rc == 0) ? ((tpl_root_data*)(r->data))->mmap.text_sz : 0, t0);
+    }
     va_end(ap);
+    return rc;
+}
+
+static int tpl_load_a(tpl_node *r, int mode, char *filename, void *addr, size_t sz, int fd) {
+    int rc;
 
     if (r->type != TPL_TYPE_ROOT) {
-        tpl_hook.oops("error: tpl_load to non-root node\n");
+        TPL_HOOK.oops("error: tpl_load to non-root node\n");
         return -1;
     }
     if (((tpl_root_data*)(r->data))->flags & (TPL_WRONLY|TPL_RDONLY)) {
@@ -1498,42 +2376,48 @@ TPL_API int tpl_load(tpl_node *r, int mode, ...) {
         tpl_free_keep_map(r);
     }
     if (mode & TPL_FILE) {
-        if (tpl_mmap_file(filename, &((tpl_root_data*)(r->data))->mmap) != 0) {
-            tpl_hook.oops("tpl_load failed for file %s\n", filename);
+        if (tpl_mmap_file(filename, &((tpl_root_data*)(r->data))->mmap, mode) != 0) {
+            TPL_HOOK.oops("tpl_load failed for file %s\n", filename);
             return -1;
         }
-        if ( (rc = tpl_sanity(r, (mode & TPL_EXCESS_OK))) != 0) {
+        if ( (rc = tpl_sanity(r, (mode & TPL_EXCESS_OK), (mode & TPL_INDEX))) != 0) {
             if (rc == ERR_FMT_MISMATCH) {
-                tpl_hook.oops("%s: format signature mismatch\n", filename);
+                TPL_HOOK.oops("%s: format signature mismatch\n", filename);
             } else if (rc == ERR_FLEN_MISMATCH) { 
-                tpl_hook.oops("%s: array lengths mismatch\n", filename);
+                TPL_HOOK.oops("%s: array lengths mismatch\n", filename);
+            } else if (rc == ERR_CRC_MISMATCH) { 
+                TPL_HOOK.oops("%s: checksum mismatch\n", filename);
             } else { 
-                tpl_hook.oops("%s: not a valid tpl file\n", filename); 
+                TPL_HOOK.oops("%s: not a valid tpl file\n", filename); 
             }
             tpl_unmap_file( &((tpl_root_data*)(r->data))->mmap );
             return -1;
         }
         ((tpl_root_data*)(r->data))->flags = (TPL_FILE | TPL_RDONLY);
+        ((tpl_root_data*)(r->data))->flags |= (mode & (TPL_NOCOPY|TPL_INDEX));
     } else if (mode & TPL_MEM) {
         ((tpl_root_data*)(r->data))->mmap.text = addr;
         ((tpl_root_data*)(r->data))->mmap.text_sz = sz;
-        if ( (rc = tpl_sanity(r, (mode & TPL_EXCESS_OK))) != 0) {
+        if ( (rc = tpl_sanity(r, (mode & TPL_EXCESS_OK), (mode & TPL_INDEX))) != 0) {
             if (rc == ERR_FMT_MISMATCH) {
-                tpl_hook.oops("format signature mismatch\n");
+                TPL_HOOK.oops("format signature mismatch\n");
+            } else if (rc == ERR_CRC_MISMATCH) {
+                TPL_HOOK.oops("checksum mismatch\n");
             } else { 
-                tpl_hook.oops("not a valid tpl file\n"); 
+                TPL_HOOK.oops("not a valid tpl file\n"); 
             }
             return -1;
         }
         ((tpl_root_data*)(r->data))->flags = (TPL_MEM | TPL_RDONLY);
         if (mode & TPL_UFREE) ((tpl_root_data*)(r->data))->flags |= TPL_UFREE;
+        ((tpl_root_data*)(r->data))->flags |= (mode & (TPL_NOCOPY|TPL_INDEX));
     } else if (mode & TPL_FD) {
         /* if fd read succeeds, resulting mem img is used for load */
         if (tpl_gather(TPL_GATHER_BLOCKING,fd,&addr,&sz) > 0) {
-            return tpl_load(r, TPL_MEM|TPL_UFREE, addr, sz);
+            return tpl_load_a(r, TPL_MEM|TPL_UFREE|(mode & (TPL_NOCOPY|TPL_INDEX)), NULL, addr, sz, 0);
         } else return -1;
     } else {
-        tpl_hook.oops("invalid tpl_load mode %d\n", mode);
+        TPL_HOOK.oops("invalid tpl_load mode %d\n", mode);
         return -1;
     }
     /* this applies to TPL_MEM or TPL_FILE */
@@ -1548,15 +2432,66 @@ TPL_API int tpl_Alen(tpl_node *r, int i) {
 
     n = tpl_find_i(r,i);
     if (n == NULL) {
-        tpl_hook.oops("invalid index %d to tpl_unpack\n", i);
+        TPL_HOOK.oops("invalid index %d to tpl_unpack\n", i);
         return -1;
     }
     if (n->type != TPL_TYPE_ARY) return -1;
     return ((tpl_atyp*)(n->data))->num;
 }
 
+/* position top level A(...) i of an image loaded from a tpl_dump(TPL_INDEX)
+ * so that the next tpl_unpack(tn, i) yields its element n (from 0). the
+ * element is found through the index, and checked before it is used.
+ * unpacking the root rewinds every A, so that must come first */
+TPL_API int tpl_seek(tpl_node *r, int i, uint32_t n) {
+    tpl_root_data *rd = (tpl_root_data*)(r->data);
+    tpl_index_ent e;
+    tpl_node *a;
+    uint64_t off;
+    size_t data, len;
+    char *text;
+
+    a = tpl_find_i(r,i);
+    if ((a == NULL) || (a->type != TPL_TYPE_ARY) || (a->parent != r)) {
+        TPL_HOOK.oops("invalid index %d to tpl_seek\n", i);
+        return -1;
+    }
+    if (!(rd->flags & TPL_RDONLY) || !rd->index || (tpl_index_get(r,i,&e) != 0)) {
+        TPL_HOOK.oops("tpl_seek: no index for %d\n", i);
+        return -1;
+    }
+    if (!(rd->flags & TPL_ROOT_UNPACKED)) {
+        TPL_HOOK.oops("tpl_seek: tpl_unpack(tn,0) must come first\n");
+        return -1;
+    }
+    if (n > e.num) {
+        TPL_HOOK.oops("tpl_seek: element %u of %u\n", n, e.num);
+        return -1;
+    }
+    if (n == e.num) { /* just past the end: consumed */
+        ((tpl_atyp*)(a->data))->num = 0;
+        return 0;
+    }
+
+    text = (char*)rd->mmap.text;
+    data = (char*)tpl_find_data_start(text) - text;
+    if (tpl_index_off(r, &e, n, &off) == -1) goto bad;
+    if ((off < data) || (off >= rd->index_at)) goto bad;
+    if (tpl_serlen_n(r, a, text + off, 1, &len) == -1) goto bad;
+    if (len > rd->index_at - off) goto bad;
+
+    ((tpl_atyp*)(a->data))->cur = text + off;
+    ((tpl_atyp*)(a->data))->num = e.num - n;
+    return 0;
+
+ bad:
+    TPL_HOOK.oops("tpl_seek: invalid index\n");
+    return -1;
+}
+
 static void tpl_free_atyp(tpl_node *n, tpl_atyp *atyp) {
-    tpl_backbone *bb,*bbnxt;
+    const tpl_alloc_t *a = tpl_alloc_of(n);
+    uint32_t k;
     tpl_node *c;
     void *dv;
     tpl_bin *binp;
@@ -1566,10 +2501,11 @@ static void tpl_free_atyp(tpl_node *n, tpl_atyp *atyp) {
     tpl_pound_data *pd;
     int i;
 
-    bb = atyp->bb;
-    while (bb) {
-        bbnxt = bb->next;
-        dv = bb->data;
+    /* a loaded A has no backbone; its num counts what is left to unpack */
+    if (!atyp->bb || tpl_atyp_flat(n)) k = atyp->num; /* nothing to free */
+    else k = 0;
+    for(; k < atyp->num; k++) {
+        dv = atyp->bb + (size_t)k * atyp->sz;
         c=n->children; 
         while (c) {
             switch (c->type) {
@@ -1585,14 +2521,13 @@ static void tpl_free_atyp(tpl_node *n, tpl_atyp *atyp) {
                     break;
                 case TPL_TYPE_BIN:
                     memcpy(&binp,dv,sizeof(tpl_bin*)); /* cp to aligned */
-                    if (binp->addr) tpl_hook.free( binp->addr ); /* free buf */
-                    tpl_hook.free(binp);  /* free tpl_bin */
+                    tpl_free_bin(a, binp);
                     dv = (void*)((uintptr_t)dv + sizeof(tpl_bin*));
                     break;
                 case TPL_TYPE_STR:
                     for(i=0; i < c->num; i++) {
                       memcpy(&strp,dv,sizeof(char*)); /* cp to aligned */
-                      if (strp) tpl_hook.free(strp); /* free string */
+                      if (strp) tpl_afree(a,strp); /* free string */
                       dv = (void*)((uintptr_t)dv + sizeof(char*));
                     }
                     break;
@@ -1613,114 +2548,164 @@ static void tpl_free_atyp(tpl_node *n, tpl_atyp *atyp) {
                     dv = (void*)((uintptr_t)dv + sizeof(void*));
                     break;
                 default:
-                    tpl_hook.fatal("unsupported format character\n");
+                    TPL_HOOK.fatal("unsupported format character\n");
                     break;
             }
             c=c->next;
         }
-        tpl_hook.free(bb);
-        bb = bbnxt;
     }
-    tpl_hook.free(atyp);
+    if (atyp->bb) tpl_afree(a,atyp->bb);
+    tpl_afree(a,atyp);
 }
 
 /* determine (by walking) byte length of serialized r/A node at address dv 
  * returns 0 on success, or -1 if the tpl isn't trustworthy (fails consistency)
  */
 static int tpl_serlen(tpl_node *r, tpl_node *n, void *dv, size_t *serlen) {
-    uint32_t slen;
-    int num=0,fidx;
-    tpl_node *c;
-    size_t len=0, alen, buf_past, itermax;
-    tpl_pound_data *pd;
+    tpl_root_data *rd = (tpl_root_data*)(r->data);
+    int num=0;
+    size_t len=0, elen, buf_past;
+    tpl_index_ent e;
+    uint64_t off;
+    uint32_t k;
 
-    buf_past = ((uintptr_t)((tpl_root_data*)(r->data))->mmap.text + 
-                      ((tpl_root_data*)(r->data))->mmap.text_sz);
+    buf_past = ((uintptr_t)rd->mmap.text + rd->mmap.text_sz);
 
     if (n->type == TPL_TYPE_ROOT) num = 1;
     else if (n->type == TPL_TYPE_ARY) {
         if ((uintptr_t)dv + sizeof(uint32_t) > buf_past) return -1;
         memcpy(&num,dv,sizeof(uint32_t));
-        if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
+        if (rd->flags & TPL_XENDIAN)
              tpl_byteswap(&num, sizeof(uint32_t));
+        /* a top level A in the index: loaded with TPL_INDEX, take its length
+         * from there; otherwise walk it, checking the index against it */
+        if ((n->parent == r) && rd->index &&
+            (tpl_index_get(r, tpl_node_i(r,n), &e) == 0)) {
+            if ((e.num != (uint32_t)num) || (e.len < sizeof(uint32_t)) ||
+                (e.len > rd->index_at - ((uintptr_t)dv - (uintptr_t)rd->mmap.text)))
+                return -1;
+            if (rd->flags & TPL_INDEX) {
+                *serlen = e.len;
+                return 0;
+            }
+            len = sizeof(uint32_t);
+            for(k=0; k < e.num; k++) {
+                if ((tpl_index_off(r, &e, k, &off) == -1) ||
+                    (off != (uintptr_t)dv + len - (uintptr_t)rd->mmap.text)) return -1;
+                if (tpl_serlen_n(r,n,(char*)dv + len,1,&elen) == -1) return -1;
+                len += elen;
+            }
+            if (len != e.len) return -1;
+            *serlen = len;
+            return 0;
+        }
         dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
         len += sizeof(uint32_t);
-    } else tpl_hook.fatal("internal error in tpl_serlen\n");
+    } else TPL_HOOK.fatal("internal error in tpl_serlen\n");
 
-    while (num-- > 0) {
-        c=n->children; 
-        while (c) {
-            switch (c->type) {
-                case TPL_TYPE_BYTE:
-                case TPL_TYPE_DOUBLE:
-                case TPL_TYPE_INT32:
-                case TPL_TYPE_UINT32:
-                case TPL_TYPE_INT64:
-                case TPL_TYPE_UINT64:
-                case TPL_TYPE_INT16:
-                case TPL_TYPE_UINT16:
-                    for(fidx=0; fidx < c->num; fidx++) {  /* octothorpe support */
-                        if ((uintptr_t)dv + tpl_types[c->type].sz > buf_past) return -1;
-                        dv = (void*)((uintptr_t)dv + tpl_types[c->type].sz);
-                        len += tpl_types[c->type].sz;
-                    }
-                    break;
-                case TPL_TYPE_BIN:
-                    len += sizeof(uint32_t);
-                    if ((uintptr_t)dv + sizeof(uint32_t) > buf_past) return -1;
-                    memcpy(&slen,dv,sizeof(uint32_t));
-                    if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
-                        tpl_byteswap(&slen, sizeof(uint32_t));
-                    len += slen;
-                    dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
-                    if ((uintptr_t)dv + slen > buf_past) return -1;
-                    dv = (void*)((uintptr_t)dv + slen);
-                    break;
-                case TPL_TYPE_STR:
-                    for(fidx=0; fidx < c->num; fidx++) {  /* octothorpe support */
-                      len += sizeof(uint32_t);
-                      if ((uintptr_t)dv + sizeof(uint32_t) > buf_past) return -1;
-                      memcpy(&slen,dv,sizeof(uint32_t));
-                      if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
-                          tpl_byteswap(&slen, sizeof(uint32_t));
-                      if (!(((tpl_root_data*)(r->data))->flags & TPL_OLD_STRING_FMT))
-                         slen = (slen>1) ? (slen-1) : 0;
-                      len += slen;
-                      dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
-                      if ((uintptr_t)dv + slen > buf_past) return -1;
-                      dv = (void*)((uintptr_t)dv + slen);
-                    }
-                    break;
-                case TPL_TYPE_ARY:
-                    if ( tpl_serlen(r,c,dv, &alen) == -1) return -1;
-                    dv = (void*)((uintptr_t)dv + alen);
-                    len += alen;
-                    break;
-                case TPL_TYPE_POUND:
-                    /* iterate over the preceding nodes */
-                    itermax = c->num;
-                    pd = (tpl_pound_data*)c->data;
-                    if (++(pd->iternum) < itermax) {
-                      c = pd->iter_start_node;
-                      continue;
-                    } else { /* loop complete. */
-                      pd->iternum = 0;
-                    }
-                    break;
-                default:
-                    tpl_hook.fatal("unsupported format character\n");
-                    break;
-            }
-            c=c->next;
+    if (tpl_serlen_n(r,n,dv,num,&elen) == -1) return -1;
+    *serlen = len + elen;
+    return 0;
+}
+
+/* the byte length of num serialized elements of n's children at dv */
+/* walk the serialized nodes c, c->next, ... up to (not including) stop at dv,
+ * as in tpl_serlen; the run must hold any S(...)# group whole */
+static int tpl_serlen_nodes(tpl_node *r, tpl_node *c, tpl_node *stop, void *dv, size_t *serlen) {
+    uint32_t slen;
+    int fidx;
+    size_t len=0, alen, buf_past, itermax;
+    tpl_pound_data *pd;
+
+    buf_past = ((uintptr_t)((tpl_root_data*)(r->data))->mmap.text + 
+                      ((tpl_root_data*)(r->data))->mmap.text_sz);
+
+    while (c != stop) {
+        switch (c->type) {
+            case TPL_TYPE_BYTE:
+            case TPL_TYPE_DOUBLE:
+            case TPL_TYPE_INT32:
+            case TPL_TYPE_UINT32:
+            case TPL_TYPE_INT64:
+            case TPL_TYPE_UINT64:
+            case TPL_TYPE_INT16:
+            case TPL_TYPE_UINT16:
+                for(fidx=0; fidx < c->num; fidx++) {  /* octothorpe support */
+                    if ((uintptr_t)dv + tpl_types[c->type].sz > buf_past) return -1;
+                    dv = (void*)((uintptr_t)dv + tpl_types[c->type].sz);
+                    len += tpl_types[c->type].sz;
+                }
+                break;
+            case TPL_TYPE_BIN:
+                len += sizeof(uint32_t);
+                if ((uintptr_t)dv + sizeof(uint32_t) > buf_past) return -1;
+                memcpy(&slen,dv,sizeof(uint32_t));
+                if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
+                    tpl_byteswap(&slen, sizeof(uint32_t));
+                len += slen;
+                dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
+                if ((uintptr_t)dv + slen > buf_past) return -1;
+                dv = (void*)((uintptr_t)dv + slen);
+                break;
+            case TPL_TYPE_STR:
+                for(fidx=0; fidx < c->num; fidx++) {  /* octothorpe support */
+                  len += sizeof(uint32_t);
+                  if ((uintptr_t)dv + sizeof(uint32_t) > buf_past) return -1;
+                  memcpy(&slen,dv,sizeof(uint32_t));
+                  if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
+                      tpl_byteswap(&slen, sizeof(uint32_t));
+                  if (!(((tpl_root_data*)(r->data))->flags & TPL_OLD_STRING_FMT))
+                     slen = (slen>1) ? (slen-1) : 0;
+                  len += slen;
+                  dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
+                  if ((uintptr_t)dv + slen > buf_past) return -1;
+                  dv = (void*)((uintptr_t)dv + slen);
+                }
+                break;
+            case TPL_TYPE_ARY:
+                if ( tpl_serlen(r,c,dv, &alen) == -1) return -1;
+                dv = (void*)((uintptr_t)dv + alen);
+                len += alen;
+                break;
+            case TPL_TYPE_POUND:
+                /* iterate over the preceding nodes */
+                itermax = c->num;
+                pd = (tpl_pound_data*)c->data;
+                if (++(pd->iternum) < itermax) {
+                  c = pd->iter_start_node;
+                  continue;
+                } else { /* loop complete. */
+                  pd->iternum = 0;
+                }
+                break;
+            default:
+                TPL_HOOK.fatal("unsupported format character\n");
+                break;
         }
+        c=c->next;
     }
     *serlen = len;
     return 0;
 }
 
-static int tpl_mmap_output_file(char *filename, size_t sz, void **text_out) {
+static int tpl_serlen_n(tpl_node *r, tpl_node *n, void *dv, int num, size_t *serlen) {
+    size_t len=0, elen;
+
+    while (num-- > 0) {
+        if (tpl_serlen_nodes(r, n->children, NULL, (char*)dv + len, &elen) == -1) return -1;
+        len += elen;
+    }
+    *serlen = len;
+    return 0;
+}
+
+/* open the output file of a TPL_FILE dump, size it and map it. with
+ * TPL_FALLOCATE its blocks are reserved up front, which keeps a large image
+ * from fragmenting; TPL_POPULATE faults the mapping in at once, rather
+ * than page by page as it is written */
+static int tpl_mmap_output_file(char *filename, size_t sz, void **text_out, int mode) {
     void *text;
-    int fd,perms;
+    int fd,perms,rc,flags=MAP_SHARED;
 
 #ifndef _WIN32
     perms = S_IRUSR|S_IWUSR|S_IWGRP|S_IRGRP|S_IROTH;  /* ug+w o+r */
@@ -1731,52 +2716,95 @@ static int tpl_mmap_output_file(char *filename, size_t sz, void **text_out) {
 #endif
 
     if ( fd == -1 ) {
-        tpl_hook.oops("Couldn't open file %s: %s\n", filename, strerror(errno));
+        TPL_HOOK.oops("Couldn't open file %s: %s\n", filename, strerror(errno));
         return -1;
     }
 
-    text = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (text == MAP_FAILED) {
-        tpl_hook.oops("Failed to mmap %s: %s\n", filename, strerror(errno));
+    rc = -1;
+#ifndef _WIN32
+    if ((mode & TPL_FALLOCATE) && ((rc = posix_fallocate(fd,0,sz)) != 0)) {
+        /* unsupported by the filesystem, say; it just gets sized */
+        TPL_HOOK.oops("posix_fallocate failed: %s\n", strerror(rc));
+        rc = -1;
+    }
+#endif
+    if ((rc != 0) && (ftruncate(fd,sz) == -1)) {
+        TPL_HOOK.oops("ftruncate failed: %s\n", strerror(errno));
         close(fd);
         return -1;
     }
-    if (ftruncate(fd,sz) == -1) {
-        tpl_hook.oops("ftruncate failed: %s\n", strerror(errno));
-        munmap( text, sz );
+#ifdef MAP_POPULATE
+    if (mode & TPL_POPULATE) flags |= MAP_POPULATE;
+#endif
+    text = mmap(0, sz, PROT_READ|PROT_WRITE, flags, fd, 0);
+    if (text == MAP_FAILED) {
+        TPL_HOOK.oops("Failed to mmap %s: %s\n", filename, strerror(errno));
         close(fd);
         return -1;
     }
+    /* the image is written front to back. hints; failures don't matter */
+#ifdef MADV_SEQUENTIAL
+    madvise(text, sz, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_HUGEPAGE
+    if (mode & TPL_HUGEPAGE) madvise(text, sz, MADV_HUGEPAGE);
+#endif
     *text_out = text;
     return fd;
 }
 
-static int tpl_mmap_file(char *filename, tpl_mmap_rec *mr) {
+/* map a file to load. it is read front to back, unless loaded with
+ * TPL_INDEX for tpl_seek. TPL_WILLNEED starts reading all of it ahead;
+ * TPL_POPULATE reads it all before returning */
+static int tpl_mmap_file(char *filename, tpl_mmap_rec *mr, int mode) {
     struct stat stat_buf;
+    int flags=MAP_PRIVATE;
 
     if ( (mr->fd = open(filename, O_RDONLY)) == -1 ) {
-        tpl_hook.oops("Couldn't open file %s: %s\n", filename, strerror(errno));
+        TPL_HOOK.oops("Couldn't open file %s: %s\n", filename, strerror(errno));
         return -1;
     }
 
     if ( fstat(mr->fd, &stat_buf) == -1) {
         close(mr->fd);
-        tpl_hook.oops("Couldn't stat file %s: %s\n", filename, strerror(errno));
+        TPL_HOOK.oops("Couldn't stat file %s: %s\n", filename, strerror(errno));
         return -1;
     }
 
+    if ((uint64_t)stat_buf.st_size > SIZE_MAX) {
+        close(mr->fd);
+        TPL_HOOK.oops("File %s is too large to map\n", filename);
+        return -1;
+    }
     mr->text_sz = (size_t)stat_buf.st_size;  
-    mr->text = mmap(0, stat_buf.st_size, PROT_READ, MAP_PRIVATE, mr->fd, 0);
+#ifdef MAP_POPULATE
+    if (mode & TPL_POPULATE) flags |= MAP_POPULATE;
+#endif
+    mr->text = mmap(0, stat_buf.st_size, PROT_READ, flags, mr->fd, 0);
     if (mr->text == MAP_FAILED) {
         close(mr->fd);
-        tpl_hook.oops("Failed to mmap %s: %s\n", filename, strerror(errno));
+        TPL_HOOK.oops("Failed to mmap %s: %s\n", filename, strerror(errno));
         return -1;
     }
+#ifdef MADV_SEQUENTIAL
+    if (!(mode & TPL_INDEX)) madvise(mr->text, mr->text_sz, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+    if (mode & TPL_WILLNEED) madvise(mr->text, mr->text_sz, MADV_WILLNEED);
+#endif
+#ifdef MADV_HUGEPAGE
+    if (mode & TPL_HUGEPAGE) madvise(mr->text, mr->text_sz, MADV_HUGEPAGE);
+#endif
 
     return 0;
 }
 
 TPL_API int tpl_pack(tpl_node *r, int i) {
+    return tpl_pack_ex(r, i, 0);
+}
+
+TPL_API int tpl_pack_ex(tpl_node *r, int i, int flags) {
+    const tpl_alloc_t *a = tpl_alloc_of(r);
     tpl_node *n, *child, *np;
     void *datav=NULL;
     size_t sz, itermax;
@@ -1788,7 +2816,7 @@ TPL_API int tpl_pack(tpl_node *r, int i) {
 
     n = tpl_find_i(r,i);
     if (n == NULL) {
-        tpl_hook.oops("invalid index %d to tpl_pack\n", i);
+        TPL_HOOK.oops("invalid index %d to tpl_pack\n", i);
         return -1;
     }
 
@@ -1819,23 +2847,22 @@ TPL_API int tpl_pack(tpl_node *r, int i) {
             case TPL_TYPE_BIN:
                 /* copy the buffer to be packed */ 
                 slen = ((tpl_bin*)child->addr)->sz;
-                if (slen >0) {
-                    str = tpl_hook.malloc(slen);
+                if (slen == 0) str = NULL;
+                else if (flags & TPL_NOCOPY) {
+                    str = ((tpl_bin*)child->addr)->addr;  /* caller's buffer */
+                } else {
+                    str = tpl_amalloc(a,slen);
                     if (!str) fatal_oom();
                     memcpy(str,((tpl_bin*)child->addr)->addr,slen);
-                } else str = NULL;
+                }
                 /* and make a tpl_bin to point to it */
-                bin = tpl_hook.malloc(sizeof(tpl_bin));
+                bin = tpl_amalloc(a,sizeof(tpl_pbin));
                 if (!bin) fatal_oom();
                 bin->addr = str;
                 bin->sz = slen;
+                ((tpl_pbin*)bin)->ref = (str && (flags & TPL_NOCOPY)) ? 1 : 0;
                 /* now pack its pointer, first deep freeing any pre-existing bin */
-                if (*(tpl_bin**)(child->data) != NULL) {
-                    if ((*(tpl_bin**)(child->data))->sz != 0) {
-                            tpl_hook.free( (*(tpl_bin**)(child->data))->addr );
-                    }
-                    tpl_hook.free(*(tpl_bin**)(child->data));  
-                }
+                tpl_free_bin(a, *(tpl_bin**)(child->data));
                 memcpy(child->data,&bin,sizeof(tpl_bin*));
                 if (datav) {
                     datav = tpl_cpv(datav, &bin, sizeof(tpl_bin*));
@@ -1854,7 +2881,7 @@ TPL_API int tpl_pack(tpl_node *r, int i) {
                   char **cdata = &((char**)child->data)[fidx];
                   slen = caddr ?  (strlen(caddr) + 1) : 0;
                   if (slen) {
-                    str = tpl_hook.malloc(slen);
+                    str = tpl_amalloc(a,slen);
                     if (!str) fatal_oom();
                     memcpy(str,caddr,slen); /* include \0 */
                   } else {
@@ -1862,7 +2889,7 @@ TPL_API int tpl_pack(tpl_node *r, int i) {
                   } 
                   /* now pack its pointer, first freeing any pre-existing string */
                   if (*cdata != NULL) {
-                      tpl_hook.free(*cdata);  
+                      tpl_afree(a,*cdata);  
                   }
                   memcpy(cdata,&str,sizeof(char*));
                   if (datav) {
@@ -1880,12 +2907,12 @@ TPL_API int tpl_pack(tpl_node *r, int i) {
                 if (datav) {
                     sz = ((tpl_atyp*)(child->data))->sz;
                     datav = tpl_cpv(datav, &child->data, sizeof(void*));
-                    child->data = tpl_hook.malloc(sizeof(tpl_atyp));
+                    child->data = tpl_amalloc(a,sizeof(tpl_atyp));
                     if (!child->data) fatal_oom();
                     ((tpl_atyp*)(child->data))->num = 0;
                     ((tpl_atyp*)(child->data))->sz = sz;
                     ((tpl_atyp*)(child->data))->bb = NULL;
-                    ((tpl_atyp*)(child->data))->bbtail = NULL;
+                    ((tpl_atyp*)(child->data))->cap = 0;
                 }
                 /* parent is array? then bubble up child array's ser_osz */
                 if (n->type == TPL_TYPE_ARY) {
@@ -1932,7 +2959,7 @@ TPL_API int tpl_pack(tpl_node *r, int i) {
                  }
                 break;
             default:
-                tpl_hook.fatal("unsupported format character\n");
+                TPL_HOOK.fatal("unsupported format character\n");
                 break;
         }
         child=child->next;
@@ -1940,46 +2967,18 @@ TPL_API int tpl_pack(tpl_node *r, int i) {
     return 0;
 }
 
-TPL_API int tpl_unpack(tpl_node *r, int i) {
-    tpl_node *n, *c, *np;
+/* unpack the image at dv into nodes c, c->next, ... up to (not including)
+ * stop; the run must hold any S(...)# group whole. returns the dv past it */
+static void *tpl_unpack_nodes(tpl_node *r, tpl_node *c, tpl_node *stop, void *dv) {
+    const tpl_alloc_t *a = tpl_alloc_of(r);
+    tpl_node *np;
     uint32_t slen;
-    int rc=1, fidx;
+    int fidx;
     char *str;
-    void *dv=NULL, *caddr;
     size_t A_bytes, itermax;
     tpl_pound_data *pd;
-    void *img;
-    size_t sz;
-
-
-    /* handle unusual case of tpl_pack,tpl_unpack without an 
-     * intervening tpl_dump. do a dump/load implicitly. */
-    if (((tpl_root_data*)(r->data))->flags & TPL_WRONLY) {
-        if (tpl_dump(r,TPL_MEM,&img,&sz) != 0) return -1;
-        if (tpl_load(r,TPL_MEM|TPL_UFREE,img,sz) != 0) {
-            tpl_hook.free(img);
-            return -1;
-        };
-    }
-
-    n = tpl_find_i(r,i);
-    if (n == NULL) {
-        tpl_hook.oops("invalid index %d to tpl_unpack\n", i);
-        return -1;
-    }
 
-    /* either root node or an A node */
-    if (n->type == TPL_TYPE_ROOT) {
-        dv = tpl_find_data_start( ((tpl_root_data*)(n->data))->mmap.text );
-    } else if (n->type == TPL_TYPE_ARY) {
-        if (((tpl_atyp*)(n->data))->num <= 0) return 0; /* array consumed */
-        else rc = ((tpl_atyp*)(n->data))->num--;
-        dv = ((tpl_atyp*)(n->data))->cur;
-        if (!dv) tpl_hook.fatal("must unpack parent of node before node itself\n");
-    }
-
-    c = n->children;
-    while (c) {
+    while (c != stop) {
         switch (c->type) {
             case TPL_TYPE_BYTE:
             case TPL_TYPE_DOUBLE:
@@ -1989,30 +2988,25 @@ TPL_API int tpl_unpack(tpl_node *r, int i) {
             case TPL_TYPE_UINT64:
             case TPL_TYPE_INT16:
             case TPL_TYPE_UINT16:
-                /* unpack elements of cross-endian octothorpic array individually */
-                if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN) {
-                    for(fidx=0; fidx < c->num; fidx++) {
-                        caddr = (void*)((uintptr_t)c->addr + (fidx * tpl_types[c->type].sz));
-                        memcpy(caddr,dv,tpl_types[c->type].sz);
-                        tpl_byteswap(caddr, tpl_types[c->type].sz);
-                        dv = (void*)((uintptr_t)dv + tpl_types[c->type].sz);
-                    }
-                } else {
-                    /* bulk unpack ok if not cross-endian */
-                    memcpy(c->addr, dv, tpl_types[c->type].sz * c->num);
-                    dv = (void*)((uintptr_t)dv + tpl_types[c->type].sz * c->num);
-                }
+                /* bulk unpack; a cross-endian octothorpic array is swapped as one run */
+                memcpy(c->addr, dv, tpl_types[c->type].sz * c->num);
+                if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
+                    tpl_byteswap_n(c->addr, tpl_types[c->type].sz, c->num);
+                dv = (void*)((uintptr_t)dv + tpl_types[c->type].sz * c->num);
                 break;
             case TPL_TYPE_BIN:
                 memcpy(&slen,dv,sizeof(uint32_t));
                 if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
                     tpl_byteswap(&slen, sizeof(uint32_t));
-                if (slen > 0) {
-                    str = (char*)tpl_hook.malloc(slen);
-                    if (!str) fatal_oom();
-                } else str=NULL;
                 dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
-                if (slen>0) memcpy(str,dv,slen);
+                if (slen == 0) str = NULL;
+                else if (((tpl_root_data*)(r->data))->flags & TPL_NOCOPY) {
+                    str = (char*)dv;  /* points into the image; not to be freed */
+                } else {
+                    str = (char*)tpl_amalloc(a,slen);
+                    if (!str) fatal_oom();
+                    memcpy(str,dv,slen);
+                }
                 memcpy(&(((tpl_bin*)c->addr)->addr),&str,sizeof(void*));
                 memcpy(&(((tpl_bin*)c->addr)->sz),&slen,sizeof(uint32_t));
                 dv = (void*)((uintptr_t)dv + slen);
@@ -2026,7 +3020,7 @@ TPL_API int tpl_unpack(tpl_node *r, int i) {
                     slen += 1;
                   dv = (void*)((uintptr_t)dv + sizeof(uint32_t));
                   if (slen) {  /* slen includes \0 */
-                    str = (char*)tpl_hook.malloc(slen);
+                    str = (char*)tpl_amalloc(a,slen);
                     if (!str) fatal_oom();
                     if (slen>1) memcpy(str,dv,slen-1);
                     str[slen-1] = '\0'; /* nul terminate */
@@ -2060,7 +3054,7 @@ TPL_API int tpl_unpack(tpl_node *r, int i) {
                 break;
             case TPL_TYPE_ARY:
                 if (tpl_serlen(r,c,dv, &A_bytes) == -1) 
-                    tpl_hook.fatal("internal error in unpack\n");
+                    TPL_HOOK.fatal("internal error in unpack\n");
                 memcpy( &((tpl_atyp*)(c->data))->num, dv, sizeof(uint32_t));
                 if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
                     tpl_byteswap(&((tpl_atyp*)(c->data))->num, sizeof(uint32_t));
@@ -2068,16 +3062,161 @@ TPL_API int tpl_unpack(tpl_node *r, int i) {
                 dv = (void*)((uintptr_t)dv + A_bytes);
                 break;
             default:
-                tpl_hook.fatal("unsupported format character\n");
+                TPL_HOOK.fatal("unsupported format character\n");
                 break;
         }
 
         c = c->next;
     }
+    return dv;
+}
+
+TPL_API int tpl_unpack(tpl_node *r, int i) {
+    tpl_node *n;
+    int rc=1;
+    void *dv=NULL;
+    void *img;
+    size_t sz;
+
+
+    /* handle unusual case of tpl_pack,tpl_unpack without an 
+     * intervening tpl_dump. do a dump/load implicitly. */
+    if (((tpl_root_data*)(r->data))->flags & TPL_WRONLY) {
+        if (tpl_dump(r,TPL_MEM,&img,&sz) != 0) return -1;
+        if (tpl_load(r,TPL_MEM|TPL_UFREE,img,sz) != 0) {
+            TPL_HOOK.free(img);
+            return -1;
+        };
+    }
+
+    n = tpl_find_i(r,i);
+    if (n == NULL) {
+        TPL_HOOK.oops("invalid index %d to tpl_unpack\n", i);
+        return -1;
+    }
+
+    /* either root node or an A node */
+    if (n->type == TPL_TYPE_ROOT) {
+        dv = tpl_find_data_start( ((tpl_root_data*)(n->data))->mmap.text );
+        ((tpl_root_data*)(n->data))->flags |= TPL_ROOT_UNPACKED;
+    } else if (n->type == TPL_TYPE_ARY) {
+        if (((tpl_atyp*)(n->data))->num <= 0) return 0; /* array consumed */
+        else rc = ((tpl_atyp*)(n->data))->num--;
+        dv = ((tpl_atyp*)(n->data))->cur;
+        if (!dv) TPL_HOOK.fatal("must unpack parent of node before node itself\n");
+    }
+
+    dv = tpl_unpack_nodes(r, n->children, NULL, dv);
     if (n->type == TPL_TYPE_ARY) ((tpl_atyp*)(n->data))->cur = dv; /* next element */
     return rc;
 }
 
+/* find A node i for a bulk pack or unpack: one of fixed width atoms */
+static tpl_node *tpl_find_flat(tpl_node *r, int i, const char *fcn) {
+    tpl_node *n;
+
+    n = tpl_find_i(r,i);
+    if ((n == NULL) || (n->type != TPL_TYPE_ARY)) {
+        TPL_HOOK.oops("invalid index %d to %s\n", i, fcn);
+        return NULL;
+    }
+    if (!tpl_atyp_flat(n)) {
+        TPL_HOOK.oops("%s: A(...) %d is not of fixed width types\n", fcn, i);
+        return NULL;
+    }
+    return n;
+}
+
+/* byteswap count datums of the fixed width A node n, in place */
+static void tpl_byteswap_atyp(tpl_node *n, void *buf, size_t count) {
+    tpl_node *c;
+    tpl_pound_data *pd;
+    char *dv = (char*)buf;
+    size_t k;
+
+    c = n->children;
+    if (c->next == NULL) { /* a single atom; swap it as one run */
+        tpl_byteswap_n(dv, tpl_types[c->type].sz, count * c->num);
+        return;
+    }
+    for(k=0; k < count; k++) {
+        c = n->children;
+        while (c) {
+            if (c->type == TPL_TYPE_POUND) {
+                pd = (tpl_pound_data*)c->data;
+                if (++(pd->iternum) < (size_t)c->num) {
+                    c = pd->iter_start_node;
+                    continue;
+                }
+                pd->iternum = 0;
+            } else {
+                tpl_byteswap_n(dv, tpl_types[c->type].sz, c->num);
+                dv += tpl_types[c->type].sz * c->num;
+            }
+            c = c->next;
+        }
+    }
+}
+
+/* pack count elements into A(...) i from src in one copy. the A must hold
+ * only fixed width types; src holds the elements back to back, as they are
+ * serialized (so for A(U), it is an array of uint64_t). returns count. */
+TPL_API int tpl_pack_n(tpl_node *r, int i, const void *src, uint32_t count) {
+    tpl_node *n;
+    tpl_atyp *at;
+    size_t sz;
+
+    if ( (n = tpl_find_flat(r, i, "tpl_pack_n")) == NULL) return -1;
+
+    if (((tpl_root_data*)(r->data))->flags & TPL_RDONLY) {
+        /* convert to an writeable tpl, initially empty */
+        tpl_free_keep_map(r);
+    }
+    ((tpl_root_data*)(r->data))->flags |= TPL_WRONLY;
+
+    at = (tpl_atyp*)n->data;
+    tpl_reserve_backbone(n, count);
+    sz = (size_t)count * at->sz;
+    if (sz) memcpy(at->bb + (size_t)at->num * at->sz, src, sz);
+    at->num += count;
+    n->ser_osz += sz;
+    return count;
+}
+
+/* unpack up to max elements of A(...) i into dst in one copy (swapping
+ * them if the image is cross-endian). the counterpart of tpl_pack_n.
+ * returns the number unpacked, 0 once the array is consumed, or -1 */
+TPL_API int tpl_unpack_n(tpl_node *r, int i, void *dst, uint32_t max) {
+    tpl_node *n;
+    tpl_atyp *at;
+    uint32_t count;
+    void *img;
+    size_t sz;
+
+    /* packed, but not dumped? do a dump/load implicitly, as tpl_unpack */
+    if (((tpl_root_data*)(r->data))->flags & TPL_WRONLY) {
+        if (tpl_dump(r,TPL_MEM,&img,&sz) != 0) return -1;
+        if (tpl_load(r,TPL_MEM|TPL_UFREE,img,sz) != 0) {
+            TPL_HOOK.free(img);
+            return -1;
+        };
+    }
+
+    if ( (n = tpl_find_flat(r, i, "tpl_unpack_n")) == NULL) return -1;
+    at = (tpl_atyp*)n->data;
+    if (at->num == 0) return 0; /* array consumed */
+    if (!at->cur) TPL_HOOK.fatal("must unpack parent of node before node itself\n");
+
+    count = (at->num < max) ? at->num : max;
+    sz = (size_t)count * at->sz;
+    memcpy(dst, at->cur, sz);
+    if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
+        tpl_byteswap_atyp(n, dst, count);
+    at->cur = (char*)at->cur + sz;
+    at->num -= count;
+    return count;
+}
+
 /* Specialized function that unpacks only the root's A nodes, after tpl_load  */
 static int tpl_unpackA0(tpl_node *r) {
     tpl_node *n, *c;
@@ -2136,7 +3275,7 @@ static int tpl_unpackA0(tpl_node *r) {
                 break;
             case TPL_TYPE_ARY:
                 if ( tpl_serlen(r,c,dv, &A_bytes) == -1) 
-                    tpl_hook.fatal("internal error in unpackA0\n");
+                    TPL_HOOK.fatal("internal error in unpackA0\n");
                 memcpy( &((tpl_atyp*)(c->data))->num, dv, sizeof(uint32_t));
                 if (((tpl_root_data*)(r->data))->flags & TPL_XENDIAN)
                     tpl_byteswap(&((tpl_atyp*)(c->data))->num, sizeof(uint32_t));
@@ -2144,7 +3283,7 @@ static int tpl_unpackA0(tpl_node *r) {
                 dv = (void*)((uintptr_t)dv + A_bytes);
                 break;
             default:
-                tpl_hook.fatal("unsupported format character\n");
+                TPL_HOOK.fatal("unsupported format character\n");
                 break;
         }
         c=c->next;
@@ -2164,6 +3303,219 @@ static void tpl_byteswap(void *word, int len) {
     }
 }
 
+/* scalar byteswap of count words of len bytes; buf need not be aligned */
+static void tpl_byteswap_scalar(char *w, int len, size_t count) {
+    size_t k;
+#ifdef __GNUC__
+    uint16_t w16;
+    uint32_t w32;
+    uint64_t w64;
+
+    switch (len) {
+      case 2:
+        for(k=0; k < count; k++, w += 2) {
+            memcpy(&w16,w,2); w16 = __builtin_bswap16(w16); memcpy(w,&w16,2);
+        }
+        return;
+      case 4:
+        for(k=0; k < count; k++, w += 4) {
+            memcpy(&w32,w,4); w32 = __builtin_bswap32(w32); memcpy(w,&w32,4);
+        }
+        return;
+      case 8:
+        for(k=0; k < count; k++, w += 8) {
+            memcpy(&w64,w,8); w64 = __builtin_bswap64(w64); memcpy(w,&w64,8);
+        }
+        return;
+    }
+#endif
+    for(k=0; k < count; k++, w += len) tpl_byteswap(w, len);
+}
+
+#ifdef TPL_SIMD_X86
+/* pshufb mask reversing each len-byte word of a 16 byte lane */
+static void tpl_bswap_mask(char mask[16], int len) {
+    int i;
+    for(i=0; i < 16; i++) mask[i] = (char)((i/len)*len + (len-1 - i%len));
+}
+
+__attribute__((target("ssse3")))
+static size_t tpl_byteswap_ssse3(char *w, int len, size_t count) {
+    char m[16];
+    __m128i mask, v;
+    size_t k, n = count * len / 16;
+
+    tpl_bswap_mask(m, len);
+    mask = _mm_loadu_si128((const __m128i*)m);
+    for(k=0; k < n; k++, w += 16) {
+        v = _mm_loadu_si128((const __m128i*)w);
+        _mm_storeu_si128((__m128i*)w, _mm_shuffle_epi8(v, mask));
+    }
+    return n * 16 / len; /* words done */
+}
+
+__attribute__((target("avx2")))
+static size_t tpl_byteswap_avx2(char *w, int len, size_t count) {
+    char m[16];
+    __m256i mask, v;
+    size_t k, n = count * len / 32;
+
+    tpl_bswap_mask(m, len);
+    mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)m));
+    for(k=0; k < n; k++, w += 32) {
+        v = _mm256_loadu_si256((const __m256i*)w);
+        _mm256_storeu_si256((__m256i*)w, _mm256_shuffle_epi8(v, mask));
+    }
+    return n * 32 / len;
+}
+#endif
+
+/* byteswap count words of len bytes each, in place. with pshufb where the
+ * cpu has it (len 2, 4 or 8, which divide the lanes evenly) */
+static void tpl_byteswap_n(void *buf, int len, size_t count) {
+    char *w = (char*)buf;
+    size_t done = 0;
+
+    if (len < 2) return;
+#ifdef TPL_SIMD_X86
+    if ((len == 2) || (len == 4) || (len == 8)) {
+        if (__builtin_cpu_supports("avx2")) done = tpl_byteswap_avx2(w, len, count);
+        else if (__builtin_cpu_supports("ssse3")) done = tpl_byteswap_ssse3(w, len, count);
+    }
+#endif
+    tpl_byteswap_scalar(w + done*len, len, count - done);
+}
+
+/* tables built on first use are published with release/acquire, where
+ * the compiler has it, so a thread that sees one ready sees all of it */
+#ifdef __GNUC__
+#define tpl_is_ready(f)   __atomic_load_n(&(f), __ATOMIC_ACQUIRE)
+#define tpl_set_ready(f)  __atomic_store_n(&(f), 1, __ATOMIC_RELEASE)
+#else
+#define tpl_is_ready(f)   (f)
+#define tpl_set_ready(f)  ((f) = 1)
+#endif
+
+#define TPL_CRC32C_POLY 0x82f63b78  /* Castagnoli, reflected */
+static uint32_t tpl_crc_tab[8][256];
+static volatile int tpl_crc_tab_ready;
+
+/* tables for slicing-by-8: tab[k][b] is the CRC of byte b followed by k 0s.
+ * threads racing to build them write the same values */
+static void tpl_crc32c_init(void) {
+    uint32_t c;
+    int i, j, k;
+
+    for(i=0; i < 256; i++) {
+        c = i;
+        for(j=0; j < 8; j++) c = (c >> 1) ^ (TPL_CRC32C_POLY & (0 - (c & 1)));
+        tpl_crc_tab[0][i] = c;
+    }
+    for(i=0; i < 256; i++)
+        for(k=1; k < 8; k++)
+            tpl_crc_tab[k][i] = (tpl_crc_tab[k-1][i] >> 8) ^ tpl_crc_tab[0][tpl_crc_tab[k-1][i] & 0xff];
+    tpl_set_ready(tpl_crc_tab_ready);
+}
+
+static uint32_t tpl_crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint32_t lo, hi;
+
+    for(; len >= 8; len -= 8, p += 8) {
+        lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = tpl_crc_tab[7][lo & 0xff] ^ tpl_crc_tab[6][(lo >> 8) & 0xff] ^
+              tpl_crc_tab[5][(lo >> 16) & 0xff] ^ tpl_crc_tab[4][lo >> 24] ^
+              tpl_crc_tab[3][hi & 0xff] ^ tpl_crc_tab[2][(hi >> 8) & 0xff] ^
+              tpl_crc_tab[1][(hi >> 16) & 0xff] ^ tpl_crc_tab[0][hi >> 24];
+    }
+    for(; len > 0; len--, p++) crc = tpl_crc_tab[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef TPL_SIMD_X86
+#ifdef __x86_64__
+/* crc32 has a latency of 3 cycles but issues every cycle, so long runs go
+ * as three lanes at once. tpl_crc_shift turns the CRC of a lane into what
+ * it becomes after another lane's worth of zeros, to join them up */
+#define TPL_CRC_LANE 4096
+static uint32_t tpl_crc_shift[4][256];
+static volatile int tpl_crc_shift_ready;
+
+__attribute__((target("sse4.2")))
+static void tpl_crc32c_shift_init(void) {
+    uint32_t basis[32], v;
+    uint64_t c;
+    int i, k, b;
+    size_t j;
+
+    for(i=0; i < 32; i++) { /* it is linear; find where each bit goes */
+        c = (uint32_t)1 << i;
+        for(j=0; j < TPL_CRC_LANE; j += 8) c = _mm_crc32_u64(c, 0);
+        basis[i] = (uint32_t)c;
+    }
+    for(k=0; k < 4; k++) {
+        for(b=0; b < 256; b++) {
+            for(v=0, i=0; i < 8; i++) if (b & (1 << i)) v ^= basis[8*k + i];
+            tpl_crc_shift[k][b] = v;
+        }
+    }
+    tpl_set_ready(tpl_crc_shift_ready);
+}
+
+static uint32_t tpl_crc32c_shift(uint32_t c) {
+    return tpl_crc_shift[0][c & 0xff] ^ tpl_crc_shift[1][(c >> 8) & 0xff] ^
+           tpl_crc_shift[2][(c >> 16) & 0xff] ^ tpl_crc_shift[3][c >> 24];
+}
+#endif
+
+__attribute__((target("sse4.2")))
+static uint32_t tpl_crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+#ifdef __x86_64__
+    uint64_t c = crc, c1, c2, w, w1, w2;
+    size_t j;
+
+    if ((len >= 3 * TPL_CRC_LANE) && !tpl_is_ready(tpl_crc_shift_ready)) tpl_crc32c_shift_init();
+    for(; len >= 3 * TPL_CRC_LANE; len -= 3 * TPL_CRC_LANE, p += 3 * TPL_CRC_LANE) {
+        c1 = c2 = 0;
+        for(j=0; j < TPL_CRC_LANE; j += 8) {
+            memcpy(&w, p + j, 8);
+            memcpy(&w1, p + TPL_CRC_LANE + j, 8);
+            memcpy(&w2, p + 2 * TPL_CRC_LANE + j, 8);
+            c = _mm_crc32_u64(c, w);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c = tpl_crc32c_shift(tpl_crc32c_shift((uint32_t)c) ^ (uint32_t)c1) ^ (uint32_t)c2;
+    }
+    for(; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = (uint32_t)c;
+#else
+    uint32_t w;
+    for(; len >= 4; len -= 4, p += 4) {
+        memcpy(&w, p, 4);
+        crc = _mm_crc32_u32(crc, w);
+    }
+#endif
+    for(; len > 0; len--, p++) crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#endif
+
+/* the CRC32C of len bytes at buf, continuing from crc (0 to begin). with
+ * the SSE4.2 crc32 instruction where the cpu has it */
+static uint32_t tpl_crc32c(uint32_t crc, const void *buf, size_t len) {
+    crc = ~crc;
+#ifdef TPL_SIMD_X86
+    if (__builtin_cpu_supports("sse4.2"))
+        return ~tpl_crc32c_sse42(crc, (const unsigned char*)buf, len);
+#endif
+    if (!tpl_is_ready(tpl_crc_tab_ready)) tpl_crc32c_init();
+    return ~tpl_crc32c_sw(crc, (const unsigned char*)buf, len);
+}
+
 static void tpl_fatal(const char *fmt, ...) {
     va_list ap;
     char exit_msg[100];
@@ -2172,7 +3524,7 @@ static void tpl_fatal(const char *fmt, ...) {
     vsnprintf(exit_msg, 100, fmt, ap);
     va_end(ap);
 
-    tpl_hook.oops("%s", exit_msg);
+    TPL_HOOK.oops("%s", exit_msg);
     exit(-1);
 }
 
@@ -2208,7 +3560,7 @@ TPL_API int tpl_gather(int mode, ...) {
             rc = tpl_gather_mem(addr,sz,gs,cb,data);
             break;
         default:
-            tpl_hook.fatal("unsupported tpl_gather mode %d\n",mode);
+            TPL_HOOK.fatal("unsupported tpl_gather mode %d\n",mode);
             break;
     }
     va_end(ap);
@@ -2220,68 +3572,67 @@ TPL_API int tpl_gather(int mode, ...) {
  * This is intended as a blocking call i.e. for use with a blocking fd.
  * It can be given a non-blocking fd, but the read spins if we have to wait.
  */
-static int tpl_gather_blocking(int fd, void **img, size_t *sz) {
-    char preamble[8];
-    int i=0, rc;
-    uint32_t tpllen;
+/* read n bytes from fd, retrying. returns 1, 0 at eof, or -1 on error */
+static int tpl_read_n(int fd, char *buf, size_t n) {
+    size_t i=0;
+    int rc;
 
     do { 
-        rc = read(fd,&preamble[i],8-i);
+        rc = read(fd,&buf[i],n-i);
         i += (rc>0) ? rc : 0;
-    } while ((rc==-1 && (errno==EINTR||errno==EAGAIN)) || (rc>0 && i<8));
+    } while ((rc==-1 && (errno==EINTR||errno==EAGAIN)) || (rc>0 && i<n));
 
     if (rc<0) {
-        tpl_hook.oops("tpl_gather_fd_blocking failed: %s\n", strerror(errno));
+        TPL_HOOK.oops("tpl_gather_fd_blocking failed: %s\n", strerror(errno));
         return -1;
-    } else if (rc == 0) {
-        /* tpl_hook.oops("tpl_gather_fd_blocking: eof\n"); */
+    } else if (i != n) {
+        /* TPL_HOOK.oops("tpl_gather_fd_blocking: eof\n"); */
         return 0;
-    } else if (i != 8) {
-        tpl_hook.oops("internal error\n");
-        return -1;
     }
+    return 1;
+}
+
+static int tpl_gather_blocking(int fd, void **img, size_t *sz) {
+    char preamble[4 + sizeof(uint64_t)];
+    int rc;
+    size_t pre;
+    uint64_t tpllen;
+
+    if ( (rc = tpl_read_n(fd,preamble,8)) <= 0) return rc;
 
     if (preamble[0] == 't' && preamble[1] == 'p' && preamble[2] == 'l') {
-        memcpy(&tpllen,&preamble[4],4);
-        if (tpl_needs_endian_swap(preamble)) tpl_byteswap(&tpllen,4);
+        /* a wide image has four more bytes of overall length */
+        if ((preamble[3] & TPL_FL_WIDE) &&
+            ((rc = tpl_read_n(fd,&preamble[8],4)) <= 0)) return rc;
+        pre = tpl_img_len(preamble,sizeof(preamble),&tpllen);
     } else {
-        tpl_hook.oops("tpl_gather_fd_blocking: non-tpl input\n");
+        TPL_HOOK.oops("tpl_gather_fd_blocking: non-tpl input\n");
+        return -1;
+    }
+    if ((tpllen < pre) || (tpllen > SIZE_MAX)) {
+        TPL_HOOK.oops("tpl_gather_fd_blocking: bad length\n");
         return -1;
     }
 
     /* malloc space for remainder of tpl image (overall length tpllen) 
      * and read it in
      */
-    if (tpl_hook.gather_max > 0 && 
-        tpllen > tpl_hook.gather_max) {
-        tpl_hook.oops("tpl exceeds max length %d\n", 
-            tpl_hook.gather_max);
+    if (TPL_HOOK.gather_max > 0 && 
+        tpllen > TPL_HOOK.gather_max) {
+        TPL_HOOK.oops("tpl exceeds max length %d\n", 
+            TPL_HOOK.gather_max);
         return -2;
     }
     *sz = tpllen;
-    if ( (*img = tpl_hook.malloc(tpllen)) == NULL) {
+    if ( (*img = TPL_HOOK.malloc(tpllen)) == NULL) {
         fatal_oom();
     }
 
-    memcpy(*img,preamble,8);  /* copy preamble to output buffer */
-    i=8;
-    do { 
-        rc = read(fd,&((*(char**)img)[i]),tpllen-i);
-        i += (rc>0) ? rc : 0;
-    } while ((rc==-1 && (errno==EINTR||errno==EAGAIN)) || (rc>0 && i<tpllen));
-
-    if (rc<0) {
-        tpl_hook.oops("tpl_gather_fd_blocking failed: %s\n", strerror(errno));
-        tpl_hook.free(*img);
-        return -1;
-    } else if (rc == 0) {
-        /* tpl_hook.oops("tpl_gather_fd_blocking: eof\n"); */
-        tpl_hook.free(*img);
-        return 0;
-    } else if (i != tpllen) {
-        tpl_hook.oops("internal error\n");
-        tpl_hook.free(*img);
-        return -1;
+    memcpy(*img,preamble,pre);  /* copy preamble to output buffer */
+    rc = tpl_read_n(fd,(char*)*img + pre,tpllen - pre);
+    if (rc <= 0) {
+        TPL_HOOK.free(*img);
+        return rc;
     }
 
     return 1;
@@ -2292,8 +3643,8 @@ static int tpl_gather_blocking(int fd, void **img, size_t *sz) {
 static int tpl_gather_nonblocking( int fd, tpl_gather_t **gs, tpl_gather_cb *cb, void *data) {
     char buf[TPL_GATHER_BUFLEN], *img, *tpl;
     int rc, keep_looping, cbrc=0;
-    size_t catlen;
-    uint32_t tpllen;
+    size_t catlen, pre;
+    uint64_t tpllen;
 
     while (1) {
         rc = read(fd,buf,TPL_GATHER_BUFLEN);
@@ -2301,19 +3652,19 @@ static int tpl_gather_nonblocking( int fd, tpl_gather_t **gs, tpl_gather_cb *cb,
             if (errno == EINTR) continue;  /* got signal during read, ignore */
             if (errno == EAGAIN) return 1; /* nothing to read right now */
             else {
-                tpl_hook.oops("tpl_gather failed: %s\n", strerror(errno));
+                TPL_HOOK.oops("tpl_gather failed: %s\n", strerror(errno));
                 if (*gs) {
-                    tpl_hook.free((*gs)->img);
-                    tpl_hook.free(*gs);
+                    TPL_HOOK.free((*gs)->img);
+                    TPL_HOOK.free(*gs);
                     *gs = NULL;
                 }
                 return -1;                 /* error, caller should close fd  */
             }
         } else if (rc == 0) {
             if (*gs) {
-                tpl_hook.oops("tpl_gather: partial tpl image precedes EOF\n");
-                tpl_hook.free((*gs)->img);
-                tpl_hook.free(*gs);
+                TPL_HOOK.oops("tpl_gather: partial tpl image precedes EOF\n");
+                TPL_HOOK.free((*gs)->img);
+                TPL_HOOK.free(*gs);
                 *gs = NULL;
             }
             return 0;                      /* EOF, caller should close fd */
@@ -2321,20 +3672,20 @@ static int tpl_gather_nonblocking( int fd, tpl_gather_t **gs, tpl_gather_cb *cb,
             /* concatenate any partial tpl from last read with new buffer */
             if (*gs) {
                 catlen = (*gs)->len + rc;
-                if (tpl_hook.gather_max > 0 && 
-                    catlen > tpl_hook.gather_max) {
-                    tpl_hook.free( (*gs)->img );
-                    tpl_hook.free( (*gs) );
+                if (TPL_HOOK.gather_max > 0 && 
+                    catlen > TPL_HOOK.gather_max) {
+                    TPL_HOOK.free( (*gs)->img );
+                    TPL_HOOK.free( (*gs) );
                     *gs = NULL;
-                    tpl_hook.oops("tpl exceeds max length %d\n", 
-                        tpl_hook.gather_max);
+                    TPL_HOOK.oops("tpl exceeds max length %d\n", 
+                        TPL_HOOK.gather_max);
                     return -2;              /* error, caller should close fd */
                 }
-                if ( (img = tpl_hook.realloc((*gs)->img, catlen)) == NULL) {
+                if ( (img = TPL_HOOK.realloc((*gs)->img, catlen)) == NULL) {
                     fatal_oom();
                 }
                 memcpy(img + (*gs)->len, buf, rc);
-                tpl_hook.free(*gs);
+                TPL_HOOK.free(*gs);
                 *gs = NULL;
             } else {
                 img = buf;
@@ -2345,15 +3696,19 @@ static int tpl_gather_nonblocking( int fd, tpl_gather_t **gs, tpl_gather_cb *cb,
             keep_looping = (tpl+8 < img+catlen) ? 1 : 0;
             while (keep_looping) {
                 if (strncmp("tpl", tpl, 3) != 0) {
-                    tpl_hook.oops("tpl prefix invalid\n");
-                    if (img != buf) tpl_hook.free(img);
-                    tpl_hook.free(*gs);
+                    TPL_HOOK.oops("tpl prefix invalid\n");
+                    if (img != buf) TPL_HOOK.free(img);
+                    TPL_HOOK.free(*gs);
                     *gs = NULL;
                     return -3; /* error, caller should close fd */
                 }
-                memcpy(&tpllen,&tpl[4],4);
-                if (tpl_needs_endian_swap(tpl)) tpl_byteswap(&tpllen,4);
-                if (tpl+tpllen <= img+catlen) {
+                pre = tpl_img_len(tpl,img+catlen-tpl,&tpllen);
+                if (pre == 0) keep_looping=0;  /* length not read in yet */
+                else if (tpllen < pre) {
+                    TPL_HOOK.oops("tpl length invalid\n");
+                    if (img != buf) TPL_HOOK.free(img);
+                    return -3; /* error, caller should close fd */
+                } else if (tpllen <= (uint64_t)(img+catlen-tpl)) {
                     cbrc = (cb)(tpl,tpllen,data);  /* invoke cb for tpl image */
                     tpl += tpllen;                 /* point to next tpl image */
                     if (cbrc < 0) keep_looping = 0;
@@ -2362,35 +3717,35 @@ static int tpl_gather_nonblocking( int fd, tpl_gather_t **gs, tpl_gather_cb *cb,
             } 
             /* check if app callback requested closure of tpl source */
             if (cbrc < 0) {
-                tpl_hook.oops("tpl_fd_gather aborted by app callback\n");
-                if (img != buf) tpl_hook.free(img);
-                if (*gs) tpl_hook.free(*gs);
+                TPL_HOOK.oops("tpl_fd_gather aborted by app callback\n");
+                if (img != buf) TPL_HOOK.free(img);
+                if (*gs) TPL_HOOK.free(*gs);
                 *gs = NULL;
                 return -4;
             }
             /* store any leftover, partial tpl fragment for next read */
             if (tpl == img && img != buf) {  
                 /* consumed nothing from img!=buf */
-                if ( (*gs = tpl_hook.malloc(sizeof(tpl_gather_t))) == NULL ) {
+                if ( (*gs = TPL_HOOK.malloc(sizeof(tpl_gather_t))) == NULL ) {
                     fatal_oom();
                 }
                 (*gs)->img = tpl;
                 (*gs)->len = catlen;
             } else if (tpl < img+catlen) {  
                 /* consumed 1+ tpl(s) from img!=buf or 0 from img==buf */
-                if ( (*gs = tpl_hook.malloc(sizeof(tpl_gather_t))) == NULL ) {
+                if ( (*gs = TPL_HOOK.malloc(sizeof(tpl_gather_t))) == NULL ) {
                     fatal_oom();
                 }
-                if ( ((*gs)->img = tpl_hook.malloc(img+catlen - tpl)) == NULL ) {
+                if ( ((*gs)->img = TPL_HOOK.malloc(img+catlen - tpl)) == NULL ) {
                     fatal_oom();
                 }
                 (*gs)->len = img+catlen - tpl;
                 memcpy( (*gs)->img, tpl, img+catlen - tpl);
                 /* free partially consumed concat buffer if used */
-                if (img != buf) tpl_hook.free(img); 
+                if (img != buf) TPL_HOOK.free(img); 
             } else {                        /* tpl(s) fully consumed */
                 /* free consumed concat buffer if used */
-                if (img != buf) tpl_hook.free(img); 
+                if (img != buf) TPL_HOOK.free(img); 
             }
         }
     } 
@@ -2400,26 +3755,26 @@ static int tpl_gather_nonblocking( int fd, tpl_gather_t **gs, tpl_gather_cb *cb,
 static int tpl_gather_mem( char *buf, size_t len, tpl_gather_t **gs, tpl_gather_cb *cb, void *data) {
     char *img, *tpl;
     int keep_looping, cbrc=0;
-    size_t catlen;
-    uint32_t tpllen;
+    size_t catlen, pre;
+    uint64_t tpllen;
 
     /* concatenate any partial tpl from last read with new buffer */
     if (*gs) {
         catlen = (*gs)->len + len;
-        if (tpl_hook.gather_max > 0 && 
-            catlen > tpl_hook.gather_max) {
-            tpl_hook.free( (*gs)->img );
-            tpl_hook.free( (*gs) );
+        if (TPL_HOOK.gather_max > 0 && 
+            catlen > TPL_HOOK.gather_max) {
+            TPL_HOOK.free( (*gs)->img );
+            TPL_HOOK.free( (*gs) );
             *gs = NULL;
-            tpl_hook.oops("tpl exceeds max length %d\n", 
-                tpl_hook.gather_max);
+            TPL_HOOK.oops("tpl exceeds max length %d\n", 
+                TPL_HOOK.gather_max);
             return -2;              /* error, caller should stop accepting input from source*/
         }
-        if ( (img = tpl_hook.realloc((*gs)->img, catlen)) == NULL) {
+        if ( (img = TPL_HOOK.realloc((*gs)->img, catlen)) == NULL) {
             fatal_oom();
         }
         memcpy(img + (*gs)->len, buf, len);
-        tpl_hook.free(*gs);
+        TPL_HOOK.free(*gs);
         *gs = NULL;
     } else {
         img = buf;
@@ -2430,15 +3785,19 @@ static int tpl_gather_mem( char *buf, size_t len, tpl_gather_t **gs, tpl_gather_
     keep_looping = (tpl+8 < img+catlen) ? 1 : 0;
     while (keep_looping) {
         if (strncmp("tpl", tpl, 3) != 0) {
-            tpl_hook.oops("tpl prefix invalid\n");
-            if (img != buf) tpl_hook.free(img);
-            tpl_hook.free(*gs);
+            TPL_HOOK.oops("tpl prefix invalid\n");
+            if (img != buf) TPL_HOOK.free(img);
+            TPL_HOOK.free(*gs);
             *gs = NULL;
             return -3; /* error, caller should stop accepting input from source*/
         }
-        memcpy(&tpllen,&tpl[4],4);
-        if (tpl_needs_endian_swap(tpl)) tpl_byteswap(&tpllen,4);
-        if (tpl+tpllen <= img+catlen) {
+        pre = tpl_img_len(tpl,img+catlen-tpl,&tpllen);
+        if (pre == 0) keep_looping=0;  /* length not read in yet */
+        else if (tpllen < pre) {
+            TPL_HOOK.oops("tpl length invalid\n");
+            if (img != buf) TPL_HOOK.free(img);
+            return -3; /* error, caller should stop accepting input from source*/
+        } else if (tpllen <= (uint64_t)(img+catlen-tpl)) {
             cbrc = (cb)(tpl,tpllen,data);  /* invoke cb for tpl image */
             tpl += tpllen;               /* point to next tpl image */
             if (cbrc < 0) keep_looping = 0;
@@ -2447,35 +3806,353 @@ static int tpl_gather_mem( char *buf, size_t len, tpl_gather_t **gs, tpl_gather_
     } 
     /* check if app callback requested closure of tpl source */
     if (cbrc < 0) {
-        tpl_hook.oops("tpl_mem_gather aborted by app callback\n");
-        if (img != buf) tpl_hook.free(img);
-        if (*gs) tpl_hook.free(*gs);
+        TPL_HOOK.oops("tpl_mem_gather aborted by app callback\n");
+        if (img != buf) TPL_HOOK.free(img);
+        if (*gs) TPL_HOOK.free(*gs);
         *gs = NULL;
         return -4;
     }
     /* store any leftover, partial tpl fragment for next read */
     if (tpl == img && img != buf) {  
         /* consumed nothing from img!=buf */
-        if ( (*gs = tpl_hook.malloc(sizeof(tpl_gather_t))) == NULL ) {
+        if ( (*gs = TPL_HOOK.malloc(sizeof(tpl_gather_t))) == NULL ) {
             fatal_oom();
         }
         (*gs)->img = tpl;
         (*gs)->len = catlen;
     } else if (tpl < img+catlen) {  
         /* consumed 1+ tpl(s) from img!=buf or 0 from img==buf */
-        if ( (*gs = tpl_hook.malloc(sizeof(tpl_gather_t))) == NULL ) {
+        if ( (*gs = TPL_HOOK.malloc(sizeof(tpl_gather_t))) == NULL ) {
             fatal_oom();
         }
-        if ( ((*gs)->img = tpl_hook.malloc(img+catlen - tpl)) == NULL ) {
+        if ( ((*gs)->img = TPL_HOOK.malloc(img+catlen - tpl)) == NULL ) {
             fatal_oom();
         }
         (*gs)->len = img+catlen - tpl;
         memcpy( (*gs)->img, tpl, img+catlen - tpl);
         /* free partially consumed concat buffer if used */
-        if (img != buf) tpl_hook.free(img); 
+        if (img != buf) TPL_HOOK.free(img); 
     } else {                        /* tpl(s) fully consumed */
         /* free consumed concat buffer if used */
-        if (img != buf) tpl_hook.free(img); 
+        if (img != buf) TPL_HOOK.free(img); 
     }
     return 1;
 }
+
+/* bytes the stream can take now: up to the length word while the image
+ * length is unknown, so as not to read past the image, then up to its end */
+static size_t tpl_stream_room(tpl_stream *s) {
+    uint64_t want;
+    size_t want_pre;
+
+    if (s->state >= TPL_STREAM_DONE) return 0;
+    if (s->pre == 0) {
+        want_pre = 4 + sizeof(uint32_t);
+        if ((s->have > 3) && (s->buf[3] & TPL_FL_WIDE)) want_pre = 4 + sizeof(uint64_t);
+        want = want_pre - s->have;
+    } else want = s->len - s->seen - s->have;
+    return (want < s->max - s->have) ? want : s->max - s->have;
+}
+
+/* checksum the image bytes at hand, up to its CRC, and keep the CRC */
+static void tpl_stream_sum(tpl_stream *s) {
+    uint64_t end = s->seen + s->have, body = s->len - sizeof(uint32_t), at;
+
+    for(at = (s->seen > body) ? s->seen : body; at < end; at++)
+        s->trailer[at - body] = s->buf[at - s->seen];
+    if (end > body) end = body;
+    if (end > s->summed) {
+        s->crc = tpl_crc32c(s->crc, s->buf + (s->summed - s->seen), end - s->summed);
+        s->summed = end;
+    }
+}
+
+static void tpl_stream_took(tpl_stream *s, size_t n) {
+    s->have += n;
+    if (s->pre == 0) {
+        if (s->have < 4) return;
+        if (memcmp(s->buf, TPL_MAGIC, 3) != 0) {
+            TPL_HOOK.oops("tpl_stream: non-tpl input\n");
+            s->state = TPL_STREAM_FAIL;
+            return;
+        }
+        if ((s->pre = tpl_img_len(s->buf, s->have, &s->len)) == 0) return;
+        s->intlflags = s->buf[3];
+        if (s->len <= s->pre + ((s->intlflags & TPL_FL_CRC) ? sizeof(uint32_t) : 0)) {
+            TPL_HOOK.oops("tpl_stream: bad length\n");
+            s->state = TPL_STREAM_FAIL;
+            return;
+        }
+    }
+    if (s->intlflags & TPL_FL_CRC) tpl_stream_sum(s);
+}
+
+/* advance as far as the bytes at hand allow. returns the index of the top
+ * level A whose element it unpacked, 0 at the end of the image, -1 on error
+ * or TPL_STREAM_MORE if it needs more of the image */
+static int tpl_stream_step(tpl_stream *s) {
+    tpl_node *r = s->r, *stop;
+    tpl_root_data *rd = (tpl_root_data*)(r->data);
+    char *dv;
+    uint64_t len64;
+    size_t len, need;
+    int rc, num_fxlens;
+    uint32_t crc;
+
+    rd->mmap.text = s->buf;      /* bounds the walks to the bytes at hand */
+    rd->mmap.text_sz = s->have;
+    for(;;) {
+        dv = s->buf + s->pos;
+        switch (s->state) {
+            case TPL_STREAM_PRE:
+                if (s->pre == 0) return TPL_STREAM_MORE;
+                tpl_fxlens(r,&num_fxlens);
+                need = s->pre + strlen(tpl_fmt(r)) + 1 + num_fxlens * sizeof(uint32_t);
+                if ((s->have < need) && (s->have < s->len)) return TPL_STREAM_MORE;
+                if ( (rc = tpl_preamble(r, 1, &len64, &len, &s->intlflags)) != 0) {
+                    if (rc == ERR_FMT_MISMATCH) TPL_HOOK.oops("tpl_stream: format signature mismatch\n");
+                    else if (rc == ERR_FLEN_MISMATCH) TPL_HOOK.oops("tpl_stream: array lengths mismatch\n");
+                    else TPL_HOOK.oops("tpl_stream: not a valid tpl image\n");
+                    return -1;
+                }
+                s->pos = len;
+                s->c = r->children;
+                s->state = TPL_STREAM_ROOT;
+                break;
+            case TPL_STREAM_ROOT:
+                if (s->c == NULL) { /* the data should end here */
+                    len64 = s->len - ((s->intlflags & TPL_FL_CRC) ? sizeof(uint32_t) : 0);
+                    if (!(s->intlflags & TPL_FL_INDEX) && (s->seen + s->pos != len64)) {
+                        TPL_HOOK.oops("tpl_stream: not a valid tpl image\n");
+                        return -1;
+                    }
+                    s->state = TPL_STREAM_TAIL;
+                } else if (s->c->type == TPL_TYPE_ARY) {
+                    if (s->have - s->pos < sizeof(uint32_t)) return TPL_STREAM_MORE;
+                    memcpy(&s->left, dv, sizeof(uint32_t));
+                    if (rd->flags & TPL_XENDIAN) tpl_byteswap(&s->left, sizeof(uint32_t));
+                    s->pos += sizeof(uint32_t);
+                    s->state = TPL_STREAM_ELT;
+                } else { /* the root's nodes up to its next A, all at once */
+                    for(stop = s->c; stop && (stop->type != TPL_TYPE_ARY); stop = stop->next) ;
+                    if (tpl_serlen_nodes(r, s->c, stop, dv, &len) == -1) return TPL_STREAM_MORE;
+                    tpl_unpack_nodes(r, s->c, stop, dv);
+                    s->pos += len;
+                    s->c = stop;
+                }
+                break;
+            case TPL_STREAM_ELT:
+                if (s->left == 0) {
+                    s->c = s->c->next;
+                    s->state = TPL_STREAM_ROOT;
+                    break;
+                }
+                if (tpl_serlen_n(r, s->c, dv, 1, &len) == -1) return TPL_STREAM_MORE;
+                tpl_unpack_nodes(r, s->c->children, NULL, dv);
+                s->pos += len;
+                s->left--;
+                return tpl_node_i(r, s->c);
+            case TPL_STREAM_TAIL: /* the rest: any index footer, and CRC */
+                s->pos = s->have;
+                if (s->seen + s->have < s->len) return TPL_STREAM_MORE;
+                if (s->intlflags & TPL_FL_CRC) {
+                    memcpy(&crc, s->trailer, sizeof(uint32_t));
+                    if (rd->flags & TPL_XENDIAN) tpl_byteswap(&crc, sizeof(uint32_t));
+                    if (crc != s->crc) {
+                        TPL_HOOK.oops("tpl_stream: checksum mismatch\n");
+                        return -1;
+                    }
+                }
+                s->state = TPL_STREAM_DONE;
+                return 0;
+            default:
+                return (s->state == TPL_STREAM_DONE) ? 0 : -1;
+        }
+    }
+}
+
+TPL_API tpl_stream *tpl_stream_new(tpl_node *r, int fd, size_t max) {
+    tpl_root_data *rd = (tpl_root_data*)(r->data);
+    tpl_stream *s;
+    int num_fxlens;
+
+    if (r->type != TPL_TYPE_ROOT) {
+        TPL_HOOK.oops("error: tpl_stream_new on non-root node\n");
+        return NULL;
+    }
+    tpl_fxlens(r,&num_fxlens);
+    if (max < 4 + sizeof(uint64_t) + strlen(tpl_fmt(r)) + 1 + num_fxlens * sizeof(uint32_t)) {
+        TPL_HOOK.oops("tpl_stream_new: max %zu is too small for the preamble\n", max);
+        return NULL;
+    }
+    if (rd->flags & (TPL_WRONLY|TPL_RDONLY)) {
+        /* already packed or loaded, so reset it as if newly mapped */
+        tpl_free_keep_map(r);
+    }
+    if ( (s = (tpl_stream*)TPL_HOOK.malloc(sizeof(tpl_stream))) == NULL) fatal_oom();
+    memset(s,0,sizeof(tpl_stream));
+    if ( (s->buf = (char*)TPL_HOOK.malloc(max)) == NULL) fatal_oom();
+    s->r = r;
+    s->fd = fd;
+    s->max = max;
+    s->state = TPL_STREAM_PRE;
+    rd->flags = TPL_RDONLY;
+    rd->index = NULL;
+    rd->nindex = 0;
+    return s;
+}
+
+TPL_API size_t tpl_stream_feed(tpl_stream *s, const void *buf, size_t sz) {
+    size_t n, taken=0;
+
+    while ((taken < sz) && ((n = tpl_stream_room(s)) > 0)) {
+        if (n > sz - taken) n = sz - taken;
+        memcpy(s->buf + s->have, (const char*)buf + taken, n);
+        tpl_stream_took(s, n);
+        taken += n;
+    }
+    return taken;
+}
+
+TPL_API int tpl_stream_next(tpl_stream *s) {
+    size_t n;
+    int rc;
+
+    for(;;) {
+        if (s->state == TPL_STREAM_FAIL) return -1;
+        rc = tpl_stream_step(s);
+        if (rc == -1) s->state = TPL_STREAM_FAIL;
+        if (rc != TPL_STREAM_MORE) return rc;
+
+        /* out of bytes: drop those used up, then get more */
+        if (s->pos) {
+            memmove(s->buf, s->buf + s->pos, s->have - s->pos);
+            s->seen += s->pos;
+            s->have -= s->pos;
+            s->pos = 0;
+        }
+        if (s->have == s->max) {
+            TPL_HOOK.oops("tpl_stream: element exceeds %zu bytes\n", s->max);
+            s->state = TPL_STREAM_FAIL;
+            return -1;
+        }
+        if (s->pre && (s->seen + s->have == s->len)) {
+            TPL_HOOK.oops("tpl_stream: not a valid tpl image\n");
+            s->state = TPL_STREAM_FAIL;
+            return -1;
+        }
+        if (s->fd == -1) return TPL_STREAM_MORE;
+
+        n = tpl_stream_room(s);
+        rc = read(s->fd, s->buf + s->have, n);
+        if (rc > 0) tpl_stream_took(s, rc);
+        else if (rc == 0) {
+            TPL_HOOK.oops("tpl_stream: eof on fd %d mid-image\n", s->fd);
+            s->state = TPL_STREAM_FAIL;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return TPL_STREAM_MORE;
+        } else if (errno != EINTR) {
+            TPL_HOOK.oops("tpl_stream: read failed: %s\n", strerror(errno));
+            s->state = TPL_STREAM_FAIL;
+        }
+    }
+}
+
+TPL_API void tpl_stream_free(tpl_stream *s) {
+    tpl_root_data *rd = (tpl_root_data*)(s->r->data);
+
+    if (rd->mmap.text == s->buf) {
+        rd->mmap.text = NULL;
+        rd->mmap.text_sz = 0;
+    }
+    TPL_HOOK.free(s->buf);
+    TPL_HOOK.free(s);
+}
+
+/* append the packed map to the log at fd as one frame (with a CRC, so a
+ * damaged frame is found on reading it back), then reset the map
+ * to pack the next record. the log is fdatasync'd whenever its end crosses
+ * a multiple of batch bytes: after every frame if batch is 1, or never if 0.
+ * a frame cut short by a failed write is truncated away */
+TPL_API int tpl_append(int fd, tpl_node *r, size_t batch) {
+    off_t start, end;
+
+    if ( (start = lseek(fd, 0, SEEK_END)) == -1) {
+        TPL_HOOK.oops("tpl_append: can't seek fd %d: %s\n", fd, strerror(errno));
+        return -1;
+    }
+    if (tpl_dump(r, TPL_FD|TPL_CRC, fd) != 0) return -1;
+    tpl_free_keep_map(r);
+    if (batch == 0) return 0;
+    if ( (end = lseek(fd, 0, SEEK_CUR)) == -1) {
+        TPL_HOOK.oops("tpl_append: can't seek fd %d: %s\n", fd, strerror(errno));
+        return -1;
+    }
+    if ((uint64_t)start / batch != (uint64_t)end / batch) {
+        if (fdatasync(fd) == -1) {
+            TPL_HOOK.oops("tpl_append: fdatasync failed on fd %d: %s\n", fd, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+TPL_API tpl_frames *tpl_frames_open(char *filename) {
+    tpl_frames *f;
+    struct stat stat_buf;
+
+    if ( (f = (tpl_frames*)TPL_HOOK.malloc(sizeof(tpl_frames))) == NULL) fatal_oom();
+    memset(f,0,sizeof(tpl_frames));
+    f->mmap.fd = -1;
+    if (stat(filename, &stat_buf) == -1) {
+        TPL_HOOK.oops("Couldn't stat file %s: %s\n", filename, strerror(errno));
+        TPL_HOOK.free(f);
+        return NULL;
+    }
+    /* an empty log has nothing to map */
+    if ((stat_buf.st_size > 0) && (tpl_mmap_file(filename, &f->mmap, 0) != 0)) {
+        TPL_HOOK.free(f);
+        return NULL;
+    }
+    return f;
+}
+
+/* load the next frame of the log into the map and return 1; the map points
+ * into the log until tpl_frames_close. returns 0 at the end of the log, or
+ * at a frame cut short (as by a crash while appending): one shorter than
+ * its length, or a last frame that does not load, its body never written.
+ * returns -1 if a frame before the last is corrupt. *off, if given, is where
+ * that frame starts: at the end of the log, the length of its whole frames,
+ * for the writer to truncate to */
+TPL_API int tpl_frames_next(tpl_frames *f, tpl_node *r, size_t *off) {
+    char *d = (char*)f->mmap.text + f->off;
+    size_t avail = f->mmap.text_sz - f->off, pre, i;
+    uint64_t len;
+
+    if (off) *off = f->off;
+    if (avail == 0) return 0;
+    pre = tpl_img_len(d, avail, &len);
+    if (memcmp(d, TPL_MAGIC, (avail < 3) ? avail : 3) != 0) {
+        /* a zero filled tail is space allocated to a frame never written */
+        for(i=0; (i < avail) && (d[i] == 0); i++) ;
+        if (i == avail) return 0;
+        TPL_HOOK.oops("tpl_frames: no frame at offset %zu\n", f->off);
+        return -1;
+    }
+    if ((pre == 0) || (len > avail)) {
+        TPL_HOOK.oops("tpl_frames: partial frame at offset %zu\n", f->off);
+        return 0;
+    }
+    if (tpl_load(r, TPL_MEM, d, (size_t)len) != 0) {
+        if (len < avail) return -1;
+        TPL_HOOK.oops("tpl_frames: torn frame at offset %zu\n", f->off);
+        return 0;
+    }
+    f->off += len;
+    return 1;
+}
+
+TPL_API void tpl_frames_close(tpl_frames *f) {
+    if (f->mmap.text) tpl_unmap_file(&f->mmap);
+    TPL_HOOK.free(f);
+}
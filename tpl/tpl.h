@@ -66,8 +66,32 @@ extern "C" {
 #define TPL_DATAPEEK  (1 << 6)  
 #define TPL_FXLENS    (1 << 7)  
 #define TPL_GETSIZE   (1 << 8)
+#define TPL_NOCOPY    (1 << 9)  /* B buffers point into the image (tpl_load) or
+                                   are packed by reference (tpl_pack_ex) */
+#define TPL_IOV       (1 << 10) /* tpl_dump into a struct iovec array */
+#define TPL_SINK      (1 << 11) /* tpl_dump in chunks to a callback */
+#define TPL_GROW      (1 << 12) /* with TPL_MEM, reuse and grow the caller's buffer */
+#define TPL_INDEX     (1 << 13) /* tpl_dump an index of top level A elements, for
+                                   tpl_seek; tpl_load trusting it for A lengths */
+#define TPL_FALLOCATE (1 << 14) /* TPL_FILE dump: reserve the file's blocks first */
+#define TPL_POPULATE  (1 << 15) /* TPL_FILE dump or load: fault the mapping in at once */
+#define TPL_WILLNEED  (1 << 16) /* TPL_FILE load: start reading it all ahead */
+#define TPL_HUGEPAGE  (1 << 17) /* TPL_FILE dump or load: ask for huge pages */
+#define TPL_STATS     (1 << 18) /* tpl_dump/tpl_load: time it, into a tpl_io_stats */
+#define TPL_CRC       (1 << 19) /* tpl_dump a CRC32C trailer; tpl_load checks it */
 /* do not add flags here without renumbering the internal flags! */
 
+/* dump modes beyond TPL_FILE/TPL_FD/TPL_MEM take these arguments:
+ *   tpl_dump(tn, TPL_IOV, struct iovec *iov, int *iovcnt)
+ *     *iovcnt is the size of iov, and becomes the number used (or needed,
+ *     if that was too few). the iovecs point into the map and its packed
+ *     B buffers, valid until the next tpl_pack, tpl_dump or tpl_free.
+ *   tpl_dump(tn, TPL_SINK, tpl_sink_cb *cb, void *data)
+ *   tpl_dump(tn, TPL_MEM|TPL_GROW, void **addr, size_t *sz, size_t *cap)
+ * with TPL_IOV and TPL_SINK, large B buffers go out by reference.
+ * with TPL_STATS, tpl_dump and tpl_load take a tpl_io_stats* after the
+ * other arguments, e.g. tpl_load(tn, TPL_FILE|TPL_STATS, "f.tpl", &st) */
+
 /* flags for tpl_gather mode */
 #define TPL_GATHER_BLOCKING    1
 #define TPL_GATHER_NONBLOCKING 2
@@ -89,6 +113,25 @@ typedef struct tpl_hook_t {
     size_t gather_max;
 } tpl_hook_t;
 
+/* tpl_hook applies to every thread; set it before starting any. a thread
+ * can have hooks and a gather_max of its own with tpl_set_hook(&h), until
+ * tpl_set_hook(NULL). otherwise maps share no mutable state, so threads
+ * can pack, dump, load and gather with maps of their own at once. a map
+ * from tpl_map allocates through the hooks of the thread calling into it;
+ * one passed between threads with different hooks wants tpl_map_ex.
+ * tpl_get_hook() gives the calling thread's hooks, to free through. */
+
+/* a per-map allocator, for tpl_map_ex. it allocates the map's nodes and
+ * backbones and the strings and buffers it packs and unpacks; ctx is passed
+ * to each call. unpacked strings and buffers are the caller's to release
+ * through it. images from tpl_dump and tpl_gather still use tpl_hook. */
+typedef struct tpl_alloc_t {
+    void *(*malloc)(void *ctx, size_t sz);
+    void *(*realloc)(void *ctx, void *ptr, size_t sz);
+    void (*free)(void *ctx, void *ptr);
+    void *ctx;
+} tpl_alloc_t;
+
 typedef struct tpl_node {
     int type;
     void *addr;
@@ -106,28 +149,81 @@ typedef struct tpl_bin {
     uint32_t sz;
 } tpl_bin;
 
+/* how long a TPL_STATS dump or load took; bytes is the image length */
+typedef struct tpl_io_stats {
+    size_t bytes;
+    double secs;
+    double bytes_per_sec;
+} tpl_io_stats;
+
 /* for async/piecemeal reading of tpl images */
 typedef struct tpl_gather_t {
     char *img;
-    int len;
+    size_t len;
 } tpl_gather_t;
 
+/* a format compiled once by tpl_schema_compile(fmt, # counts...), then
+ * mapped any number of times, from any thread, without parsing it again */
+typedef struct tpl_schema tpl_schema;
+
+/* a pull parser over an image arriving in pieces, holding at most max bytes
+ * of it: tpl_stream_new(tn, fd, max) reads fd as it needs to, or with fd -1,
+ * is given the image by tpl_stream_feed. tpl_stream_next unpacks the next
+ * element of a top level A(...) into its mapped variables and returns its
+ * index; any A's within it can be tpl_unpack'd until the next call. the
+ * root's other fields are unpacked as they arrive, ahead of any A after
+ * them. it returns 0 when the image is done, -1 on error (such as an
+ * element over max bytes) or TPL_STREAM_MORE for more input, from
+ * tpl_stream_feed or a nonblocking fd. tpl_stream_feed returns how much it
+ * took: less than offered when full, or at the end of the image. a TPL_CRC
+ * image is checked at its end, so its last call returns -1 if that fails */
+typedef struct tpl_stream tpl_stream;
+#define TPL_STREAM_MORE (-2)
+
+/* a log of images, one frame per tpl_append(fd, tn, batch), read back in
+ * order from its mapping by tpl_frames_next(f, tn, &off) */
+typedef struct tpl_frames tpl_frames;
+
 /* Callback used when tpl_gather has read a full tpl image */
 typedef int (tpl_gather_cb)(void *img, size_t sz, void *data);
 
+/* Callback that takes each chunk of a TPL_SINK dump. returns 0, or -1 to
+ * fail the dump. tpl_dump(tn, TPL_SINK, cb, data) */
+typedef int (tpl_sink_cb)(const void *buf, size_t sz, void *data);
+
 /* Prototypes */
 TPL_API tpl_node *tpl_map(char *fmt,...);       /* define tpl using format */
 TPL_API void tpl_free(tpl_node *r);             /* free a tpl map */
 TPL_API int tpl_pack(tpl_node *r, int i);       /* pack the n'th packable */
+TPL_API int tpl_pack_ex(tpl_node *r, int i, int flags); /* TPL_NOCOPY */
 TPL_API int tpl_unpack(tpl_node *r, int i);     /* unpack the n'th packable */
+TPL_API int tpl_pack_n(tpl_node *r, int i, const void *src, uint32_t count);
+TPL_API int tpl_unpack_n(tpl_node *r, int i, void *dst, uint32_t max);
 TPL_API int tpl_dump(tpl_node *r, int mode, ...); /* serialize to mem/file */
 TPL_API int tpl_load(tpl_node *r, int mode, ...); /* set mem/file to unpack */
 TPL_API int tpl_Alen(tpl_node *r, int i);      /* array len of packable i */
+TPL_API int tpl_seek(tpl_node *r, int i, uint32_t n); /* go to element n of A i, after tpl_unpack(r,0) */
 TPL_API char* tpl_peek(int mode, ...);         /* sneak peek at format string */
 TPL_API int tpl_gather( int mode, ...);        /* non-blocking image gather */
 TPL_API int tpl_jot(int mode, ...);            /* quick write a simple tpl */
+TPL_API tpl_stream *tpl_stream_new(tpl_node *r, int fd, size_t max); /* fd or -1 */
+TPL_API size_t tpl_stream_feed(tpl_stream *s, const void *buf, size_t sz);
+TPL_API int tpl_stream_next(tpl_stream *s);
+TPL_API void tpl_stream_free(tpl_stream *s);
+TPL_API int tpl_append(int fd, tpl_node *r, size_t batch); /* fdatasync every batch bytes */
+TPL_API tpl_frames *tpl_frames_open(char *filename);
+TPL_API int tpl_frames_next(tpl_frames *f, tpl_node *r, size_t *off);
+TPL_API void tpl_frames_close(tpl_frames *f);
+
+TPL_API void tpl_set_hook(const tpl_hook_t *h); /* this thread's, or NULL */
+TPL_API const tpl_hook_t *tpl_get_hook(void); /* this thread's, or &tpl_hook */
 
 TPL_API tpl_node *tpl_map_va(char *fmt, va_list ap);
+TPL_API tpl_node *tpl_map_ex(const tpl_alloc_t *alloc, char *fmt,...);
+TPL_API tpl_schema *tpl_schema_compile(char *fmt, ...);
+TPL_API tpl_node *tpl_map_from_schema(const tpl_schema *s, ...); /* pointers */
+TPL_API tpl_node *tpl_map_from_schema_ex(const tpl_alloc_t *alloc, const tpl_schema *s, ...);
+TPL_API void tpl_schema_free(tpl_schema *s);
 
 #if defined __cplusplus
     }
@@ -0,0 +1,446 @@
+/*
+Copyright (c) 2005-2013, Troy D. Hanson     http://troydhanson.github.com/tpl/
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef TPL_HPP
+#define TPL_HPP
+
+/* tpl images from C++, with the format fixed at compile time. the format
+ * is spelled as a type, one per format character:
+ *
+ *   typedef tpl::format<tpl::U, tpl::A<tpl::B> > msg_fmt;   // "UA(B)"
+ *   std::string img = msg_fmt::dump(cookie, bufs);
+ *   ok = msg_fmt::load(img.data(), img.size(), cookie, bufs);
+ *
+ * each character has a C++ type: i int32_t, u uint32_t, c char, I int64_t,
+ * U uint64_t, f double, j int16_t, v uint16_t, s and B std::string, and
+ * A<...> a std::vector of the one type within it, or of a std::tuple of
+ * them. values of any other type do not compile. the packing, unpacking
+ * and sizing are generated for the format, with no map to build or walk.
+ * the images are those of tpl_dump for the same format and values, so
+ * either side can tpl_load the other's. load also takes images with a
+ * TPL_INDEX footer or TPL_CRC trailer (checking the CRC), or from a host
+ * of the other endianness. S(...) and # are not supported; a NULL s loads
+ * as an empty string, and an s holding a NUL is cut there by tpl_load */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace tpl {
+
+/* the format characters */
+struct i; struct u; struct c; struct I; struct U;
+struct f; struct j; struct v; struct s; struct B;
+template <class... T> struct A;
+
+namespace detail {
+
+/* the flags byte after the magic prefix, as in tpl.c */
+enum {
+    FL_BIGENDIAN = 1 << 0,
+    FL_NULLSTRINGS = 1 << 1,
+    FL_WIDE = 1 << 2,
+    FL_INDEX = 1 << 3,
+    FL_CRC = 1 << 4,
+    SUPPORTED_BITFLAGS = 31
+};
+
+/* a format string, built up at compile time */
+template <char... C> struct chars {
+    static constexpr char str[sizeof...(C) + 1] = {C..., '\0'};
+};
+template <char... C> constexpr char chars<C...>::str[];
+
+template <class... S> struct cat;
+template <> struct cat<> { typedef chars<> type; };
+template <char... C> struct cat<chars<C...> > { typedef chars<C...> type; };
+template <char... C, char... D, class... S> struct cat<chars<C...>, chars<D...>, S...> {
+    typedef typename cat<chars<C..., D...>, S...>::type type;
+};
+
+template <bool... b> struct bools;
+template <bool... b> struct all
+    : std::is_same<bools<true, b...>, bools<b..., true> > {};
+template <bool... b> struct any
+    : std::integral_constant<bool, !all<!b...>::value> {};
+
+template <size_t... n> struct sum;
+template <> struct sum<> : std::integral_constant<size_t, 0> {};
+template <size_t n, size_t... m> struct sum<n, m...>
+    : std::integral_constant<size_t, n + sum<m...>::value> {};
+
+/* values match the format if their types are exactly those it maps to */
+template <class... T> struct list;
+template <class X, class Y> struct same_list : std::false_type {};
+template <class... X> struct same_list<list<X...>, list<X...> > : std::true_type {};
+
+template <size_t... k> struct seq {};
+template <size_t n, size_t... k> struct make_seq : make_seq<n - 1, n - 1, k...> {};
+template <size_t... k> struct make_seq<0, k...> { typedef seq<k...> type; };
+
+inline bool host_bigendian() {
+    const uint32_t one = 1;
+    char b;
+    memcpy(&b, &one, 1);
+    return b == 0;
+}
+
+inline void byteswap(void *word, size_t len) {
+    char *w = (char*)word, t;
+    size_t k;
+
+    for (k = 0; k < len / 2; k++) {
+        t = w[k];
+        w[k] = w[len - 1 - k];
+        w[len - 1 - k] = t;
+    }
+}
+
+inline uint32_t crc32c(const char *p, size_t n) {
+    struct table {
+        uint32_t t[256];
+        table() {
+            for (uint32_t k = 0; k < 256; k++) {
+                uint32_t c = k;
+                for (int b = 0; b < 8; b++) c = (c >> 1) ^ (0x82f63b78 & (0 - (c & 1)));
+                t[k] = c;
+            }
+        }
+    };
+    static const table tab;
+    uint32_t c = ~(uint32_t)0;
+
+    while (n--) c = tab.t[(c ^ (unsigned char)*p++) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+inline char *put_u32(char *p, uint32_t n) {
+    memcpy(p, &n, sizeof(n));
+    return p + sizeof(n);
+}
+
+/* the data of a loaded image, read front to back */
+struct reader {
+    const char *p, *end;
+    bool swap;          /* image is of the other endianness */
+    bool old_strings;   /* s lengths without the +1 of tpl 1.3 */
+
+    size_t left() const { return (size_t)(end - p); }
+    bool take(void *dst, size_t n) {
+        if (left() < n) return false;
+        if (n) memcpy(dst, p, n);
+        p += n;
+        return true;
+    }
+    template <class V> bool fixed(V &val) {
+        if (!take(&val, sizeof(val))) return false;
+        if (swap) byteswap(&val, sizeof(val));
+        return true;
+    }
+    bool bytes(std::string &str, size_t n) {
+        if (left() < n) return false;
+        str.assign(p, n);
+        p += n;
+        return true;
+    }
+};
+
+/* each format character: its C++ type, format string, and serialized
+ * size (fixed, or at least min_sz), and how to put and get a value */
+template <class T> struct field;
+
+template <class V, char C> struct fixed_field {
+    typedef V value_type;
+    typedef chars<C> fmt;
+    static const bool fixed = true;
+    static const bool has_s = false;
+    static const size_t fixed_sz = sizeof(V);
+    static const size_t min_sz = sizeof(V);
+    static size_t size(const V &) { return sizeof(V); }
+    static char *put(char *p, const V &val) {
+        memcpy(p, &val, sizeof(V));
+        return p + sizeof(V);
+    }
+    static bool get(reader &r, V &val) { return r.fixed(val); }
+};
+
+static_assert(sizeof(double) == 8, "tpl: f is an 8 byte double");
+template <> struct field<i> : fixed_field<int32_t, 'i'> {};
+template <> struct field<u> : fixed_field<uint32_t, 'u'> {};
+template <> struct field<c> : fixed_field<char, 'c'> {};
+template <> struct field<I> : fixed_field<int64_t, 'I'> {};
+template <> struct field<U> : fixed_field<uint64_t, 'U'> {};
+template <> struct field<f> : fixed_field<double, 'f'> {};
+template <> struct field<j> : fixed_field<int16_t, 'j'> {};
+template <> struct field<v> : fixed_field<uint16_t, 'v'> {};
+
+/* a length word, then the bytes */
+template <char C> struct bytes_field {
+    typedef std::string value_type;
+    typedef chars<C> fmt;
+    static const bool fixed = false;
+    static const bool has_s = (C == 's');
+    static const size_t fixed_sz = 0;
+    static const size_t min_sz = sizeof(uint32_t);
+    static size_t size(const std::string &str) { return sizeof(uint32_t) + str.size(); }
+    static char *put(char *p, const std::string &str) {
+        /* an s length counts a NUL, so that 0 can mean a NULL string */
+        p = put_u32(p, (uint32_t)str.size() + (C == 's' ? 1 : 0));
+        if (!str.empty()) memcpy(p, str.data(), str.size());
+        return p + str.size();
+    }
+    static bool get(reader &r, std::string &str) {
+        uint32_t n;
+
+        if (!r.fixed(n)) return false;
+        if ((C == 's') && !r.old_strings) {
+            if (n == 0) {
+                str.clear();
+                return true;
+            }
+            n--;
+        }
+        return r.bytes(str, n);
+    }
+};
+
+template <> struct field<s> : bytes_field<'s'> {};
+template <> struct field<B> : bytes_field<'B'> {};
+
+/* the field of the k'th format character */
+template <size_t k, class... T> struct pick;
+template <class T, class... U> struct pick<0, T, U...> { typedef field<T> type; };
+template <size_t k, class T, class... U> struct pick<k, T, U...> : pick<k - 1, U...> {};
+
+/* the element of an A: one field's value, or a tuple of them */
+template <class... T> struct elem;
+
+template <class T> struct elem<T> : field<T> {
+    static const bool flat = field<T>::fixed; /* vector is already serialized */
+};
+
+template <class T1, class T2, class... T> struct elem<T1, T2, T...> {
+    typedef std::tuple<typename field<T1>::value_type, typename field<T2>::value_type,
+                       typename field<T>::value_type...> value_type;
+    typedef typename make_seq<2 + sizeof...(T)>::type ks;
+    static const bool fixed = all<field<T1>::fixed, field<T2>::fixed, field<T>::fixed...>::value;
+    static const bool flat = false;
+    static const size_t fixed_sz = sum<field<T1>::fixed_sz, field<T2>::fixed_sz, field<T>::fixed_sz...>::value;
+    static const size_t min_sz = sum<field<T1>::min_sz, field<T2>::min_sz, field<T>::min_sz...>::value;
+
+    template <size_t... k> static size_t size_(const value_type &e, seq<k...>) {
+        size_t n = 0;
+        int x[] = {0, (n += pick<k, T1, T2, T...>::type::size(std::get<k>(e)), 0)...};
+        (void)x;
+        return n;
+    }
+    template <size_t... k> static char *put_(char *p, const value_type &e, seq<k...>) {
+        int x[] = {0, (p = pick<k, T1, T2, T...>::type::put(p, std::get<k>(e)), 0)...};
+        (void)x;
+        return p;
+    }
+    template <size_t... k> static bool get_(reader &r, value_type &e, seq<k...>) {
+        bool ok = true;
+        int x[] = {0, (ok = ok && pick<k, T1, T2, T...>::type::get(r, std::get<k>(e)), 0)...};
+        (void)x;
+        return ok;
+    }
+    static size_t size(const value_type &e) { return fixed ? fixed_sz : size_(e, ks()); }
+    static char *put(char *p, const value_type &e) { return put_(p, e, ks()); }
+    static bool get(reader &r, value_type &e) { return get_(r, e, ks()); }
+};
+
+/* a count, then the elements */
+template <class... T> struct field<A<T...> > {
+    typedef elem<T...> E;
+    typedef std::vector<typename E::value_type> value_type;
+    typedef typename cat<chars<'A', '('>, typename field<T>::fmt..., chars<')'> >::type fmt;
+    static const bool fixed = false;
+    static const bool has_s = any<field<T>::has_s...>::value;
+    static const size_t fixed_sz = 0;
+    static const size_t min_sz = sizeof(uint32_t);
+
+    static size_t size(const value_type &a) {
+        size_t n = sizeof(uint32_t), k;
+
+        if (E::fixed) return n + a.size() * E::fixed_sz;
+        for (k = 0; k < a.size(); k++) n += E::size(a[k]);
+        return n;
+    }
+    static char *put(char *p, const value_type &a) {
+        size_t k;
+
+        p = put_u32(p, (uint32_t)a.size());
+        if (E::flat) {
+            if (!a.empty()) memcpy(p, &a[0], a.size() * E::fixed_sz);
+            return p + a.size() * E::fixed_sz;
+        }
+        for (k = 0; k < a.size(); k++) p = E::put(p, a[k]);
+        return p;
+    }
+    static bool get(reader &r, value_type &a) {
+        uint32_t n;
+        size_t k;
+
+        if (!r.fixed(n)) return false;
+        if (n > r.left() / E::min_sz) return false; /* before sizing a */
+        a.resize(n);
+        if (E::flat) {
+            if (!r.take(n ? (void*)&a[0] : NULL, n * E::fixed_sz)) return false;
+            if (r.swap) for (k = 0; k < n; k++) byteswap(&a[k], E::fixed_sz);
+            return true;
+        }
+        for (k = 0; k < n; k++) if (!E::get(r, a[k])) return false;
+        return true;
+    }
+};
+
+/* the preamble: magic, flags, overall length, format and its NUL */
+inline size_t image_len(size_t fmtsz, size_t data) {
+    size_t n = 4 + sizeof(uint32_t) + fmtsz + data;
+    if ((uint64_t)n > UINT32_MAX) n += sizeof(uint64_t) - sizeof(uint32_t); /* wide */
+    return n;
+}
+
+inline char *put_preamble(char *p, size_t len, const char *fmt, size_t fmtsz, bool has_s) {
+    char flags = 0;
+    uint32_t len32 = (uint32_t)len;
+    uint64_t len64 = len;
+
+    if (host_bigendian()) flags |= FL_BIGENDIAN;
+    if (has_s) flags |= FL_NULLSTRINGS;
+    if ((uint64_t)len > UINT32_MAX) flags |= FL_WIDE;
+    memcpy(p, "tpl", 3);
+    p[3] = flags;
+    p += 4;
+    if (flags & FL_WIDE) {
+        memcpy(p, &len64, sizeof(len64));
+        p += sizeof(len64);
+    } else p = put_u32(p, len32);
+    memcpy(p, fmt, fmtsz);
+    return p + fmtsz;
+}
+
+/* check an image's preamble and trailers, and point r at its data */
+inline bool open_image(reader &r, const void *img, size_t sz, const char *fmt, size_t fmtsz) {
+    const char *d = (const char*)img, *end;
+    char flags;
+    uint32_t len32, crc;
+    uint64_t len, footer;
+
+    if ((sz < 4 + sizeof(uint32_t)) || (memcmp(d, "tpl", 3) != 0)) return false;
+    flags = d[3];
+    if (flags & ~SUPPORTED_BITFLAGS) return false;
+    r.swap = ((flags & FL_BIGENDIAN) != 0) != host_bigendian();
+    r.old_strings = !(flags & FL_NULLSTRINGS);
+    r.p = d + 4;
+    r.end = d + sz;
+    if (flags & FL_WIDE) {
+        if (!r.fixed(len)) return false;
+    } else {
+        if (!r.fixed(len32)) return false;
+        len = len32;
+    }
+    if (len != sz) return false;
+    end = d + sz;
+    if (flags & FL_CRC) {
+        if ((size_t)(end - r.p) < sizeof(crc)) return false;
+        end -= sizeof(crc);
+        memcpy(&crc, end, sizeof(crc));
+        if (r.swap) byteswap(&crc, sizeof(crc));
+        if (crc32c(d, end - d) != crc) return false;
+    }
+    if (flags & FL_INDEX) { /* the footer ends with its own length */
+        if ((size_t)(end - r.p) < sizeof(footer)) return false;
+        memcpy(&footer, end - sizeof(footer), sizeof(footer));
+        if (r.swap) byteswap(&footer, sizeof(footer));
+        if (footer > (uint64_t)(end - r.p)) return false;
+        end -= footer;
+    }
+    r.end = end;
+    if ((r.left() < fmtsz) || (memcmp(r.p, fmt, fmtsz) != 0)) return false;
+    r.p += fmtsz;
+    return true;
+}
+
+} /* namespace detail */
+
+/* a format, and the packing and unpacking made for it */
+template <class... F> struct format {
+    typedef typename detail::cat<typename detail::field<F>::fmt...>::type chars;
+    typedef detail::list<typename detail::field<F>::value_type...> types;
+    static const bool has_s = detail::any<detail::field<F>::has_s...>::value;
+
+    /* the format string, as tpl_map would take it */
+    static const char *str() { return chars::str; }
+
+    /* the length of the image of these values */
+    template <class... V> static size_t size(const V&... vals) {
+        static_assert(detail::same_list<detail::list<V...>, types>::value,
+                      "tpl::format: values do not match the format's types");
+        size_t n = 0;
+        int x[] = {0, (n += detail::field<F>::size(vals), 0)...};
+        (void)x;
+        return detail::image_len(sizeof(chars::str), n);
+    }
+
+    /* the image of these values into img, reusing its space */
+    template <class... V> static void dump_into(std::string &img, const V&... vals) {
+        size_t n = size(vals...);
+        char *p;
+
+        img.resize(n);
+        p = detail::put_preamble(&img[0], n, chars::str, sizeof(chars::str), has_s);
+        int x[] = {0, (p = detail::field<F>::put(p, vals), 0)...};
+        (void)x;
+    }
+
+    template <class... V> static std::string dump(const V&... vals) {
+        std::string img;
+        dump_into(img, vals...);
+        return img;
+    }
+
+    /* unpack the image of sz bytes at img into vals. returns false if it
+     * is not a whole, valid image of this format */
+    template <class... V> static bool load(const void *img, size_t sz, V&... vals) {
+        static_assert(detail::same_list<detail::list<V...>, types>::value,
+                      "tpl::format: values do not match the format's types");
+        detail::reader r;
+        bool ok;
+
+        if (!detail::open_image(r, img, sz, chars::str, sizeof(chars::str))) return false;
+        ok = true;
+        int x[] = {0, (ok = ok && detail::field<F>::get(r, vals), 0)...};
+        (void)x;
+        return ok && (r.p == r.end);
+    }
+};
+
+} /* namespace tpl */
+
+#endif /* TPL_HPP */